@@ -1,9 +1,10 @@
 #pragma once
 
+#include "Archive.h"
 #include "Common.h"
 #include "Hittable.h"
 
-class XYRect : public IHittable
+class XYRect final : public IHittable
 {
 public:
 	XYRect() {}
@@ -39,6 +40,27 @@ public:
 		return true;
 	}
 
+	bool Serialise(ArchiveWriter& Out) const
+	{
+		Out.Write(m_X0);
+		Out.Write(m_X1);
+		Out.Write(m_Y0);
+		Out.Write(m_Y1);
+		Out.Write(m_K);
+		Out.WriteMaterial(m_Material);
+		return true;
+	}
+
+	void Deserialise(ArchiveReader& In)
+	{
+		m_X0 = In.Read<float>();
+		m_X1 = In.Read<float>();
+		m_Y0 = In.Read<float>();
+		m_Y1 = In.Read<float>();
+		m_K = In.Read<float>();
+		m_Material = In.ReadMaterial();
+	}
+
 private:
 	float m_X0, m_X1;
 	float m_Y0, m_Y1;
@@ -46,7 +68,7 @@ private:
 	std::shared_ptr<Material> m_Material;
 };
 
-class YZRect : public IHittable
+class YZRect final : public IHittable
 {
 public:
 	YZRect() {}
@@ -82,6 +104,27 @@ public:
 		return true;
 	}
 
+	bool Serialise(ArchiveWriter& Out) const
+	{
+		Out.Write(m_Y0);
+		Out.Write(m_Y1);
+		Out.Write(m_Z0);
+		Out.Write(m_Z1);
+		Out.Write(m_K);
+		Out.WriteMaterial(m_Material);
+		return true;
+	}
+
+	void Deserialise(ArchiveReader& In)
+	{
+		m_Y0 = In.Read<float>();
+		m_Y1 = In.Read<float>();
+		m_Z0 = In.Read<float>();
+		m_Z1 = In.Read<float>();
+		m_K = In.Read<float>();
+		m_Material = In.ReadMaterial();
+	}
+
 private:
 	float m_Y0, m_Y1;
 	float m_Z0, m_Z1;
@@ -89,7 +132,7 @@ private:
 	std::shared_ptr<Material> m_Material;
 };
 
-class XZRect : public IHittable
+class XZRect final : public IHittable
 {
 public:
 	XZRect() {}
@@ -125,6 +168,27 @@ public:
 		return true;
 	}
 
+	bool Serialise(ArchiveWriter& Out) const
+	{
+		Out.Write(m_X0);
+		Out.Write(m_X1);
+		Out.Write(m_Z0);
+		Out.Write(m_Z1);
+		Out.Write(m_K);
+		Out.WriteMaterial(m_Material);
+		return true;
+	}
+
+	void Deserialise(ArchiveReader& In)
+	{
+		m_X0 = In.Read<float>();
+		m_X1 = In.Read<float>();
+		m_Z0 = In.Read<float>();
+		m_Z1 = In.Read<float>();
+		m_K = In.Read<float>();
+		m_Material = In.ReadMaterial();
+	}
+
 private:
 	float m_X0, m_X1;
 	float m_Z0, m_Z1;
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+class IHittable;
+class Material;
+class Texture;
+
+// The binary format SceneCache files are written in. Each type that can be stored has a Serialise that writes its
+// fields to an ArchiveWriter and a Deserialise that reads them back from an ArchiveReader: a member that fills in a
+// default-constructed object for geometry, which is kept by value, and a static that makes the object for materials
+// and textures, which are made from their fields. Materials and textures are written once into tables and referred
+// to by index, so sharing survives a round trip. Objects that hold other objects through an IHittable pointer write
+// them through ObjectWriter and read them through ObjectReader, which SceneCache provides since it knows every kind.
+class ArchiveWriter
+{
+public:
+	using ObjectWriterFunction = bool (*)(ArchiveWriter&, const std::shared_ptr<IHittable>&);
+
+	explicit ArchiveWriter(const ObjectWriterFunction ObjectWriter) : m_ObjectWriter(ObjectWriter) {}
+
+	template<typename T>
+	void Write(const T& Value)
+	{
+		static_assert(std::is_trivially_copyable_v<T>);
+		const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&Value);
+		Bytes.insert(Bytes.end(), bytes, bytes + sizeof(T));
+	}
+
+	template<typename T>
+	void WriteArray(const T* Values, const size_t Count)
+	{
+		static_assert(std::is_trivially_copyable_v<T>);
+		Write<uint64_t>(Count);
+		const uint8_t* bytes = reinterpret_cast<const uint8_t*>(Values);
+		Bytes.insert(Bytes.end(), bytes, bytes + (Count * sizeof(T)));
+	}
+
+	template<typename T, typename Allocator>
+	void WriteArray(const std::vector<T, Allocator>& Values) { WriteArray(Values.data(), Values.size()); }
+
+	void WriteString(const std::string& Value) { WriteArray(Value.data(), Value.size()); }
+
+	// Serialises each of Objects in turn, for arrays of objects that aren't trivially copyable.
+	template<typename T>
+	bool WriteEach(const std::vector<T>& Objects)
+	{
+		Write<uint64_t>(Objects.size());
+		for (const T& object : Objects)
+		{
+			if (!object.Serialise(*this))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Fails if Object is of a kind that can't be stored.
+	bool WriteObject(const std::shared_ptr<IHittable>& Object) { return m_ObjectWriter(*this, Object); }
+
+	void WriteMaterial(const std::shared_ptr<Material>& Mat) { WriteReference(Mat, Materials); }
+	void WriteTexture(const std::shared_ptr<Texture>& Tex) { WriteReference(Tex, Textures); }
+
+	std::vector<uint8_t> Bytes;
+	std::vector<std::shared_ptr<Material>> Materials;
+	std::vector<std::shared_ptr<Texture>> Textures;
+
+private:
+	template<typename T>
+	void WriteReference(const std::shared_ptr<T>& Object, std::vector<std::shared_ptr<T>>& Table)
+	{
+		const auto [entry, inserted] = m_Indices.try_emplace(Object.get(), static_cast<uint32_t>(Table.size()));
+		if (inserted)
+		{
+			Table.push_back(Object);
+		}
+		Write(entry->second);
+	}
+
+	ObjectWriterFunction m_ObjectWriter;
+	std::unordered_map<const void*, uint32_t> m_Indices;	//Into whichever of the two tables holds the object
+};
+
+// Reads from a payload in memory. Running off the end of it, or finding a reference to a material or texture that
+// doesn't exist, sets Failed rather than reading out of bounds; callers check it once they're done. Textures can
+// refer to textures anywhere in the table, so each is made through TextureReader the first time something refers to
+// it, from where TextureOffsets says it was written, which makes whatever it refers to in turn first.
+class ArchiveReader
+{
+public:
+	using ObjectReaderFunction = std::shared_ptr<IHittable> (*)(ArchiveReader&);
+	using TextureReaderFunction = std::shared_ptr<Texture> (*)(ArchiveReader&);
+
+	ArchiveReader(const uint8_t* Data, const size_t Size, const ObjectReaderFunction ObjectReader, const TextureReaderFunction TextureReader)
+		: m_Data(Data), m_Size(Size), m_ObjectReader(ObjectReader), m_TextureReader(TextureReader)
+	{}
+
+	template<typename T>
+	T Read()
+	{
+		T value{};
+		if (Failed || Position > m_Size || m_Size - Position < sizeof(T))
+		{
+			Failed = true;
+			return value;
+		}
+
+		std::memcpy(&value, m_Data + Position, sizeof(T));
+		Position += sizeof(T);
+		return value;
+	}
+
+	template<typename T, typename Allocator>
+	void ReadArray(std::vector<T, Allocator>& Out)
+	{
+		const uint64_t count = Read<uint64_t>();
+		if (Failed || count > m_Size || m_Size - Position < count * sizeof(T))
+		{
+			Failed = true;
+			return;
+		}
+
+		Out.resize(count);
+		std::memcpy(Out.data(), m_Data + Position, count * sizeof(T));
+		Position += count * sizeof(T);
+	}
+
+	// For fixed-size arrays, which must have been written with the same length.
+	template<typename T>
+	void ReadArray(T* Out, const size_t Count)
+	{
+		if (Read<uint64_t>() != Count || Failed || m_Size - Position < Count * sizeof(T))
+		{
+			Failed = true;
+			return;
+		}
+
+		std::memcpy(Out, m_Data + Position, Count * sizeof(T));
+		Position += Count * sizeof(T);
+	}
+
+	std::string ReadString()
+	{
+		std::vector<char> chars;
+		ReadArray(chars);
+		return std::string(chars.begin(), chars.end());
+	}
+
+	template<typename T>
+	void ReadEach(std::vector<T>& Objects)
+	{
+		const uint64_t count = Read<uint64_t>();
+		if (Failed || count > m_Size)
+		{
+			Failed = true;
+			return;
+		}
+
+		Objects.resize(count);
+		for (T& object : Objects)
+		{
+			object.Deserialise(*this);
+		}
+	}
+
+	std::shared_ptr<IHittable> ReadObject() { return m_ObjectReader(*this); }
+
+	std::shared_ptr<Material> ReadMaterial() { return ReadReference(Materials); }
+	std::shared_ptr<Texture> ReadTexture()
+	{
+		const uint32_t idx = Read<uint32_t>();
+		if (!Failed && idx < TextureOffsets.size() && !Textures[idx])
+		{
+			//Pointing the offset past the end first means a texture that somehow refers to itself fails to read
+			const size_t resume = Position;
+			Position = TextureOffsets[idx];
+			TextureOffsets[idx] = m_Size;
+			Textures[idx] = m_TextureReader(*this);
+			Position = resume;
+		}
+
+		if (Failed || idx >= Textures.size() || !Textures[idx])
+		{
+			Failed = true;
+			return nullptr;
+		}
+		return Textures[idx];
+	}
+
+	size_t Position = 0;
+	bool Failed = false;
+	std::vector<std::shared_ptr<Material>> Materials;
+	std::vector<std::shared_ptr<Texture>> Textures;	//The same length as TextureOffsets, filled in as they're read
+	std::vector<uint64_t> TextureOffsets;
+
+private:
+	template<typename T>
+	std::shared_ptr<T> ReadReference(const std::vector<std::shared_ptr<T>>& Table)
+	{
+		const uint32_t idx = Read<uint32_t>();
+		if (Failed || idx >= Table.size() || !Table[idx])
+		{
+			Failed = true;
+			return nullptr;
+		}
+		return Table[idx];
+	}
+
+	const uint8_t* m_Data;
+	size_t m_Size;
+	ObjectReaderFunction m_ObjectReader;
+	TextureReaderFunction m_TextureReader;
+};
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+// Statistics for judging the BVHs: the shape of a built tree, and how much work rays cost it during a render,
+// broken down by bounce. Counting only happens when RAYTRACER_BVH_STATS is defined; otherwise BVH_STAT expands to
+// nothing, so traversal carries no trace of it.
+#ifdef RAYTRACER_BVH_STATS
+	#define BVH_STAT(Statement) Statement
+#else
+	#define BVH_STAT(Statement)
+#endif
+
+namespace BVHStats
+{
+	//Bounces beyond the last are counted with it
+	constexpr int MaxBounces = 64;
+
+	struct TreeShape
+	{
+		size_t Nodes = 0;
+		size_t Leaves = 0;
+		int MaxDepth = 0;
+		double AverageLeafDepth = 0.0;
+		float Cost = 0.0f;
+		std::vector<size_t> LeafSizes;		//How many leaves hold each number of objects
+		std::vector<double> OverlapByDepth;	//Mean surface area shared by an inner node's children, relative to the node's
+	};
+
+	struct Work
+	{
+		uint64_t Rays = 0;
+		uint64_t Nodes = 0;			//Visited, counting a packet's visit once for each of its rays
+		uint64_t Boxes = 0;			//Child boxes tested against a ray
+		uint64_t Primitives = 0;	//Primitives or sphere blocks tested against a ray
+	};
+
+	struct Totals
+	{
+		std::array<Work, MaxBounces> Bounces{};
+
+		void Add(const Totals& Other)
+		{
+			for (int bounce = 0; bounce < MaxBounces; bounce++)
+			{
+				Bounces[bounce].Rays += Other.Bounces[bounce].Rays;
+				Bounces[bounce].Nodes += Other.Bounces[bounce].Nodes;
+				Bounces[bounce].Boxes += Other.Bounces[bounce].Boxes;
+				Bounces[bounce].Primitives += Other.Bounces[bounce].Primitives;
+			}
+		}
+	};
+
+	inline std::mutex& SharedMutex()
+	{
+		static std::mutex mutex;
+		return mutex;
+	}
+
+	inline Totals& Shared()
+	{
+		static Totals totals;
+		return totals;
+	}
+
+	// Each thread counts into its own totals and hands them over when it exits, so counting never contends.
+	struct ThreadTotals : Totals
+	{
+		int Bounce = 0;
+
+		~ThreadTotals()
+		{
+			const std::lock_guard<std::mutex> lock(SharedMutex());
+			Shared().Add(*this);
+		}
+	};
+
+	inline ThreadTotals& Local()
+	{
+		thread_local ThreadTotals totals;
+		return totals;
+	}
+
+	// Starts Count rays on Bounce. Everything traversal does until the next call is counted against that bounce.
+	inline void BeginRays(const int Bounce, const size_t Count = 1)
+	{
+		ThreadTotals& local = Local();
+		local.Bounce = std::min(Bounce, MaxBounces - 1);
+		local.Bounces[local.Bounce].Rays += Count;
+	}
+
+	inline void CountNodes(const uint32_t Lanes = 1u) { Local().Bounces[Local().Bounce].Nodes += std::popcount(Lanes); }
+	inline void CountBoxes(const int Boxes, const uint32_t Lanes = 1u) { Local().Bounces[Local().Bounce].Boxes += static_cast<uint64_t>(Boxes) * std::popcount(Lanes); }
+	inline void CountPrimitives(const uint32_t Lanes = 1u) { Local().Bounces[Local().Bounce].Primitives += std::popcount(Lanes); }
+
+	// Everything counted so far by threads that have exited and by the calling one, whose counts are moved over.
+	// Call it once the render's threads have been joined.
+	inline Totals Collect()
+	{
+		const std::lock_guard<std::mutex> lock(SharedMutex());
+		ThreadTotals& local = Local();
+		Shared().Add(local);
+		local.Bounces = {};
+		return Shared();
+	}
+
+	inline void WriteJson(std::ostream& Out, const TreeShape& Shape, const Totals& Traced)
+	{
+		auto writeList = [&](const auto& Values)
+		{
+			Out << '[';
+			for (size_t idx = 0; idx < Values.size(); idx++)
+			{
+				Out << (idx > 0 ? ", " : "") << Values[idx];
+			}
+			Out << ']';
+		};
+
+		Out << "{\n  \"tree\": {\n"
+			<< "    \"nodes\": " << Shape.Nodes << ",\n"
+			<< "    \"leaves\": " << Shape.Leaves << ",\n"
+			<< "    \"maxDepth\": " << Shape.MaxDepth << ",\n"
+			<< "    \"averageLeafDepth\": " << Shape.AverageLeafDepth << ",\n"
+			<< "    \"sahCost\": " << Shape.Cost << ",\n"
+			<< "    \"leafSizes\": ";
+		writeList(Shape.LeafSizes);
+		Out << ",\n    \"overlapByDepth\": ";
+		writeList(Shape.OverlapByDepth);
+		Out << "\n  },\n  \"bounces\": [";
+
+		bool first = true;
+		for (int bounce = 0; bounce < MaxBounces; bounce++)
+		{
+			const Work& counts = Traced.Bounces[bounce];
+			if (counts.Rays == 0)
+			{
+				continue;
+			}
+
+			const double rays = static_cast<double>(counts.Rays);
+			Out << (first ? "\n" : ",\n") << "    { \"bounce\": " << bounce << ", \"rays\": " << counts.Rays
+				<< ", \"nodesPerRay\": " << counts.Nodes / rays << ", \"boxesPerRay\": " << counts.Boxes / rays
+				<< ", \"primitivesPerRay\": " << counts.Primitives / rays << " }";
+			first = false;
+		}
+		Out << (first ? "]\n}\n" : "\n  ]\n}\n");
+	}
+}
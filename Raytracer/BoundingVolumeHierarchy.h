@@ -1,11 +1,25 @@
 #pragma once
 
+#include "Archive.h"
+#include "BVHStats.h"
 #include "Common.h"
 #include "Hittable.h"
 #include "HittableList.h"
+#include "PageAllocator.h"
+#include "PrimitiveStore.h"
+#include "QuantizedNode.h"
+#include "RayPacket.h"
 
 #include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cstdint>
 #include <iostream>
+#include <map>
+#include <numeric>
+#include <span>
+#include <utility>
+#include <vector>
 
 inline bool BoxCompare(const std::shared_ptr<IHittable> A, const std::shared_ptr<IHittable> B, const int Axis)
 {
@@ -19,95 +33,1399 @@ inline bool BoxCompare(const std::shared_ptr<IHittable> A, const std::shared_ptr
 	return BoxA.Min()[Axis] < BoxB.Min()[Axis];
 }
 
-inline bool BoxXCompare(const std::shared_ptr<IHittable> A, const std::shared_ptr<IHittable> B)
+// Built top-down and stored as a flat array of nodes in depth-first order, so traversal walks an explicit stack
+// instead of recursing through virtual calls. Leaves index into a PrimitiveStore, which keeps copies of the scene's
+// primitives in per-type arrays.
+//
+// The BuildMethod picks how nodes are split. Median halves each node along a random axis. BinnedSAH sorts the
+// objects' centres into bins along each axis and takes the cut the surface area heuristic rates cheapest. Spatial
+// builds an SBVH: as well as dividing the objects it may cut space itself, so an object straddling the plane goes
+// into both children with its box clipped to each side. A huge object like a ground sphere then only inflates the
+// nodes it really reaches, instead of every node on its way down. Duplicated references cost memory, so spatial splits
+// stop once they have added SpatialSplitBudget of the object count, and are only tried where the best object split
+// leaves children that overlap. Moving objects are never clipped, since a clipped box wouldn't interpolate to cover
+// them; a straddling one goes into both children whole.
+//
+// When built over a shutter interval, every node keeps its bounds at both ends of it and a ray tests the box
+// interpolated to its own time, rather than one box swept over the whole interval. Moving primitives move linearly,
+// so the interpolated box of a group still contains all of them. For long intervals the shutter can also be cut into
+// TimeSegments slices, each with its own tree whose nodes only have to cover the motion within that slice. The
+// primitives themselves are stored once and shared by every slice, and so is a sphere block wherever two slices
+// group the same spheres together; a slice that groups them differently adds blocks of its own, which Stats counts
+// in StoreBytes.
+//
+// For animation a tree built Refittable keeps the objects it was built from. Replace swaps one for its next frame's
+// version and Refit updates the store's copies in place and brings the bounds up to date in one linear pass, keeping
+// the shape of the tree. Objects that move around a lot leave a refitted tree with big overlapping nodes, so Refit
+// compares the tree's surface area cost against what it was when built and rebuilds from scratch once it has got too
+// much worse. Refitting drops the clipping of spatial splits, which is still correct but looser. Other trees let go
+// of their objects once built, since the store has copies of them; Replace, Refit and Rebuild on those, and on trees
+// loaded from a SceneCache, are mistakes and say so.
+//
+// Once built, the binary nodes are collapsed into quantized nodes with four children each, and rays only ever traverse
+// those: QuantizedNodes of one cache line for trees that don't move, and MovingQuantizedNodes of two, with both of
+// each child's boxes, for trees that do. Only Refittable trees keep the binary nodes, which Refit works on; the rest
+// let go of them along with their objects.
+//
+// Built depth-first, the nodes along one path to a leaf end up spread across the whole array. So the quantized nodes
+// are laid out again in treelets of the nodes under one root that a ray is most likely to visit, each within a single
+// page: the arrays start on a page boundary, and a treelet that wouldn't fit in what's left of a page starts the
+// next one instead. Traversal also prefetches each node it puts off for later, so it's already on its way into the
+// cache by the time it comes off the stack.
+class BoundingVolumeHierarchy : public IHittable
 {
-	return BoxCompare(A, B, 0);
-}
+public:
+	enum class BuildMethod { Median, BinnedSAH, Spatial };
 
-inline bool BoxYCompare(const std::shared_ptr<IHittable> A, const std::shared_ptr<IHittable> B)
-{
-	return BoxCompare(A, B, 1);
-}
+	//What trees are built with when the constructor isn't told. Median draws its split axes from the random generator,
+	//so a scene that keeps generating after building a tree comes out differently under the other methods.
+	inline static BuildMethod DefaultBuildMethod = BuildMethod::Median;
 
-inline bool BoxZCompare(const std::shared_ptr<IHittable> A, const std::shared_ptr<IHittable> B)
-{
-	return BoxCompare(A, B, 2);
-}
+	//How many references spatial splits may add, as a fraction of the number of objects
+	static constexpr float SpatialSplitBudget = 0.3f;
+
+	enum class NodeLayout { DepthFirst, Treelets };
+
+	//How quantized nodes are ordered in memory. This only moves nodes around, so rays visit the same ones either way
+	inline static NodeLayout DefaultLayout = NodeLayout::Treelets;
+
+	//Whether trees keep the objects they were built from, for Replace, Refit and Rebuild, when the constructor isn't told
+	inline static bool DefaultRefittable = false;
+
+	//Quantized nodes of a type per treelet, enough to fill a page
+	template<typename NodeType>
+	static constexpr size_t TreeletNodes = PageAllocator<NodeType>::PageSize / sizeof(NodeType);
+	static_assert(PageAllocator<QuantizedNode>::PageSize % sizeof(MovingQuantizedNode) == 0, "Pages should hold whole nodes");
 
-class BoundingVolumeHierarchy : public IHittable
-{
-public:
 	BoundingVolumeHierarchy() {}
-	BoundingVolumeHierarchy(const HittableList& List, const float T0 = 0.0f, const float T1 = 0.0f)
-		: BoundingVolumeHierarchy(List.Objects(), 0, List.Objects().size(), T0, T1)
-	{}
-	BoundingVolumeHierarchy(const std::vector<std::shared_ptr<IHittable>>& Objects, const size_t Start, const size_t End, const float T0, const float T1)
+	BoundingVolumeHierarchy(const HittableList& List, const float T0 = 0.0f, const float T1 = 0.0f, const int TimeSegments = 1,
+		const BuildMethod Method = DefaultBuildMethod, const bool Refittable = DefaultRefittable)
+		: m_Objects(List.Objects()), m_Refittable(Refittable), m_T0(T0), m_T1(T1), m_TimeSegments(T1 > T0 ? std::clamp(TimeSegments, 1, m_MaxSegments) : 1),
+		m_Method(Method)
 	{
-		std::vector<std::shared_ptr<IHittable>> objects = Objects; //Modifiable copy
+		Rebuild();
+	}
 
-		int axis = Common::RandomInt(0, 2);
-		auto comparator = (axis == 0) ? BoxXCompare :
-						  (axis == 1) ? BoxYCompare :
-										BoxZCompare;
+	// Whether the tree still has the objects it was built from.
+	bool Refittable() const { return m_Refittable && !m_Objects.empty(); }
 
-		size_t objectSpan = End - Start;
+	// Puts Replacement where the ObjectIdx'th object of the list the tree was built from was. Nothing changes
+	// for rays until the next Refit.
+	void Replace(const size_t ObjectIdx, std::shared_ptr<IHittable> Replacement)
+	{
+		if (RequireObjects("Replace"))
+		{
+			m_Objects[ObjectIdx] = std::move(Replacement);
+		}
+	}
+
+	// Copies the objects' current state over their copies in the store and recomputes every node's bounds, leaves
+	// first. Returns true when the tree was rebuilt instead: because it had degraded past RebuildThreshold, or because
+	// an object was replaced by one of another type, which its copy has no room for.
+	bool Refit()
+	{
+		if (!RequireObjects("Refit") || m_Nodes.empty())
+		{
+			return false;
+		}
 
-		if (objectSpan == 1)
+		for (size_t idx = 0; idx < m_Objects.size(); idx++)
 		{
-			m_Left = objects[Start];
-			m_Right = objects[Start];
+			if (m_ObjectTags[idx] != m_Untagged && !m_Store.Update(m_ObjectTags[idx], m_Objects[idx]))
+			{
+				Rebuild();
+				return true;
+			}
 		}
-		else if (objectSpan == 2)
+
+		std::shared_ptr<IHittable> spheres[SphereBlock::Width];
+		for (const auto& [objects, tag] : m_BlockTags)
 		{
-			if (comparator(objects[Start], objects[Start + 1]))
+			for (size_t idx = 0; idx < objects.size(); idx++)
 			{
-				m_Left = objects[Start];
-				m_Right = objects[Start + 1];
+				spheres[idx] = m_Objects[objects[idx]];
 			}
-			else
+			if (!m_Store.UpdateSphereBlock(tag, std::span(spheres, objects.size())))
+			{
+				Rebuild();
+				return true;
+			}
+		}
+
+		for (size_t segment = 0; segment < m_Roots.size(); segment++)
+		{
+			const auto [start, end] = SegmentTimes(static_cast<int>(segment));
+			const uint32_t first = m_Roots[segment];
+			const uint32_t last = segment + 1 < m_Roots.size() ? m_Roots[segment + 1] : static_cast<uint32_t>(m_Nodes.size());
+
+			//Each segment's nodes are contiguous and children follow their parent, so going backwards refits bottom-up
+			for (uint32_t nodeIdx = last; nodeIdx-- > first;)
 			{
-				m_Left = objects[Start + 1];
-				m_Right = objects[Start];
+				Node& node = m_Nodes[nodeIdx];
+				if (node.Count == 0)
+				{
+					node.Box = AABB(m_Nodes[nodeIdx + 1].Box, m_Nodes[node.Offset].Box);
+					node.EndBox = AABB(m_Nodes[nodeIdx + 1].EndBox, m_Nodes[node.Offset].EndBox);
+				}
+				else
+				{
+					node = LeafNode(node.Offset, m_LeafSources[node.Offset], start, end);
+				}
 			}
 		}
+
+		m_Moving = std::any_of(m_Nodes.begin(), m_Nodes.end(), [](const Node& N) { return N.Moves(); });
+		m_Bounds = RootBounds();
+
+		if (Cost() > m_BuiltCost * RebuildThreshold)
+		{
+			Rebuild();
+			return true;
+		}
+
+		Quantize();
+		return false;
+	}
+
+	// Throws the tree away and builds it again over the current objects, from now on with Method.
+	void Rebuild(const BuildMethod Method)
+	{
+		m_Method = Method;
+		Rebuild();
+	}
+
+	// Throws the tree away and builds it again over the current objects.
+	void Rebuild()
+	{
+		//An empty tree has nothing to build, but one that has already let go of its objects can't be built again
+		if (m_Objects.empty())
+		{
+			if (!m_Roots.empty())
+			{
+				RequireObjects("Rebuild");
+			}
+			return;
+		}
+
+		m_Nodes.clear();
+		m_Roots.clear();
+		m_Primitives.clear();
+		m_LeafSources.clear();
+		m_SourceIndices.clear();
+		m_Store = PrimitiveStore();
+
+		m_SegmentsPerTime = m_T1 > m_T0 ? 1.0f / SegmentDuration() : 0.0f;
+
+		std::vector<uint32_t> order(m_Objects.size());
+		std::iota(order.begin(), order.end(), 0u);
+		m_ObjectTags.assign(m_Objects.size(), m_Untagged);
+		m_BlockTags.clear();
+		m_Nodes.reserve(2 * m_Objects.size() * m_TimeSegments);
+		for (int segment = 0; segment < m_TimeSegments; segment++)
+		{
+			const auto [start, end] = SegmentTimes(segment);
+			if (m_Method == BuildMethod::Median)
+			{
+				m_Roots.push_back(Build(order, 0, order.size(), start, end));
+				continue;
+			}
+
+			BuildContext context{ start, end };
+			std::vector<Reference> references(m_Objects.size());
+			AABB bounds = EmptyBox();
+			for (size_t idx = 0; idx < m_Objects.size(); idx++)
+			{
+				Reference& reference = references[idx];
+				reference.Object = static_cast<uint32_t>(idx);
+				if (!m_Objects[idx]->BoundingBox(start, start, reference.Box) || !m_Objects[idx]->BoundingBox(end, end, reference.EndBox))
+				{
+					std::cerr << "No bounding box found in BoundingVolumeHierarchy.\n";
+				}
+				bounds = AABB(bounds, reference.SweptBox());
+			}
+			context.RootArea = SurfaceArea(bounds);
+			context.SplitBudget = m_Method == BuildMethod::Spatial ? static_cast<size_t>(SpatialSplitBudget * m_Objects.size()) : 0;
+			m_Roots.push_back(Build(references, context, 0));
+		}
+		m_ObjectCount = m_Objects.size();
+
+		//A tree over things that stay still can skip the interpolation
+		m_Moving = std::any_of(m_Nodes.begin(), m_Nodes.end(), [](const Node& N) { return N.Moves(); });
+		m_BuiltCost = Cost();
+		m_Bounds = RootBounds();
+		Quantize();
+
+		if (m_Refittable)
+		{
+			m_Nodes.shrink_to_fit();
+		}
 		else
 		{
-			std::sort(objects.begin() + Start, objects.begin() + End, comparator);
-			size_t mid = Start + (objectSpan / 2);
-			m_Left = std::make_shared<BoundingVolumeHierarchy>(objects, Start, mid, T0, T1);
-			m_Right = std::make_shared<BoundingVolumeHierarchy>(objects, mid, End, T0, T1);
+			Freeze();
 		}
+	}
+
+	// Lets go of everything only Replace, Refit and Rebuild need: the objects the tree was built from, which the store
+	// has copies of, and the binary nodes, which rays don't traverse once they've been quantized. Builds that count
+	// RAYTRACER_BVH_STATS keep the binary nodes for Shape.
+	void Freeze()
+	{
+		std::vector<std::shared_ptr<IHittable>>().swap(m_Objects);
+		std::vector<uint32_t>().swap(m_SourceIndices);
+		std::vector<uint32_t>().swap(m_ObjectTags);
+		m_BlockTags.clear();
+#ifndef RAYTRACER_BVH_STATS
+		std::vector<Node>().swap(m_Nodes);
+#endif
+	}
+
+	//How much worse than when it was built the refitted tree's cost may get before Refit rebuilds it
+	static constexpr float RebuildThreshold = 1.5f;
+
+	struct BuildStats
+	{
+		size_t Objects;
+		size_t References;	//Objects in leaves, counting each copy a spatial split made, over all the time segments
+		size_t Nodes;		//That rays are traversed through
+		size_t NodeBytes;	//Of every node the tree holds, counting binary nodes kept for refitting alongside the quantized ones
+		size_t StoreBytes;	//Of the primitives' copies in the store, including sphere blocks added by more than one segment
+		float Cost;			//The surface area heuristic's, relative to a ray that only goes through the root
+	};
+
+	BuildStats Stats() const
+	{
+		const size_t nodes = m_Moving ? m_MovingQuantizedNodes.size() : m_QuantizedNodes.size();
+		const size_t nodeBytes = (m_Nodes.capacity() * sizeof(Node)) + (m_QuantizedNodes.capacity() * sizeof(QuantizedNode))
+			+ (m_MovingQuantizedNodes.capacity() * sizeof(MovingQuantizedNode));
+		const size_t references = m_LeafSources.empty() ? 0 : m_LeafSources.back().First + m_LeafSources.back().Count;
+		return { m_ObjectCount, references, nodes, nodeBytes, m_Store.Bytes(), Cost() };
+	}
 
-		AABB leftBox, rightBox;
-		if (!m_Left->BoundingBox(T0, T1, leftBox) || !m_Right->BoundingBox(T0, T1, rightBox))
+	// The shape of the binary tree over every time segment. Leaf sizes count objects, which a sphere block holds
+	// several of; a tree loaded from a SceneCache no longer knows which objects are where, and counts each leaf as one.
+	// Only trees that kept their binary nodes have a shape, which outside RAYTRACER_BVH_STATS builds are Refittable ones.
+	BVHStats::TreeShape Shape() const
+	{
+		BVHStats::TreeShape shape;
+		shape.Nodes = m_Nodes.size();
+		shape.Cost = Cost();
+
+		std::vector<size_t> overlapCounts;
+		size_t depthTotal = 0;
+		std::vector<std::pair<uint32_t, int>> stack;
+		for (const uint32_t root : m_Roots)
 		{
-			std::cerr << "No bounding box found in BoundingVolumeHierarchy ctor.\n";
+			stack.push_back({ root, 0 });
+			while (!stack.empty())
+			{
+				const auto [nodeIdx, depth] = stack.back();
+				stack.pop_back();
+				const Node& node = m_Nodes[nodeIdx];
+				shape.MaxDepth = std::max(shape.MaxDepth, depth);
+
+				if (node.Count > 0)
+				{
+					const size_t objects = m_LeafSources.empty() ? node.Count : m_LeafSources[node.Offset].Count;
+					shape.LeafSizes.resize(std::max(shape.LeafSizes.size(), objects + 1), 0);
+					shape.LeafSizes[objects]++;
+					shape.Leaves++;
+					depthTotal += depth;
+					continue;
+				}
+
+				const float area = SurfaceArea(node.SweptBox());
+				if (shape.OverlapByDepth.size() <= static_cast<size_t>(depth))
+				{
+					shape.OverlapByDepth.resize(depth + 1, 0.0);
+					overlapCounts.resize(depth + 1, 0);
+				}
+				shape.OverlapByDepth[depth] += area > 0.0f ? OverlapArea(m_Nodes[nodeIdx + 1].SweptBox(), m_Nodes[node.Offset].SweptBox()) / area : 0.0f;
+				overlapCounts[depth]++;
+
+				stack.push_back({ node.Offset, depth + 1 });
+				stack.push_back({ nodeIdx + 1, depth + 1 });
+			}
 		}
 
-		m_Box = { leftBox, rightBox };
+		for (size_t depth = 0; depth < overlapCounts.size(); depth++)
+		{
+			shape.OverlapByDepth[depth] /= std::max<size_t>(overlapCounts[depth], 1);
+		}
+		shape.AverageLeafDepth = shape.Leaves > 0 ? static_cast<double>(depthTotal) / shape.Leaves : 0.0;
+		return shape;
 	}
 
 	virtual bool Hit(const Ray& R, float TMin, float TMax, HitRecord& OutHit) const override
 	{
-		if (!m_Box.Hit(R, TMin, TMax))
+		if (m_Roots.empty())
 		{
 			return false;
 		}
 
-		const bool hitLeft = m_Left->Hit(R, TMin, TMax, OutHit);
-		const bool hitRight = m_Right->Hit(R, TMin, hitLeft ? OutHit.T : TMax, OutHit);
+		const int segment = SegmentOf(R.Time());
+		const float blend = BlendOf(R.Time(), segment);
+		return m_Moving ? HitQuantized(m_MovingQuantizedNodes, R, TMin, TMax, OutHit, m_QuantizedRoots[segment], blend)
+			: HitQuantized(m_QuantizedNodes, R, TMin, TMax, OutHit, m_QuantizedRoots[segment], blend);
+	}
 
-		return hitLeft || hitRight;
+	// Whether R hits anything within [TMin, TMax], for shadow and visibility rays. Returns at the first hit it finds
+	// instead of looking for the closest, so children needn't be visited in order. Objects nested inside the tree,
+	// such as other trees and instances, still find their own closest hit.
+	bool Occluded(const Ray& R, const float TMin, const float TMax) const
+	{
+		if (m_Roots.empty())
+		{
+			return false;
+		}
+
+		const int segment = SegmentOf(R.Time());
+		const float blend = BlendOf(R.Time(), segment);
+		return m_Moving ? OccludedQuantized(m_MovingQuantizedNodes, R, TMin, TMax, m_QuantizedRoots[segment], blend)
+			: OccludedQuantized(m_QuantizedNodes, R, TMin, TMax, m_QuantizedRoots[segment], blend);
+	}
+
+	// Finds the closest hit for every ray of Packet, writing OutHits[lane] and returning a mask of the lanes that hit.
+	// Nodes are tested for the whole packet at once; leaves fall back to single ray tests of their primitives. The rays
+	// of a packet can be at different times, so moving nodes are tested with the box that covers their whole segment,
+	// and a packet spread over several segments goes down each of those trees with just the lanes that belong to it.
+	template<int N>
+	uint32_t HitPacket(RayPacket<N>& Packet, HitRecord* OutHits) const
+	{
+		if (m_Roots.empty())
+		{
+			return 0;
+		}
+
+		if (m_Roots.size() == 1)
+		{
+			return HitPacketSegment(Packet, OutHits, 0, Packet.LaneMask());
+		}
+
+		uint32_t segmentLanes[m_MaxSegments] = {};
+		for (int lane = 0; lane < Packet.Count(); lane++)
+		{
+			segmentLanes[SegmentOf(Packet.Get(lane).Time())] |= 1u << lane;
+		}
+
+		uint32_t hits = 0;
+		for (size_t segment = 0; segment < m_Roots.size(); segment++)
+		{
+			if (segmentLanes[segment] != 0)
+			{
+				hits |= HitPacketSegment(Packet, OutHits, segment, segmentLanes[segment]);
+			}
+		}
+		return hits;
 	}
 
 	virtual bool BoundingBox(const float T0, const float T1, AABB& OutBox) const override
 	{
-		OutBox = m_Box;
+		if (m_Roots.empty())
+		{
+			return false;
+		}
+
+		OutBox = m_Bounds;
 		return true;
 	}
 
+	// Nodes are stored as they are in memory, so files written with a different layout can't be read.
+	static constexpr size_t NodeSize() { return sizeof(Node) + sizeof(QuantizedNode) + sizeof(MovingQuantizedNode); }
+
+	// Writes the built tree: its quantized nodes, its binary ones if it still has them, and the store, but not the
+	// objects it was built from. Fails if the store holds an object of a kind that can't be stored.
+	bool Serialise(ArchiveWriter& Out) const
+	{
+		Out.Write(m_T0);
+		Out.Write(m_T1);
+		Out.Write(m_TimeSegments);
+		Out.Write(m_SegmentsPerTime);
+		Out.Write(m_Moving);
+		Out.Write(m_BuiltCost);
+		Out.Write(m_Bounds);
+		Out.WriteArray(m_QuantizedNodes);
+		Out.WriteArray(m_MovingQuantizedNodes);
+		Out.WriteArray(m_QuantizedRoots);
+		Out.WriteArray(m_Nodes);
+		Out.WriteArray(m_Roots);
+		Out.WriteArray(m_Primitives);
+		return m_Store.Serialise(Out);
+	}
+
+	// The tree comes back without its objects, so it can be traced but not refitted or rebuilt. It only keeps the
+	// binary nodes that were written, which frozen trees have none of.
+	void Deserialise(ArchiveReader& In)
+	{
+		m_T0 = In.Read<float>();
+		m_T1 = In.Read<float>();
+		m_TimeSegments = In.Read<int>();
+		m_SegmentsPerTime = In.Read<float>();
+		m_Moving = In.Read<bool>();
+		m_BuiltCost = In.Read<float>();
+		m_Bounds = In.Read<AABB>();
+		In.ReadArray(m_QuantizedNodes);
+		In.ReadArray(m_MovingQuantizedNodes);
+		In.ReadArray(m_QuantizedRoots);
+		In.ReadArray(m_Nodes);
+		In.ReadArray(m_Roots);
+		In.ReadArray(m_Primitives);
+		m_Store.Deserialise(In);
+	}
+
 private:
-	std::shared_ptr<IHittable> m_Left;
-	std::shared_ptr<IHittable> m_Right;
-	AABB m_Box;
+
+	struct LeafSource
+	{
+		uint32_t First;		//Into m_SourceIndices
+		uint32_t Count;
+	};
+
+	struct Node
+	{
+		AABB Box;			//Bounds at the start of the node's time segment
+		AABB EndBox;		//Bounds at its end, the same as Box for anything that doesn't move
+		uint32_t Offset;	//Interior nodes: index of the right child (the left one follows the node). Leaves: first primitive
+		uint16_t Count;		//Primitives in a leaf, 0 for interior nodes
+		uint8_t Axis;		//Axis the children were split along
+
+		AABB SweptBox() const { return AABB(Box, EndBox); }
+
+		bool Moves() const { return !SameBox(Box, EndBox); }
+	};
+
+	// One object's place in a node being built. Spatial splits can put the same object in several nodes, each with
+	// its box clipped to that node's side of the planes above it.
+	struct Reference
+	{
+		uint32_t Object;	//Into m_Objects
+		AABB Box;
+		AABB EndBox;
+
+		AABB SweptBox() const { return AABB(Box, EndBox); }
+		bool Moves() const { return !SameBox(Box, EndBox); }
+		Point3 Centre() const { const AABB box = SweptBox(); return 0.5f * (box.Min() + box.Max()); }
+	};
+
+	struct BuildContext
+	{
+		float T0;
+		float T1;
+		float RootArea = 0.0f;
+		size_t SplitBudget = 0;		//References spatial splits can still add
+	};
+
+	struct Split
+	{
+		float Cost = Common::Infinity;
+		int Axis = 0;
+		int Bin = 0;				//The last bin on the left
+		float Plane = 0.0f;			//Spatial splits: where space is cut. Object splits: where the first bin starts
+		float BinScale = 0.0f;		//Object splits: bins per unit along Axis
+		bool Spatial = false;
+		AABB LeftBox;
+		AABB RightBox;
+
+		bool Valid() const { return Cost < Common::Infinity; }
+	};
+
+	//Median splits keep the tree balanced, and the SAH builders fall back to them past half of this, so traversal's
+	//stack never runs out
+	static constexpr int m_MaxDepth = 64;
+	static constexpr int m_MaxSegments = 32;
+	static constexpr uint32_t m_Untagged = ~0u;
+
+	// Whether the tree still has its objects, complaining if it doesn't, since a call that needs them would otherwise
+	// quietly do nothing.
+	bool RequireObjects(const char* Operation) const
+	{
+		if (Refittable())
+		{
+			return true;
+		}
+
+		std::cerr << "BoundingVolumeHierarchy::" << Operation << " needs the objects the tree was built from, which only a tree "
+			"built Refittable keeps, and not one loaded from a SceneCache. The tree is unchanged.\n";
+		assert(!"BoundingVolumeHierarchy needs its objects");
+		return false;
+	}
+
+	//Relative costs of stepping through a node and of testing a leaf's primitive (or sphere block)
+	static constexpr float m_TraversalCost = 1.0f;
+	static constexpr float m_IntersectionCost = 1.0f;
+
+	static constexpr int m_SAHBins = 16;
+	//How much the best object split's children must overlap, relative to the root's area, before spatial splits are tried
+	static constexpr float m_SpatialOverlapThreshold = 1e-5f;
+
+	float SegmentDuration() const { return (m_T1 - m_T0) / m_TimeSegments; }
+
+	std::pair<float, float> SegmentTimes(const int Segment) const
+	{
+		const float start = m_T0 + (Segment * SegmentDuration());
+		return { start, Segment + 1 == m_TimeSegments ? m_T1 : start + SegmentDuration() };
+	}
+
+	// The surface area heuristic's estimate of a ray's cost, averaged over the segments: each node costs its
+	// surface area relative to its root's, the chance that a ray through the root goes through it too.
+	float Cost() const
+	{
+		//A frozen tree can't have changed since it was built
+		if (m_Nodes.empty())
+		{
+			return m_BuiltCost;
+		}
+
+		float total = 0.0f;
+		for (size_t segment = 0; segment < m_Roots.size(); segment++)
+		{
+			const uint32_t first = m_Roots[segment];
+			const uint32_t last = segment + 1 < m_Roots.size() ? m_Roots[segment + 1] : static_cast<uint32_t>(m_Nodes.size());
+
+			const float rootArea = SurfaceArea(m_Nodes[first].SweptBox());
+			if (rootArea <= 0.0f)
+			{
+				continue;
+			}
+
+			for (uint32_t nodeIdx = first; nodeIdx < last; nodeIdx++)
+			{
+				const Node& node = m_Nodes[nodeIdx];
+				const float nodeCost = node.Count == 0 ? m_TraversalCost : m_IntersectionCost * node.Count;
+				total += nodeCost * SurfaceArea(node.SweptBox()) / rootArea;
+			}
+		}
+		return total / m_Roots.size();
+	}
+
+	static AABB EmptyBox() { return { Point3(Common::Infinity), Point3(-Common::Infinity) }; }
+
+	// Everything the tree holds over the whole shutter interval.
+	AABB RootBounds() const
+	{
+		AABB bounds = EmptyBox();
+		for (const uint32_t root : m_Roots)
+		{
+			bounds = AABB(bounds, m_Nodes[root].SweptBox());
+		}
+		return bounds;
+	}
+
+	static bool SameBox(const AABB& A, const AABB& B)
+	{
+		for (int axis = 0; axis < 3; axis++)
+		{
+			if (A.Min()[axis] != B.Min()[axis] || A.Max()[axis] != B.Max()[axis])
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Box with its extent along Axis cut down to [Min, Max].
+	static AABB Clip(const AABB& Box, const int Axis, const float Min, const float Max)
+	{
+		Point3 min = Box.Min();
+		Point3 max = Box.Max();
+		min[Axis] = std::fmaxf(min[Axis], Min);
+		max[Axis] = std::fminf(max[Axis], Max);
+		return { min, max };
+	}
+
+	static float SurfaceArea(const AABB& Box)
+	{
+		const Vec3 extent = Box.Max() - Box.Min();
+		return 2.0f * ((extent.x() * extent.y()) + (extent.y() * extent.z()) + (extent.z() * extent.x()));
+	}
+
+	int SegmentOf(const float Time) const
+	{
+		if (m_Roots.size() == 1)
+		{
+			return 0;
+		}
+
+		return std::clamp(static_cast<int>((Time - m_T0) * m_SegmentsPerTime), 0, static_cast<int>(m_Roots.size()) - 1);
+	}
+
+	// Where Time falls between the two ends of its segment, clamped so the boxes are never extrapolated.
+	float BlendOf(const float Time, const int Segment) const
+	{
+		return m_Moving ? std::clamp(((Time - m_T0) * m_SegmentsPerTime) - Segment, 0.0f, 1.0f) : 0.0f;
+	}
+
+	// Moving nodes take two cache lines, and a ray needs both of them.
+	template<typename NodeType>
+	static void PrefetchNode(const NodeType& Node)
+	{
+		Prefetch(&Node);
+		if constexpr (sizeof(NodeType) > 64)
+		{
+			Prefetch(reinterpret_cast<const char*>(&Node) + 64);
+		}
+	}
+
+	template<int N>
+	uint32_t HitPacketSegment(RayPacket<N>& Packet, HitRecord* OutHits, const size_t Segment, const uint32_t Lanes) const
+	{
+		return m_Moving ? HitPacketQuantized(m_MovingQuantizedNodes, Packet, OutHits, m_QuantizedRoots[Segment], Lanes)
+			: HitPacketQuantized(m_QuantizedNodes, Packet, OutHits, m_QuantizedRoots[Segment], Lanes);
+	}
+
+	// Hit, through one segment's quantized nodes. Children are pushed with where the ray enters them, farthest first, so the
+	// nearest is visited next and anything entered beyond the closest hit so far is skipped when it comes off the stack.
+	template<typename NodeType>
+	bool HitQuantized(const PageVector<NodeType>& Nodes, const Ray& R, const float TMin, float TMax, HitRecord& OutHit, const uint32_t Root,
+		const float Blend) const
+	{
+		struct Entry
+		{
+			uint32_t Child;
+			float T;
+		};
+
+		const Vec3 inverseDirection(1.0f / R.Direction().x(), 1.0f / R.Direction().y(), 1.0f / R.Direction().z());
+
+		Entry stack[QuantizedNode::Width * m_MaxDepth];
+		int stackSize = 0;
+		stack[stackSize++] = { Root, TMin };
+		bool anyHit = false;
+
+		while (stackSize > 0)
+		{
+			const Entry entry = stack[--stackSize];
+			if (entry.T > TMax)
+			{
+				continue;
+			}
+
+			if (entry.Child & QuantizedNode::LeafFlag)
+			{
+				BVH_STAT(BVHStats::CountPrimitives());
+				if (m_Store.Hit(m_Primitives[entry.Child & ~QuantizedNode::LeafFlag], R, TMin, TMax, OutHit))
+				{
+					anyHit = true;
+					TMax = OutHit.T;
+				}
+				continue;
+			}
+
+			const NodeType& node = Nodes[entry.Child];
+			BVH_STAT(BVHStats::CountNodes(); BVHStats::CountBoxes(node.ChildCount));
+			float entries[QuantizedNode::Width];
+			for (uint32_t mask = node.Intersect(R.Origin(), inverseDirection, TMin, TMax, Blend, entries); mask != 0;)
+			{
+				int farthest = std::countr_zero(mask);
+				for (uint32_t rest = mask & (mask - 1); rest != 0; rest &= rest - 1)
+				{
+					const int child = std::countr_zero(rest);
+					farthest = entries[child] > entries[farthest] ? child : farthest;
+				}
+
+				stack[stackSize++] = { node.Children[farthest], entries[farthest] };
+				mask &= ~(1u << farthest);
+
+				//The nearest child is visited straight away; the rest wait on the stack while it's traversed
+				if (mask != 0 && !(node.Children[farthest] & QuantizedNode::LeafFlag))
+				{
+					PrefetchNode(Nodes[node.Children[farthest]]);
+				}
+			}
+		}
+		return anyHit;
+	}
+
+	// Occluded, through one segment's quantized nodes.
+	template<typename NodeType>
+	bool OccludedQuantized(const PageVector<NodeType>& Nodes, const Ray& R, const float TMin, const float TMax, const uint32_t Root,
+		const float Blend) const
+	{
+		const Vec3 inverseDirection(1.0f / R.Direction().x(), 1.0f / R.Direction().y(), 1.0f / R.Direction().z());
+
+		HitRecord hit;
+		uint32_t stack[QuantizedNode::Width * m_MaxDepth];
+		int stackSize = 0;
+		stack[stackSize++] = Root;
+
+		while (stackSize > 0)
+		{
+			const uint32_t child = stack[--stackSize];
+			if (child & QuantizedNode::LeafFlag)
+			{
+				BVH_STAT(BVHStats::CountPrimitives());
+				if (m_Store.Hit(m_Primitives[child & ~QuantizedNode::LeafFlag], R, TMin, TMax, hit))
+				{
+					return true;
+				}
+				continue;
+			}
+
+			const NodeType& node = Nodes[child];
+			BVH_STAT(BVHStats::CountNodes(); BVHStats::CountBoxes(node.ChildCount));
+			float entries[QuantizedNode::Width];
+			for (uint32_t mask = node.Intersect(R.Origin(), inverseDirection, TMin, TMax, Blend, entries); mask != 0; mask &= mask - 1)
+			{
+				stack[stackSize++] = node.Children[std::countr_zero(mask)];
+			}
+		}
+		return false;
+	}
+
+	// HitPacket, through one segment's quantized nodes. Leaves are tested as soon as they're reached, and inner
+	// children are ordered along the direction of the first ray, as a stand-in for the whole packet. Moving children
+	// are tested with their box over the whole segment.
+	template<typename NodeType, int N>
+	uint32_t HitPacketQuantized(const PageVector<NodeType>& Nodes, RayPacket<N>& Packet, HitRecord* OutHits, const uint32_t Root,
+		const uint32_t Lanes) const
+	{
+		const Vec3 direction = Packet.Get(std::countr_zero(Lanes)).Direction();
+
+		uint32_t stack[QuantizedNode::Width * m_MaxDepth];
+		int stackSize = 0;
+		stack[stackSize++] = Root;
+		uint32_t hits = 0;
+
+		while (stackSize > 0)
+		{
+			const NodeType& node = Nodes[stack[--stackSize]];
+			BVH_STAT(BVHStats::CountNodes(Lanes); BVHStats::CountBoxes(node.ChildCount, Lanes));
+
+			float distances[QuantizedNode::Width];
+			uint32_t inner = 0;
+			for (int child = 0; child < node.ChildCount; child++)
+			{
+				const AABB box = node.SweptChildBox(child);
+				const uint32_t active = Packet.Intersects(box) & Lanes;
+				if (active == 0)
+				{
+					continue;
+				}
+
+				if (!(node.Children[child] & QuantizedNode::LeafFlag))
+				{
+					inner |= 1u << child;
+					distances[child] = Dot(0.5f * (box.Min() + box.Max()), direction);
+					continue;
+				}
+
+				const uint32_t primitive = m_Primitives[node.Children[child] & ~QuantizedNode::LeafFlag];
+				BVH_STAT(BVHStats::CountPrimitives(active));
+				for (uint32_t lanes = active; lanes != 0; lanes &= lanes - 1)
+				{
+					const int lane = std::countr_zero(lanes);
+					if (m_Store.Hit(primitive, Packet.Get(lane), Packet.TMin(), Packet.TMax(lane), OutHits[lane]))
+					{
+						hits |= 1u << lane;
+						Packet.Shorten(lane, OutHits[lane].T);
+					}
+				}
+			}
+
+			while (inner != 0)
+			{
+				int farthest = std::countr_zero(inner);
+				for (uint32_t rest = inner & (inner - 1); rest != 0; rest &= rest - 1)
+				{
+					const int child = std::countr_zero(rest);
+					farthest = distances[child] > distances[farthest] ? child : farthest;
+				}
+
+				stack[stackSize++] = node.Children[farthest];
+				inner &= ~(1u << farthest);
+				if (inner != 0)
+				{
+					PrefetchNode(Nodes[node.Children[farthest]]);
+				}
+			}
+		}
+		return hits;
+	}
+
+	// Rebuilds the quantized nodes from the binary ones, with both of each child's boxes if the tree moves.
+	void Quantize()
+	{
+		m_QuantizedNodes.clear();
+		m_MovingQuantizedNodes.clear();
+		m_QuantizedRoots.clear();
+		if (m_Moving)
+		{
+			Quantize(m_MovingQuantizedNodes);
+		}
+		else
+		{
+			Quantize(m_QuantizedNodes);
+		}
+
+		m_QuantizedNodes.shrink_to_fit();
+		m_MovingQuantizedNodes.shrink_to_fit();
+	}
+
+	template<typename NodeType>
+	void Quantize(PageVector<NodeType>& Nodes)
+	{
+		Nodes.reserve(m_Nodes.size() / 2);
+		for (const uint32_t root : m_Roots)
+		{
+			m_QuantizedRoots.push_back(Quantize(Nodes, root));
+		}
+
+		if (DefaultLayout == NodeLayout::Treelets)
+		{
+			LayOutTreelets(Nodes);
+		}
+	}
+
+	// Reorders the quantized nodes into treelets of up to a page. A treelet grows from its root by taking whichever
+	// child not yet placed has the largest surface area, as the one a ray that got this far is most likely to visit
+	// next. The children left over when it's full root the treelets that follow, largest first, so the likeliest of
+	// them sits next to its parent's page. A treelet holds a whole subtree when that fits in a page, and the rest of
+	// a page is padded with unused nodes whenever the next treelet wouldn't fit in it.
+	template<typename NodeType>
+	void LayOutTreelets(PageVector<NodeType>& Nodes)
+	{
+		struct Candidate
+		{
+			uint32_t Node;
+			float Area;
+		};
+
+		//Children come after their parents, so every subtree's size is known by the time its root's is counted
+		std::vector<uint32_t> subtreeSizes(Nodes.size(), 1);
+		for (size_t nodeIdx = Nodes.size(); nodeIdx-- > 0;)
+		{
+			const NodeType& node = Nodes[nodeIdx];
+			for (int child = 0; child < node.ChildCount; child++)
+			{
+				if (!(node.Children[child] & QuantizedNode::LeafFlag))
+				{
+					subtreeSizes[nodeIdx] += subtreeSizes[node.Children[child]];
+				}
+			}
+		}
+
+		constexpr size_t pageNodes = TreeletNodes<NodeType>;
+		PageVector<NodeType> laidOut;
+		laidOut.reserve(Nodes.size() + (Nodes.size() / 4));
+		std::vector<uint32_t> newIndices(Nodes.size());
+		std::vector<uint32_t> treeletRoots(m_QuantizedRoots.rbegin(), m_QuantizedRoots.rend());
+		std::vector<Candidate> frontier;
+
+		while (!treeletRoots.empty())
+		{
+			frontier.assign(1, { treeletRoots.back(), 0.0f });
+			treeletRoots.pop_back();
+
+			const size_t treeletSize = std::min<size_t>(subtreeSizes[frontier[0].Node], pageNodes);
+			if (laidOut.size() % pageNodes + treeletSize > pageNodes)
+			{
+				laidOut.resize(laidOut.size() + pageNodes - (laidOut.size() % pageNodes));
+			}
+
+			for (size_t placed = 0; placed < treeletSize && !frontier.empty(); placed++)
+			{
+				const auto widest = std::max_element(frontier.begin(), frontier.end(),
+					[](const Candidate& A, const Candidate& B) { return A.Area < B.Area; });
+				const uint32_t nodeIdx = widest->Node;
+				*widest = frontier.back();
+				frontier.pop_back();
+
+				newIndices[nodeIdx] = static_cast<uint32_t>(laidOut.size());
+				laidOut.push_back(Nodes[nodeIdx]);
+
+				const NodeType& node = Nodes[nodeIdx];
+				for (int child = 0; child < node.ChildCount; child++)
+				{
+					if (!(node.Children[child] & QuantizedNode::LeafFlag))
+					{
+						frontier.push_back({ node.Children[child], SurfaceArea(node.SweptChildBox(child)) });
+					}
+				}
+			}
+
+			//Roots are taken from the back, so the largest leftover goes last
+			std::sort(frontier.begin(), frontier.end(), [](const Candidate& A, const Candidate& B) { return A.Area < B.Area; });
+			for (const Candidate& leftOver : frontier)
+			{
+				treeletRoots.push_back(leftOver.Node);
+			}
+		}
+
+		for (NodeType& node : laidOut)
+		{
+			for (int child = 0; child < node.ChildCount; child++)
+			{
+				if (!(node.Children[child] & QuantizedNode::LeafFlag))
+				{
+					node.Children[child] = newIndices[node.Children[child]];
+				}
+			}
+		}
+		for (uint32_t& root : m_QuantizedRoots)
+		{
+			root = newIndices[root];
+		}
+		Nodes = std::move(laidOut);
+	}
+
+	// Collapses the binary subtree at NodeIdx into one quantized node by opening up the inner child with the largest
+	// surface area until there are four children, then does the same for each inner child left over.
+	template<typename NodeType>
+	uint32_t Quantize(PageVector<NodeType>& Nodes, const uint32_t NodeIdx)
+	{
+		const uint32_t quantizedIdx = static_cast<uint32_t>(Nodes.size());
+		Nodes.emplace_back();
+
+		uint32_t children[QuantizedNode::Width] = { NodeIdx };
+		int childCount = 1;
+		while (childCount < QuantizedNode::Width)
+		{
+			int widest = -1;
+			for (int child = 0; child < childCount; child++)
+			{
+				const Node& candidate = m_Nodes[children[child]];
+				if (candidate.Count == 0 && (widest < 0 || SurfaceArea(candidate.SweptBox()) > SurfaceArea(m_Nodes[children[widest]].SweptBox())))
+				{
+					widest = child;
+				}
+			}
+
+			if (widest < 0)
+			{
+				break;
+			}
+
+			const uint32_t opened = children[widest];
+			children[widest] = opened + 1;
+			children[childCount++] = m_Nodes[opened].Offset;
+		}
+
+		//Leaves hold a single primitive or sphere block, so they become a child of their own
+		AABB boxes[QuantizedNode::Width];
+		AABB endBoxes[QuantizedNode::Width];
+		uint32_t references[QuantizedNode::Width];
+		for (int child = 0; child < childCount; child++)
+		{
+			const Node& node = m_Nodes[children[child]];
+			boxes[child] = node.Box;
+			endBoxes[child] = node.EndBox;
+			references[child] = node.Count == 0 ? Quantize(Nodes, children[child]) : node.Offset | QuantizedNode::LeafFlag;
+		}
+
+		NodeType& quantized = Nodes[quantizedIdx];
+		quantized.SetBounds(m_Nodes[NodeIdx].SweptBox(), boxes, endBoxes, childCount);
+		std::copy(references, references + childCount, quantized.Children);
+		return quantizedIdx;
+	}
+
+	uint32_t Build(std::vector<uint32_t>& Order, const size_t Start, const size_t End, const float T0, const float T1)
+	{
+		const uint32_t nodeIdx = static_cast<uint32_t>(m_Nodes.size());
+		m_Nodes.emplace_back();
+
+		//Small runs of spheres become one leaf that tests them all at once
+		const bool allSpheres = End - Start <= SphereBlock::Width
+			&& std::all_of(Order.begin() + Start, Order.begin() + End, [&](const uint32_t Idx) { return PrimitiveStore::IsSphere(m_Objects[Idx]); });
+		if (End - Start == 1 || allSpheres)
+		{
+			AddLeaf(m_Nodes[nodeIdx], std::span(Order.data() + Start, End - Start), T0, T1);
+			return nodeIdx;
+		}
+
+		const int axis = Common::RandomInt(0, 2);
+		std::sort(Order.begin() + Start, Order.begin() + End,
+			[&](const uint32_t A, const uint32_t B) { return BoxCompare(m_Objects[A], m_Objects[B], axis); });
+		const size_t mid = Start + ((End - Start) / 2);
+
+		const uint32_t left = Build(Order, Start, mid, T0, T1);
+		const uint32_t right = Build(Order, mid, End, T0, T1);
+
+		m_Nodes[nodeIdx] = { AABB(m_Nodes[left].Box, m_Nodes[right].Box), AABB(m_Nodes[left].EndBox, m_Nodes[right].EndBox), right, 0, static_cast<uint8_t>(axis) };
+		return nodeIdx;
+	}
+
+	uint32_t Build(std::vector<Reference>& References, BuildContext& Context, const int Depth)
+	{
+		const uint32_t nodeIdx = static_cast<uint32_t>(m_Nodes.size());
+		m_Nodes.emplace_back();
+
+		const bool allSpheres = References.size() <= SphereBlock::Width
+			&& std::all_of(References.begin(), References.end(), [&](const Reference& Ref) { return PrimitiveStore::IsSphere(m_Objects[Ref.Object]); });
+		if (References.size() == 1 || allSpheres)
+		{
+			std::vector<uint32_t> objects;
+			AABB box = EmptyBox();
+			AABB endBox = EmptyBox();
+			for (const Reference& reference : References)
+			{
+				objects.push_back(reference.Object);
+				box = AABB(box, reference.Box);
+				endBox = AABB(endBox, reference.EndBox);
+			}
+
+			//The store holds whole objects, but the leaf only has to cover the part of them on its side of any cuts
+			Node& leaf = m_Nodes[nodeIdx];
+			AddLeaf(leaf, objects, Context.T0, Context.T1);
+			leaf.Box = box;
+			leaf.EndBox = endBox;
+			return nodeIdx;
+		}
+
+		std::vector<Reference> left, right;
+		int axis = 0;
+		if (Depth < m_MaxDepth / 2)
+		{
+			Split split = FindObjectSplit(References);
+
+			const bool overlapping = !split.Valid() || (Context.RootArea > 0.0f && OverlapArea(split.LeftBox, split.RightBox) > m_SpatialOverlapThreshold * Context.RootArea);
+			if (Context.SplitBudget > 0 && overlapping)
+			{
+				const Split spatial = FindSpatialSplit(References);
+				if (spatial.Cost < split.Cost)
+				{
+					split = spatial;
+				}
+			}
+
+			if (split.Valid() && Partition(References, split, Context, left, right))
+			{
+				axis = split.Axis;
+			}
+		}
+
+		if (left.empty() || right.empty())
+		{
+			//Nothing to choose between, or too deep to be choosy: halve the node along its widest spread of centres
+			left.clear();
+			right.clear();
+			axis = LongestCentreAxis(References);
+			const size_t mid = References.size() / 2;
+			std::nth_element(References.begin(), References.begin() + mid, References.end(),
+				[&](const Reference& A, const Reference& B) { return A.Centre()[axis] < B.Centre()[axis]; });
+			left.assign(References.begin(), References.begin() + mid);
+			right.assign(References.begin() + mid, References.end());
+		}
+
+		//The children's lists replace this one, so only one path down the tree holds its references at a time
+		std::vector<Reference>().swap(References);
+
+		const uint32_t leftIdx = Build(left, Context, Depth + 1);
+		const uint32_t rightIdx = Build(right, Context, Depth + 1);
+
+		m_Nodes[nodeIdx] = { AABB(m_Nodes[leftIdx].Box, m_Nodes[rightIdx].Box), AABB(m_Nodes[leftIdx].EndBox, m_Nodes[rightIdx].EndBox), rightIdx, 0, static_cast<uint8_t>(axis) };
+		return nodeIdx;
+	}
+
+	static float OverlapArea(const AABB& A, const AABB& B)
+	{
+		Point3 min, max;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			min[axis] = std::fmaxf(A.Min()[axis], B.Min()[axis]);
+			max[axis] = std::fminf(A.Max()[axis], B.Max()[axis]);
+			if (max[axis] <= min[axis])
+			{
+				return 0.0f;
+			}
+		}
+		return SurfaceArea({ min, max });
+	}
+
+	static int LongestCentreAxis(const std::vector<Reference>& References)
+	{
+		AABB centres = EmptyBox();
+		for (const Reference& reference : References)
+		{
+			centres = AABB(centres, AABB(reference.Centre(), reference.Centre()));
+		}
+
+		const Vec3 extent = centres.Max() - centres.Min();
+		return (extent.x() >= extent.y() && extent.x() >= extent.z()) ? 0 : (extent.y() >= extent.z()) ? 1 : 2;
+	}
+
+	static int CentreBin(const Reference& Ref, const int Axis, const float Min, const float Scale)
+	{
+		return std::clamp(static_cast<int>((Ref.Centre()[Axis] - Min) * Scale), 0, m_SAHBins - 1);
+	}
+
+	// Tries the planes between bins, with running totals from both ends. Left counts the references starting in each
+	// bin and Right those ending in it, which for object splits are the same thing. Each side costs its surface area
+	// times how many references it holds.
+	static void SweepBins(Split& Best, const int Axis, const AABB (&Boxes)[m_SAHBins], const size_t (&Left)[m_SAHBins], const size_t (&Right)[m_SAHBins])
+	{
+		AABB rightBoxes[m_SAHBins];
+		AABB accumulated = EmptyBox();
+		for (int bin = m_SAHBins - 1; bin > 0; bin--)
+		{
+			accumulated = AABB(accumulated, Boxes[bin]);
+			rightBoxes[bin - 1] = accumulated;
+		}
+
+		accumulated = EmptyBox();
+		size_t leftCount = 0, rightCount = 0;
+		for (int bin = 0; bin < m_SAHBins; bin++)
+		{
+			rightCount += Right[bin];
+		}
+
+		for (int bin = 0; bin < m_SAHBins - 1; bin++)
+		{
+			accumulated = AABB(accumulated, Boxes[bin]);
+			leftCount += Left[bin];
+			rightCount -= Right[bin];
+			if (leftCount == 0 || rightCount == 0)
+			{
+				continue;
+			}
+
+			const float cost = (SurfaceArea(accumulated) * leftCount) + (SurfaceArea(rightBoxes[bin]) * rightCount);
+			if (cost < Best.Cost)
+			{
+				Best.Cost = cost;
+				Best.Axis = Axis;
+				Best.Bin = bin;
+				Best.LeftBox = accumulated;
+				Best.RightBox = rightBoxes[bin];
+			}
+		}
+	}
+
+	Split FindObjectSplit(const std::vector<Reference>& References) const
+	{
+		AABB centres = EmptyBox();
+		for (const Reference& reference : References)
+		{
+			centres = AABB(centres, AABB(reference.Centre(), reference.Centre()));
+		}
+
+		Split best;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			const float extent = centres.Max()[axis] - centres.Min()[axis];
+			if (extent <= 0.0f)
+			{
+				continue;
+			}
+
+			AABB boxes[m_SAHBins];
+			size_t counts[m_SAHBins] = {};
+			std::fill(std::begin(boxes), std::end(boxes), EmptyBox());
+
+			const float scale = m_SAHBins / extent;
+			for (const Reference& reference : References)
+			{
+				const int bin = CentreBin(reference, axis, centres.Min()[axis], scale);
+				boxes[bin] = AABB(boxes[bin], reference.SweptBox());
+				counts[bin]++;
+			}
+
+			Split candidate;
+			SweepBins(candidate, axis, boxes, counts, counts);
+			if (candidate.Cost < best.Cost)
+			{
+				best = candidate;
+				best.Plane = centres.Min()[axis];
+				best.BinScale = scale;
+			}
+		}
+		return best;
+	}
+
+	// Cuts the node's bounds into equal slabs along each axis. A reference is counted where it starts and where it
+	// ends, and adds its box clipped to each slab it crosses, so the best plane's children are as tight as clipping
+	// will make them.
+	Split FindSpatialSplit(const std::vector<Reference>& References) const
+	{
+		AABB bounds = EmptyBox();
+		for (const Reference& reference : References)
+		{
+			bounds = AABB(bounds, reference.SweptBox());
+		}
+
+		Split best;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			const float min = bounds.Min()[axis];
+			const float binWidth = (bounds.Max()[axis] - min) / m_SAHBins;
+			if (binWidth <= 0.0f)
+			{
+				continue;
+			}
+
+			AABB boxes[m_SAHBins];
+			size_t entries[m_SAHBins] = {};
+			size_t exits[m_SAHBins] = {};
+			std::fill(std::begin(boxes), std::end(boxes), EmptyBox());
+
+			for (const Reference& reference : References)
+			{
+				const AABB swept = reference.SweptBox();
+				const int first = std::clamp(static_cast<int>((swept.Min()[axis] - min) / binWidth), 0, m_SAHBins - 1);
+				const int last = std::clamp(static_cast<int>((swept.Max()[axis] - min) / binWidth), first, m_SAHBins - 1);
+				entries[first]++;
+				exits[last]++;
+
+				for (int bin = first; bin <= last; bin++)
+				{
+					const AABB part = reference.Moves() ? swept : Clip(swept, axis, min + (bin * binWidth), min + ((bin + 1) * binWidth));
+					boxes[bin] = AABB(boxes[bin], part);
+				}
+			}
+
+			Split candidate;
+			SweepBins(candidate, axis, boxes, entries, exits);
+			if (candidate.Cost < best.Cost)
+			{
+				best = candidate;
+				best.Plane = min + ((candidate.Bin + 1) * binWidth);
+			}
+		}
+
+		best.Spatial = true;
+		return best;
+	}
+
+	// Sends each reference to its side of Chosen. Fails, leaving both sides empty, if a spatial split would duplicate
+	// more references than the budget has left.
+	bool Partition(const std::vector<Reference>& References, const Split& Chosen, BuildContext& Context,
+		std::vector<Reference>& OutLeft, std::vector<Reference>& OutRight) const
+	{
+		const int axis = Chosen.Axis;
+		if (!Chosen.Spatial)
+		{
+			for (const Reference& reference : References)
+			{
+				(CentreBin(reference, axis, Chosen.Plane, Chosen.BinScale) <= Chosen.Bin ? OutLeft : OutRight).push_back(reference);
+			}
+			return true;
+		}
+
+		size_t straddling = 0;
+		for (const Reference& reference : References)
+		{
+			const AABB swept = reference.SweptBox();
+			if (swept.Max()[axis] <= Chosen.Plane)
+			{
+				OutLeft.push_back(reference);
+			}
+			else if (swept.Min()[axis] >= Chosen.Plane)
+			{
+				OutRight.push_back(reference);
+			}
+			else
+			{
+				//Moving references go to both sides whole; still ones are cut at the plane
+				Reference leftPart = reference;
+				Reference rightPart = reference;
+				if (!reference.Moves())
+				{
+					leftPart.Box = leftPart.EndBox = Clip(reference.Box, axis, -Common::Infinity, Chosen.Plane);
+					rightPart.Box = rightPart.EndBox = Clip(reference.Box, axis, Chosen.Plane, Common::Infinity);
+				}
+				OutLeft.push_back(leftPart);
+				OutRight.push_back(rightPart);
+				straddling++;
+			}
+		}
+
+		if (straddling > Context.SplitBudget)
+		{
+			OutLeft.clear();
+			OutRight.clear();
+			return false;
+		}
+
+		Context.SplitBudget -= straddling;
+		return true;
+	}
+
+	void AddLeaf(Node& Leaf, const std::span<const uint32_t> Objects, const float T0, const float T1)
+	{
+		const uint32_t slot = static_cast<uint32_t>(m_Primitives.size());
+		m_Primitives.emplace_back();
+		m_LeafSources.push_back({ static_cast<uint32_t>(m_SourceIndices.size()), static_cast<uint32_t>(Objects.size()) });
+		m_SourceIndices.insert(m_SourceIndices.end(), Objects.begin(), Objects.end());
+
+		//In a fixed order, so segments that group the same spheres can find each other's block
+		std::sort(m_SourceIndices.end() - Objects.size(), m_SourceIndices.end());
+
+		Leaf = LeafNode(slot, m_LeafSources.back(), T0, T1);
+		StoreLeaf(slot, m_LeafSources.back());
+	}
+
+	// A leaf over the objects it was given, bounding them at both ends of [T0, T1].
+	Node LeafNode(const uint32_t Slot, const LeafSource& Source, const float T0, const float T1) const
+	{
+		AABB box, endBox;
+		for (uint32_t idx = 0; idx < Source.Count; idx++)
+		{
+			const std::shared_ptr<IHittable>& object = m_Objects[m_SourceIndices[Source.First + idx]];
+
+			AABB objectBox, objectEndBox;
+			if (!object->BoundingBox(T0, T0, objectBox) || !object->BoundingBox(T1, T1, objectEndBox))
+			{
+				std::cerr << "No bounding box found in BoundingVolumeHierarchy.\n";
+			}
+			box = idx == 0 ? objectBox : AABB(box, objectBox);
+			endBox = idx == 0 ? objectEndBox : AABB(endBox, objectEndBox);
+		}
+		return { box, endBox, Slot, 1, 0 };
+	}
+
+	// Points a leaf's entry in m_Primitives at the store's copy of its objects: one object, or a group of spheres
+	// packed into a block.
+	void StoreLeaf(const uint32_t Slot, const LeafSource& Source)
+	{
+		if (Source.Count == 1)
+		{
+			//Segments share the store, so each object is only copied into it the first time a tree reaches it
+			uint32_t& tag = m_ObjectTags[m_SourceIndices[Source.First]];
+			if (tag == m_Untagged)
+			{
+				tag = m_Store.Add(m_Objects[m_SourceIndices[Source.First]]);
+			}
+			m_Primitives[Slot] = tag;
+			return;
+		}
+
+		//Likewise a block is only added the first time a tree groups its spheres together
+		const auto sources = m_SourceIndices.begin() + Source.First;
+		const auto [block, added] = m_BlockTags.try_emplace(std::vector<uint32_t>(sources, sources + Source.Count), 0u);
+		if (added)
+		{
+			std::shared_ptr<IHittable> spheres[SphereBlock::Width];
+			for (uint32_t idx = 0; idx < Source.Count; idx++)
+			{
+				spheres[idx] = m_Objects[m_SourceIndices[Source.First + idx]];
+			}
+			block->second = m_Store.AddSphereBlock(std::span(spheres, Source.Count));
+		}
+		m_Primitives[Slot] = block->second;
+	}
+
+	std::vector<Node> m_Nodes;
+	std::vector<uint32_t> m_Roots;			//One tree per time segment
+	std::vector<uint32_t> m_Primitives;		//Tagged indices into m_Store, in leaf order
+	PageVector<QuantizedNode> m_QuantizedNodes;	//For trees that don't move
+	PageVector<MovingQuantizedNode> m_MovingQuantizedNodes;	//For trees that do
+	std::vector<uint32_t> m_QuantizedRoots;
+	AABB m_Bounds;	//Kept apart from the nodes, which don't keep the root's box once quantized
+	PrimitiveStore m_Store;
+
+	//What the tree was built from, kept after building only by Refittable trees
+	std::vector<std::shared_ptr<IHittable>> m_Objects;
+	std::vector<uint32_t> m_SourceIndices;	//Indices into m_Objects
+	std::vector<uint32_t> m_ObjectTags;		//Store entry of each object that has one to itself
+	std::map<std::vector<uint32_t>, uint32_t> m_BlockTags;	//Store entry of each group of objects packed into a sphere block
+	bool m_Refittable = false;
+
+	std::vector<LeafSource> m_LeafSources;	//Which objects went into each entry of m_Primitives
+	size_t m_ObjectCount = 0;
+
+	float m_T0 = 0.0f;
+	float m_T1 = 0.0f;
+	int m_TimeSegments = 1;				//Always 1 without a shutter interval
+	float m_SegmentsPerTime = 0.0f;
+	bool m_Moving = false;
+	float m_BuiltCost = 0.0f;
+	BuildMethod m_Method = BuildMethod::Median;
 };
\ No newline at end of file
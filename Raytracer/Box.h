@@ -1,28 +1,68 @@
 #pragma once
 
-#include "AARect.h"
+#include "Archive.h"
 #include "Common.h"
-#include "HittableList.h"
+#include "Hittable.h"
 
-class Box : public IHittable
+// An axis-aligned box intersected as one primitive with the slab test. The face that was hit is the axis that
+// entered last (or left first, for rays starting inside), which gives the normal and the face's texture coordinates.
+class Box final : public IHittable
 {
 public:
 	Box() {}
-	Box(const Point3& P0, const Point3& P1, std::shared_ptr<Material> Mat) : m_Min(P0), m_Max(P1), m_Material(Mat)
+	Box(const Point3& P0, const Point3& P1, std::shared_ptr<Material> Mat) : m_Min(P0), m_Max(P1), m_Material(Mat) {}
+
+	virtual bool Hit(const Ray& R, float TMin, float TMax, HitRecord& OutHit) const override
 	{
-		m_Sides.Add(std::make_shared<XYRect>(P0.x(), P1.x(), P0.y(), P1.y(), P1.z(), Mat));
-		m_Sides.Add(std::make_shared<XYRect>(P0.x(), P1.x(), P0.y(), P1.y(), P0.z(), Mat));
+		float tNear = -Common::Infinity, tFar = Common::Infinity;
+		int nearAxis = 0, farAxis = 0;
 
-		m_Sides.Add(std::make_shared<XZRect>(P0.x(), P1.x(), P0.z(), P1.z(), P1.y(), Mat));
-		m_Sides.Add(std::make_shared<XZRect>(P0.x(), P1.x(), P0.z(), P1.z(), P0.y(), Mat));
+		for (int axis = 0; axis < 3; axis++)
+		{
+			const float inverseDirection = 1.0f / R.Direction()[axis];
+			float t0 = (m_Min[axis] - R.Origin()[axis]) * inverseDirection;
+			float t1 = (m_Max[axis] - R.Origin()[axis]) * inverseDirection;
+			if (inverseDirection < 0.0f)
+			{
+				std::swap(t0, t1);
+			}
 
-		m_Sides.Add(std::make_shared<YZRect>(P0.y(), P1.y(), P0.z(), P1.z(), P1.x(), Mat));
-		m_Sides.Add(std::make_shared<YZRect>(P0.y(), P1.y(), P0.z(), P1.z(), P0.x(), Mat));
-	}
+			if (t0 > tNear) { tNear = t0; nearAxis = axis; }
+			if (t1 < tFar) { tFar = t1; farAxis = axis; }
+		}
 
-	virtual bool Hit(const Ray& R, float TMin, float TMax, HitRecord& OutHit) const override
-	{
-		return m_Sides.Hit(R, TMin, TMax, OutHit);
+		if (tNear > tFar)
+		{
+			return false;
+		}
+
+		//Take the entry point if it's in range, otherwise the exit point, as the six faces tested separately would
+		float t = tNear;
+		int axis = nearAxis;
+		if (t < TMin || t > TMax)
+		{
+			t = tFar;
+			axis = farAxis;
+			if (t < TMin || t > TMax)
+			{
+				return false;
+			}
+		}
+
+		const Point3 pos = R.At(t);
+
+		//The outward normal of whichever of the two faces on this axis is nearer the hit point
+		Vec3 outNormal(0.0f);
+		outNormal[axis] = (pos[axis] - m_Min[axis]) < (m_Max[axis] - pos[axis]) ? -1.0f : 1.0f;
+
+		//Texture coordinates follow the rectangles the box used to be built from: the other two axes, in order
+		const int uAxis = axis == 0 ? 1 : 0;
+		const int vAxis = axis == 2 ? 1 : 2;
+		const float u = (pos[uAxis] - m_Min[uAxis]) / (m_Max[uAxis] - m_Min[uAxis]);
+		const float v = (pos[vAxis] - m_Min[vAxis]) / (m_Max[vAxis] - m_Min[vAxis]);
+
+		OutHit = { t, pos, outNormal, R.Direction(), m_Material, u, v };
+		return true;
 	}
 
 	virtual bool BoundingBox(const float T0, const float T1, AABB& OutBox) const override
@@ -30,8 +70,24 @@ public:
 		OutBox = { m_Min, m_Max };
 		return true;
 	}
+
+	bool Serialise(ArchiveWriter& Out) const
+	{
+		Out.Write(m_Min);
+		Out.Write(m_Max);
+		Out.WriteMaterial(m_Material);
+		return true;
+	}
+
+	void Deserialise(ArchiveReader& In)
+	{
+		m_Min = In.Read<Point3>();
+		m_Max = In.Read<Point3>();
+		m_Material = In.ReadMaterial();
+	}
+
 private:
+
 	Point3 m_Min, m_Max;
 	std::shared_ptr<Material> m_Material;
-	HittableList m_Sides;
-};
\ No newline at end of file
+};
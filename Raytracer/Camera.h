@@ -1,6 +1,7 @@
 #pragma once
 #include "Common.h"
 #include "Ray.h"
+#include "Tile.h"
 #include "Vec3.h"
 
 class Camera
@@ -12,31 +13,101 @@ public:
 			const float T0 = 0.0f, const float T1 = 0.0f) :
 		m_FOV(VFov), m_AspectRatio(AspectRatio), m_FocalLength(FocalLength), m_Position(Position), m_Target(LookAt), m_Up(Up), m_Aperture(Aperture),
 		m_T0(T0), m_T1(T1)
-	{}
-
-	Point3 Position()	const { return m_Position; }
-	Vec3 Horizontal()	const { return FocalLength() * Width() * Normalised(Cross(Up(), Forward())); }
-	Vec3 Vertical()		const
 	{
-		const Vec3 forward = Forward();
-		return FocalLength() * Height() * Cross(forward, Normalised(Cross(Up(), forward)));
+		UpdateBasis();
 	}
-	Vec3 Forward()		const { return Normalised(Position() - m_Target); }
+
+	Point3 Position()	const { return m_Position; }
+	Vec3 Horizontal()	const { return m_Horizontal; }
+	Vec3 Vertical()		const { return m_Vertical; }
+	Vec3 Forward()		const { return m_Forward; }
 	Vec3 Up()			const { return m_Up; }
-	Vec3 LowerLeft()	const { return Position() - (Horizontal() / 2.0f) - (Vertical() / 2.0f) - (FocalLength() * Forward()); }
+	Vec3 LowerLeft()	const { return m_LowerLeft; }
 	float FocalLength() const { return m_FocalLength; }
 	float Width()		const { return m_AspectRatio * Height(); }
-	float Height()		const { return  2.0f * std::tanf(Common::DegreesToRadians(m_FOV) / 2.0f); }
+	float Height()		const { return m_Height; }
 	float LensRadius()	const { return m_Aperture / 2.0f; }
+
 	Ray GetRay(const float s, const float t) const 
 	{
-		const Vec3 u = Normalised(Cross(Up(), Forward()));
-		const Vec3 v = Cross(Forward(), u);
 		const Vec3 random = LensRadius() * RandomInUnitDisk();
-		const Vec3 offset = (u * random.x()) + (v * random.y());
+		const Vec3 offset = (m_U * random.x()) + (m_V * random.y());
 		return Ray(Position() + offset, LowerLeft() + (s * Horizontal()) + (t * Vertical()) - Position() - offset, Common::Random(m_T0, m_T1));
 	}
+
+	// Fills Out with samples FirstSample to FirstSample + SampleCount - 1 of every pixel of Region, pixel by pixel
+	// with samples innermost, so Out.Size() must be Region.PixelCount() * SampleCount. Each sample reseeds the calling
+	// thread's generator with Common::SeedSample.
+	void GenerateRays(const Tile& Region, const int FirstSample, const int SampleCount, const int ImageWidth, const int ImageHeight, const RayBatch& Out) const
+	{
+		//Draw the random numbers first (the lens sample has a rejection loop), parking them in the output streams
+		size_t idx = 0;
+		for (int y = Region.Y0; y < Region.Y1; y++)
+		{
+			for (int x = Region.X0; x < Region.X1; x++)
+			{
+				for (int sample = 0; sample < SampleCount; sample++, idx++)
+				{
+					Common::SeedSample(x, y, FirstSample + sample, Common::SampleStream::Camera);
+					Out.DirectionX[idx] = (static_cast<float>(x) + Common::Random()) / (ImageWidth - 1);
+					Out.DirectionY[idx] = (static_cast<float>(y) + Common::Random()) / (ImageHeight - 1);
+					const Vec3 lens = m_Aperture > 0.0f ? RandomInUnitDisk() : Vec3(0.0f);
+					Out.OriginX[idx] = lens.x();
+					Out.OriginY[idx] = lens.y();
+					Out.Time[idx] = Common::Random(m_T0, m_T1);
+				}
+			}
+		}
+
+		//Then the arithmetic is a branch-free loop over arrays that the compiler can vectorise
+		const float lensRadius = LensRadius();
+		const float ux = m_U.x(), uy = m_U.y(), uz = m_U.z();
+		const float vx = m_V.x(), vy = m_V.y(), vz = m_V.z();
+		const float hx = m_Horizontal.x(), hy = m_Horizontal.y(), hz = m_Horizontal.z();
+		const float sx = m_Vertical.x(), sy = m_Vertical.y(), sz = m_Vertical.z();
+		const float px = m_Position.x(), py = m_Position.y(), pz = m_Position.z();
+		const float lx = m_LowerLeft.x() - px, ly = m_LowerLeft.y() - py, lz = m_LowerLeft.z() - pz;
+
+		float* const originX = Out.OriginX.data();
+		float* const originY = Out.OriginY.data();
+		float* const originZ = Out.OriginZ.data();
+		float* const directionX = Out.DirectionX.data();
+		float* const directionY = Out.DirectionY.data();
+		float* const directionZ = Out.DirectionZ.data();
+		const size_t count = Out.Size();
+		for (size_t ray = 0; ray < count; ray++)
+		{
+			const float s = directionX[ray];
+			const float t = directionY[ray];
+			const float diskX = lensRadius * originX[ray];
+			const float diskY = lensRadius * originY[ray];
+
+			const float offsetX = (ux * diskX) + (vx * diskY);
+			const float offsetY = (uy * diskX) + (vy * diskY);
+			const float offsetZ = (uz * diskX) + (vz * diskY);
+
+			originX[ray] = px + offsetX;
+			originY[ray] = py + offsetY;
+			originZ[ray] = pz + offsetZ;
+			directionX[ray] = lx + (s * hx) + (t * sx) - offsetX;
+			directionY[ray] = ly + (s * hy) + (t * sy) - offsetY;
+			directionZ[ray] = lz + (s * hz) + (t * sz) - offsetZ;
+		}
+	}
+
 private:
+	// The camera frame only changes when the camera moves, so it is worked out once here rather than per ray.
+	void UpdateBasis()
+	{
+		m_Height = 2.0f * std::tanf(Common::DegreesToRadians(m_FOV) / 2.0f);
+		m_Forward = Normalised(m_Position - m_Target);
+		m_U = Normalised(Cross(m_Up, m_Forward));
+		m_V = Cross(m_Forward, m_U);
+		m_Horizontal = FocalLength() * Width() * m_U;
+		m_Vertical = FocalLength() * Height() * m_V;
+		m_LowerLeft = m_Position - (m_Horizontal / 2.0f) - (m_Vertical / 2.0f) - (FocalLength() * m_Forward);
+	}
+
 	float m_FOV;
 	float m_AspectRatio;
 	float m_FocalLength;
@@ -45,4 +116,9 @@ private:
 	Vec3 m_Up;
 	float m_Aperture;
 	float m_T0, m_T1;
+
+	float m_Height;
+	Vec3 m_Forward, m_U, m_V;
+	Vec3 m_Horizontal, m_Vertical;
+	Point3 m_LowerLeft;
 };
\ No newline at end of file
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <cmath>
+#include <cstdint>
+#include <initializer_list>
 #include <limits>
 #include <random>
 
@@ -13,10 +15,81 @@ namespace Common
 		return degrees * pi / 180.0f;
 	}
 
+	// PCG32 (O'Neill, 2014): a 64 bit LCG whose output is permuted down to 32 bits. Its whole state is one integer,
+	// so seeding it is cheap enough to give every camera sample its own sequence.
+	class RandomEngine
+	{
+	public:
+		using result_type = uint32_t;
+
+		static constexpr result_type min() { return 0; }
+		static constexpr result_type max() { return std::numeric_limits<result_type>::max(); }
+
+		RandomEngine() { seed(DefaultSeed); }
+		explicit RandomEngine(const uint64_t Value) { seed(Value); }
+
+		void seed(const uint64_t Value)
+		{
+			m_State = 0;
+			(*this)();
+			m_State += Value;
+			(*this)();
+		}
+
+		result_type operator()()
+		{
+			const uint64_t old = m_State;
+			m_State = (old * 6364136223846793005ull) + Increment;
+			const uint32_t shifted = static_cast<uint32_t>(((old >> 18u) ^ old) >> 27u);
+			const uint32_t rotation = static_cast<uint32_t>(old >> 59u);
+			return (shifted >> rotation) | (shifted << ((32u - rotation) & 31u));
+		}
+
+		static constexpr uint64_t DefaultSeed = 0x853c49e6748fea9bull;
+
+	private:
+		static constexpr uint64_t Increment = 0xda3e39cb94b95bdbull;
+		uint64_t m_State = 0;
+	};
+
+	inline RandomEngine& Generator()
+	{
+		// One generator per thread so concurrent render jobs don't race on its state.
+		thread_local RandomEngine generator;
+		return generator;
+	}
+
+	// SplitMix64's finaliser: every input bit affects every output bit.
+	inline uint64_t Mix(uint64_t Value)
+	{
+		Value = (Value ^ (Value >> 30u)) * 0xbf58476d1ce4e5b9ull;
+		Value = (Value ^ (Value >> 27u)) * 0x94d049bb133111ebull;
+		return Value ^ (Value >> 31u);
+	}
+
+	inline void Seed(const std::initializer_list<uint32_t> Values)
+	{
+		// Gives each block of work its own reproducible sequence.
+		uint64_t hash = 0;
+		for (const uint32_t value : Values)
+		{
+			hash = Mix(hash + value + 0x9e3779b97f4a7c15ull);
+		}
+		Generator().seed(hash);
+	}
+
+	// Each camera sample draws its ray and its path from separate sequences, seeded from its pixel and index, so
+	// neither depends on which other samples were traced first or how the image was split into tiles and jobs.
+	enum class SampleStream : uint32_t { Camera, Path };
+
+	inline void SeedSample(const int X, const int Y, const int Sample, const SampleStream Stream)
+	{
+		Seed({ static_cast<uint32_t>(X), static_cast<uint32_t>(Y), static_cast<uint32_t>(Sample), static_cast<uint32_t>(Stream) });
+	}
+
 	inline float Random() {
-		static std::uniform_real_distribution<float> distribution(0.0f, 1.0);
-		static std::mt19937 generator;
-		return distribution(generator);
+		thread_local std::uniform_real_distribution<float> distribution(0.0f, 1.0);
+		return distribution(Generator());
 	}
 
 	inline float Random(const float Min, const float Max)
@@ -1,12 +1,17 @@
 #pragma once
 
+#include "Archive.h"
 #include "Common.h"
 #include "Hittable.h"
 #include "Material.h"
 
+#include <bit>
+#include <cstdint>
+
 class ConstantMedium : public IHittable
 {
 public:
+	ConstantMedium() {}
 	ConstantMedium(std::shared_ptr<IHittable> Boundary, const float Density, std::shared_ptr<Texture> Tex)
 		: m_Boundary(Boundary), m_NegInvDensity(-1.0f / Density), m_PhaseFunction(std::make_shared<Isotropic>(Tex))
 	{}
@@ -35,6 +40,8 @@ public:
 			std::cerr << "\nTMin=" << hit1.T << ", TMax=" << hit2.T << "\n";
 		}
 
+		//Where the ray enters the boundary goes into the random number too, so media the ray passes through don't all agree
+		const float entry = hit1.T;
 		if (hit1.T < TMin) { hit1.T = TMin; }
 		if (hit2.T > TMax) { hit2.T = TMax; }
 
@@ -43,7 +50,7 @@ public:
 
 		const float rayLength = R.Direction().Length();
 		const float distWithinBoundary = (hit2.T - hit1.T) * rayLength;
-		const float hitDistance = m_NegInvDensity * std::log(Common::Random());
+		const float hitDistance = m_NegInvDensity * std::log(RandomFor(R, entry));
 
 		if (hitDistance > distWithinBoundary) { return false; }
 
@@ -66,7 +73,36 @@ public:
 	{
 		return m_Boundary->BoundingBox(T0, T1, OutBox);
 	}
+
+	bool Serialise(ArchiveWriter& Out) const
+	{
+		Out.Write(m_NegInvDensity);
+		Out.WriteMaterial(m_PhaseFunction);
+		return Out.WriteObject(m_Boundary);
+	}
+
+	void Deserialise(ArchiveReader& In)
+	{
+		m_NegInvDensity = In.Read<float>();
+		m_PhaseFunction = In.ReadMaterial();
+		m_Boundary = In.ReadObject();
+	}
+
 private:
+	// A number in (0, 1] drawn from the ray itself rather than the thread's generator, so whether a ray scatters in
+	// the medium doesn't depend on which rays were traced before it or which packet it was traced in.
+	static float RandomFor(const Ray& R, const float Entry)
+	{
+		const Point3 origin = R.Origin();
+		const Vec3 direction = R.Direction();
+		uint64_t hash = 0;
+		for (const float value : { origin.x(), origin.y(), origin.z(), direction.x(), direction.y(), direction.z(), R.Time(), Entry })
+		{
+			hash = Common::Mix(hash + std::bit_cast<uint32_t>(value) + 0x9e3779b97f4a7c15ull);
+		}
+		return static_cast<float>((hash >> 40u) + 1u) * 0x1.0p-24f;
+	}
+
 	std::shared_ptr<IHittable> m_Boundary;
 	std::shared_ptr<Material> m_PhaseFunction;
 	float m_NegInvDensity;
@@ -0,0 +1,135 @@
+#pragma once
+
+#include "Framebuffer.h"
+#include "TileScheduler.h"
+#include "Vec3.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010). Radiance is divided by albedo before filtering so
+// texture detail survives, and neighbours only contribute where colour, normal, depth and albedo agree.
+class Denoiser
+{
+public:
+	struct Parameters
+	{
+		int Iterations = 5;
+		float ColourSigma = 4.0f;
+		float NormalSigma = 0.3f;
+		float DepthSigma = 0.1f;	//Relative to the centre pixel's depth
+		float AlbedoSigma = 0.1f;
+	};
+
+	// Returns the filtered beauty layer as per-pixel averages, bottom row first.
+	static std::vector<Colour> Denoise(const Framebuffer& Frame, const Parameters& Params)
+	{
+		const int width = Frame.Width();
+		const int height = Frame.Height();
+
+		std::vector<Features> features(Frame.PixelCount());
+		std::vector<Colour> illumination(Frame.PixelCount());
+		for (int y = 0; y < height; y++)
+		{
+			for (int x = 0; x < width; x++)
+			{
+				const size_t idx = Index(x, y, width);
+				features[idx] = { Frame.Resolve(Framebuffer::Layer::Albedo, x, y), Frame.Resolve(Framebuffer::Layer::Normal, x, y),
+					Frame.Resolve(Framebuffer::Layer::Depth, x, y).x() };
+				illumination[idx] = Demodulate(Frame.Resolve(Framebuffer::Layer::Beauty, x, y), features[idx].Albedo);
+			}
+		}
+
+		std::vector<Colour> filtered(illumination.size());
+		for (int iteration = 0; iteration < Params.Iterations; iteration++)
+		{
+			const int step = 1 << iteration;
+			//Later passes see smoother input, so they can afford to be stricter about colour differences
+			const float colourSigma = Params.ColourSigma / static_cast<float>(step);
+
+			Parallel::For(static_cast<size_t>(height), [&](const size_t Row)
+			{
+				const int y = static_cast<int>(Row);
+				for (int x = 0; x < width; x++)
+				{
+					filtered[Index(x, y, width)] = FilterPixel(illumination, features, width, height, x, y, step, colourSigma, Params);
+				}
+			});
+
+			illumination.swap(filtered);
+		}
+
+		for (size_t idx = 0; idx < illumination.size(); idx++)
+		{
+			illumination[idx] = Remodulate(illumination[idx], features[idx].Albedo);
+		}
+
+		return illumination;
+	}
+
+private:
+	struct Features
+	{
+		Colour Albedo;
+		Vec3 Normal;
+		float Depth;
+	};
+
+	static size_t Index(const int X, const int Y, const int Width) { return (static_cast<size_t>(Y) * Width) + X; }
+
+	static Colour Demodulate(const Colour& Radiance, const Colour& Albedo)
+	{
+		return Colour(Radiance.x() / std::max(Albedo.x(), m_MinAlbedo), Radiance.y() / std::max(Albedo.y(), m_MinAlbedo), Radiance.z() / std::max(Albedo.z(), m_MinAlbedo));
+	}
+
+	static Colour Remodulate(const Colour& Illumination, const Colour& Albedo)
+	{
+		return Colour(Illumination.x() * std::max(Albedo.x(), m_MinAlbedo), Illumination.y() * std::max(Albedo.y(), m_MinAlbedo), Illumination.z() * std::max(Albedo.z(), m_MinAlbedo));
+	}
+
+	static Colour FilterPixel(const std::vector<Colour>& Illumination, const std::vector<Features>& Feature, const int Width, const int Height,
+		const int X, const int Y, const int Step, const float ColourSigma, const Parameters& Params)
+	{
+		static constexpr float kernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+		const size_t centreIdx = Index(X, Y, Width);
+		const Colour& centreColour = Illumination[centreIdx];
+		const Features& centre = Feature[centreIdx];
+		const float depthSigma = Params.DepthSigma * std::max(centre.Depth, 1e-3f) * Step;
+		//Compare colours relative to the centre's brightness so bright lights and dim corners are treated alike
+		const float colourScale = 1.0f + centreColour.LengthSq();
+
+		Colour sum(0.0f);
+		float weightSum = 0.0f;
+		for (int dy = -2; dy <= 2; dy++)
+		{
+			const int y = Y + (dy * Step);
+			if (y < 0 || y >= Height) { continue; }
+
+			for (int dx = -2; dx <= 2; dx++)
+			{
+				const int x = X + (dx * Step);
+				if (x < 0 || x >= Width) { continue; }
+
+				const size_t idx = Index(x, y, Width);
+				const Features& other = Feature[idx];
+
+				const float colourDistance = (Illumination[idx] - centreColour).LengthSq() / (ColourSigma * ColourSigma * colourScale);
+				const float normalDistance = (other.Normal - centre.Normal).LengthSq() / (Params.NormalSigma * Params.NormalSigma);
+				const float depthDifference = other.Depth - centre.Depth;
+				const float depthDistance = (depthDifference * depthDifference) / (depthSigma * depthSigma);
+				const float albedoDistance = (other.Albedo - centre.Albedo).LengthSq() / (Params.AlbedoSigma * Params.AlbedoSigma);
+
+				const float weight = kernel[dx + 2] * kernel[dy + 2] * std::exp(-(colourDistance + normalDistance + depthDistance + albedoDistance));
+				sum += weight * Illumination[idx];
+				weightSum += weight;
+			}
+		}
+
+		//The centre tap always has weight kernel[2]^2, so weightSum is never zero
+		return sum / weightSum;
+	}
+
+	static constexpr float m_MinAlbedo = 0.01f;
+};
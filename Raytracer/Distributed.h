@@ -0,0 +1,474 @@
+#pragma once
+
+#include "Framebuffer.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#ifndef WIN32_LEAN_AND_MEAN
+		#define WIN32_LEAN_AND_MEAN
+	#endif
+	#include <windows.h>
+	#include <fcntl.h>
+	#include <io.h>
+#else
+	#include <csignal>
+	#include <fcntl.h>
+	#include <sys/wait.h>
+	#include <unistd.h>
+#endif
+
+// A band of scanlines and the range of samples to take for them.
+struct RenderJob
+{
+	int FirstRow;
+	int RowCount;
+	int SampleStart;
+	int SampleCount;
+};
+
+namespace Distributed
+{
+	// A child process running a shell command, with a pipe to its stdin and one from its stdout. Kill may be called
+	// from another thread while this one is blocked reading, which it unblocks.
+	class Process
+	{
+	public:
+		Process() = default;
+		Process(const Process&) = delete;
+		Process& operator=(const Process&) = delete;
+		~Process() { Kill(); Close(); }
+
+		bool Running() const { return m_Input != nullptr; }
+		std::FILE* Input() const { return m_Input; }
+		std::FILE* Output() const { return m_Output; }
+
+		bool Start(const std::string& Command)
+		{
+			//Processes are started one at a time, so none inherits the pipes another is being given
+			static std::mutex startMutex;
+			const std::lock_guard<std::mutex> lock(startMutex);
+#ifdef _WIN32
+			SECURITY_ATTRIBUTES security{ sizeof(SECURITY_ATTRIBUTES), nullptr, TRUE };
+			HANDLE childInput = nullptr, input = nullptr, output = nullptr, childOutput = nullptr;
+			if (!CreatePipe(&childInput, &input, &security, 0))
+			{
+				return false;
+			}
+			if (!CreatePipe(&output, &childOutput, &security, 0))
+			{
+				CloseHandle(childInput);
+				CloseHandle(input);
+				return false;
+			}
+			SetHandleInformation(input, HANDLE_FLAG_INHERIT, 0);
+			SetHandleInformation(output, HANDLE_FLAG_INHERIT, 0);
+
+			STARTUPINFOA startup{};
+			startup.cb = sizeof(startup);
+			startup.dwFlags = STARTF_USESTDHANDLES;
+			startup.hStdInput = childInput;
+			startup.hStdOutput = childOutput;
+			startup.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+
+			//cmd.exe strips the outer quotes, so wrap the whole line to keep a quoted executable path intact. The job
+			//object lets Kill take down whatever cmd.exe started along with it.
+			std::string commandLine = "cmd.exe /c \"" + Command + "\"";
+			PROCESS_INFORMATION info{};
+			const bool started = CreateProcessA(nullptr, commandLine.data(), nullptr, nullptr, TRUE, CREATE_SUSPENDED, nullptr, nullptr, &startup, &info);
+			CloseHandle(childInput);
+			CloseHandle(childOutput);
+			if (!started)
+			{
+				CloseHandle(input);
+				CloseHandle(output);
+				return false;
+			}
+
+			m_Job = CreateJobObjectA(nullptr, nullptr);
+			JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits{};
+			limits.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
+			if (m_Job != nullptr)
+			{
+				SetInformationJobObject(m_Job, JobObjectExtendedLimitInformation, &limits, sizeof(limits));
+				AssignProcessToJobObject(m_Job, info.hProcess);
+			}
+			ResumeThread(info.hThread);
+			CloseHandle(info.hThread);
+			m_Process = info.hProcess;
+
+			m_Input = _fdopen(_open_osfhandle(reinterpret_cast<intptr_t>(input), 0), "wb");
+			m_Output = _fdopen(_open_osfhandle(reinterpret_cast<intptr_t>(output), _O_RDONLY), "rb");
+#else
+			//Writing to a worker that has died must fail rather than kill the coordinator
+			std::signal(SIGPIPE, SIG_IGN);
+
+			int toChild[2], fromChild[2];
+			if (pipe(toChild) != 0)
+			{
+				return false;
+			}
+			if (pipe(fromChild) != 0)
+			{
+				close(toChild[0]);
+				close(toChild[1]);
+				return false;
+			}
+			fcntl(toChild[1], F_SETFD, FD_CLOEXEC);
+			fcntl(fromChild[0], F_SETFD, FD_CLOEXEC);
+
+			//Built before forking, since the child of a multithreaded process mustn't allocate
+			const std::string shellCommand = "exec " + Command;
+			const pid_t pid = fork();
+			if (pid == 0)
+			{
+				//A group of its own, so Kill reaches anything a wrapper script starts as well as the command itself
+				setpgid(0, 0);
+				dup2(toChild[0], STDIN_FILENO);
+				dup2(fromChild[1], STDOUT_FILENO);
+				close(toChild[0]);
+				close(fromChild[1]);
+				execl("/bin/sh", "sh", "-c", shellCommand.c_str(), static_cast<char*>(nullptr));
+				_exit(127);
+			}
+
+			close(toChild[0]);
+			close(fromChild[1]);
+			if (pid < 0)
+			{
+				close(toChild[1]);
+				close(fromChild[0]);
+				return false;
+			}
+
+			//Also set here, so the group exists by the time Kill might need it whichever process runs first
+			setpgid(pid, pid);
+			m_Pid = pid;
+			m_Input = fdopen(toChild[1], "w");
+			m_Output = fdopen(fromChild[0], "r");
+#endif
+			if (m_Input == nullptr || m_Output == nullptr)
+			{
+				Kill();
+				Close();
+				return false;
+			}
+			return true;
+		}
+
+		void Kill()
+		{
+#ifdef _WIN32
+			if (m_Job != nullptr)
+			{
+				TerminateJobObject(m_Job, 1);
+			}
+			else if (m_Process != nullptr)
+			{
+				TerminateProcess(m_Process, 1);
+			}
+#else
+			if (m_Pid > 0)
+			{
+				kill(-m_Pid, SIGKILL);
+			}
+#endif
+		}
+
+		// Closes the pipes, which a worker takes as the end of its session, waits for the process to exit and returns
+		// its exit code, or -1 if it couldn't be found.
+		int Close()
+		{
+			if (m_Input != nullptr)
+			{
+				std::fclose(m_Input);
+				m_Input = nullptr;
+			}
+			if (m_Output != nullptr)
+			{
+				std::fclose(m_Output);
+				m_Output = nullptr;
+			}
+
+			int exitCode = -1;
+#ifdef _WIN32
+			if (m_Process != nullptr)
+			{
+				DWORD code = 0;
+				WaitForSingleObject(m_Process, INFINITE);
+				exitCode = GetExitCodeProcess(m_Process, &code) ? static_cast<int>(code) : -1;
+				CloseHandle(m_Process);
+				m_Process = nullptr;
+			}
+			if (m_Job != nullptr)
+			{
+				CloseHandle(m_Job);
+				m_Job = nullptr;
+			}
+#else
+			if (m_Pid > 0)
+			{
+				int status = 0;
+				exitCode = waitpid(m_Pid, &status, 0) == m_Pid && WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+				m_Pid = -1;
+			}
+#endif
+			return exitCode;
+		}
+
+	private:
+		std::FILE* m_Input = nullptr;
+		std::FILE* m_Output = nullptr;
+#ifdef _WIN32
+		HANDLE m_Process = nullptr;
+		HANDLE m_Job = nullptr;
+#else
+		pid_t m_Pid = -1;
+#endif
+	};
+
+	inline void SetBinaryStdout()
+	{
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+	}
+
+	constexpr uint32_t ResultMagic = 0x57525452; //"RTRW"
+
+	// Jobs go to a worker's stdin as one line of text each.
+	inline bool WriteJob(std::FILE* Out, const RenderJob& Job)
+	{
+		return std::fprintf(Out, "%d %d %d %d\n", Job.FirstRow, Job.RowCount, Job.SampleStart, Job.SampleCount) > 0 && std::fflush(Out) == 0;
+	}
+
+	inline bool ReadJob(std::FILE* In, RenderJob& OutJob)
+	{
+		return std::fscanf(In, "%d %d %d %d", &OutJob.FirstRow, &OutJob.RowCount, &OutJob.SampleStart, &OutJob.SampleCount) == 4;
+	}
+
+	// Worker output: magic, the job it answers, the framebuffer for its rows, then the magic again so truncated output is caught.
+	inline bool WriteResult(std::FILE* Out, const RenderJob& Job, const Framebuffer& Frame)
+	{
+		const int32_t header[] = { Job.FirstRow, Job.RowCount, Job.SampleStart, Job.SampleCount, Frame.Width() };
+		bool ok = std::fwrite(&ResultMagic, sizeof(ResultMagic), 1, Out) == 1;
+		ok = ok && std::fwrite(header, sizeof(header), 1, Out) == 1;
+		ok = ok && std::fwrite(Frame.Data(), sizeof(float), Frame.FloatCount(), Out) == Frame.FloatCount();
+		ok = ok && std::fwrite(&ResultMagic, sizeof(ResultMagic), 1, Out) == 1;
+		return ok && std::fflush(Out) == 0;
+	}
+
+	inline bool ReadResult(std::FILE* In, const RenderJob& Job, const int Width, Framebuffer& OutFrame)
+	{
+		uint32_t magic = 0;
+		int32_t header[5];
+		if (std::fread(&magic, sizeof(magic), 1, In) != 1 || magic != ResultMagic || std::fread(header, sizeof(header), 1, In) != 1)
+		{
+			return false;
+		}
+
+		if (header[0] != Job.FirstRow || header[1] != Job.RowCount || header[2] != Job.SampleStart || header[3] != Job.SampleCount || header[4] != Width)
+		{
+			return false;
+		}
+
+		OutFrame = Framebuffer(Width, Job.RowCount);
+		if (std::fread(OutFrame.Data(), sizeof(float), OutFrame.FloatCount(), In) != OutFrame.FloatCount())
+		{
+			return false;
+		}
+
+		return std::fread(&magic, sizeof(magic), 1, In) == 1 && magic == ResultMagic;
+	}
+}
+
+// Hands render jobs to worker processes (this executable started with --worker) and merges what they send back.
+// Each launcher is a command prefix such as "ssh render07", so the same code drives local and remote workers. A
+// worker loads its scene once and then renders job after job sent to its stdin, until the coordinator closes it.
+class Coordinator
+{
+public:
+	using LocalRender = std::function<Framebuffer(const RenderJob&)>;
+
+	// A worker that takes longer than Timeout over one job is killed and the job is rendered in this process. A zero
+	// Timeout means four times the slowest job any worker has finished so far, and no limit until one has.
+	Coordinator(const std::string& WorkerCommand, const std::vector<std::string>& Launchers, const int WorkerCount,
+		const std::chrono::seconds Timeout = std::chrono::seconds(0), const int MaxAttempts = 3)
+		: m_WorkerCommand(WorkerCommand), m_Launchers(Launchers), m_WorkerCount(WorkerCount), m_Timeout(Timeout), m_MaxAttempts(MaxAttempts)
+	{
+		if (m_Launchers.empty())
+		{
+			m_Launchers.emplace_back();
+		}
+	}
+
+	// Jobs whose workers keep dying are rendered in this process with Fallback once MaxAttempts is reached, and so
+	// are jobs whose worker timed out.
+	void Run(const std::vector<RenderJob>& Jobs, const int Width, const LocalRender& Fallback, Framebuffer& Accumulation)
+	{
+		std::deque<PendingJob> pending;
+		for (const RenderJob& job : Jobs)
+		{
+			pending.push_back({ job, 0 });
+		}
+
+		std::mutex mutex;
+		size_t remaining = Jobs.size();
+
+		auto workerLoop = [&](const int Slot)
+		{
+			const std::string& launcher = m_Launchers[Slot % m_Launchers.size()];
+			Distributed::Process worker;
+
+			while (true)
+			{
+				PendingJob current;
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					if (pending.empty())
+					{
+						break;
+					}
+
+					current = pending.front();
+					pending.pop_front();
+				}
+
+				Framebuffer data;
+				bool succeeded = false;
+				bool timedOut = false;
+				if (current.Attempts < m_MaxAttempts)
+				{
+					if (worker.Running() || worker.Start((launcher.empty() ? "" : launcher + " ") + m_WorkerCommand + " --worker"))
+					{
+						succeeded = RunJob(worker, current.Job, Width, data, timedOut);
+					}
+
+					//A worker that failed may be stuck mid-job, so the next job gets a fresh one
+					if (!succeeded)
+					{
+						worker.Kill();
+						worker.Close();
+					}
+				}
+				else
+				{
+					data = Fallback(current.Job);
+					succeeded = true;
+				}
+
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!succeeded)
+				{
+					std::cerr << "\nWorker for rows " << current.Job.FirstRow << "-" << current.Job.FirstRow + current.Job.RowCount - 1
+						<< (timedOut ? " timed out, rendering them here.\n" : " failed (attempt " + std::to_string(current.Attempts + 1) + "), reassigning.\n");
+					current.Attempts = timedOut ? m_MaxAttempts : current.Attempts + 1;
+					pending.push_back(current);
+					continue;
+				}
+
+				Accumulation.Merge(data, 0, current.Job.FirstRow);
+				remaining--;
+				std::cerr << "\rJobs remaining: " << remaining << ' ' << std::flush;
+			}
+
+			//Closing its stdin ends the worker's session
+			worker.Close();
+		};
+
+		std::vector<std::thread> slots;
+		for (int slot = 0; slot < m_WorkerCount; slot++)
+		{
+			slots.emplace_back(workerLoop, slot);
+		}
+
+		for (std::thread& slot : slots)
+		{
+			slot.join();
+		}
+	}
+
+private:
+	struct PendingJob
+	{
+		RenderJob Job;
+		int Attempts;
+	};
+
+	// Sends Job to Worker and reads back its rows, killing the worker if that takes too long.
+	bool RunJob(Distributed::Process& Worker, const RenderJob& Job, const int Width, Framebuffer& OutData, bool& OutTimedOut)
+	{
+		using Clock = std::chrono::steady_clock;
+		if (!Distributed::WriteJob(Worker.Input(), Job))
+		{
+			return false;
+		}
+
+		const Clock::duration slowest = Clock::duration(m_SlowestJob.load());
+		const Clock::duration timeout = m_Timeout.count() > 0 ? Clock::duration(m_Timeout) : 4 * slowest;
+
+		//Killing the worker's process group, or its job object on Windows, takes down anything it started too, so
+		//nothing is left holding the other end of the pipe and the read below returns
+		std::mutex mutex;
+		std::condition_variable finished;
+		bool done = false;
+		std::thread watchdog;
+		if (timeout.count() > 0)
+		{
+			watchdog = std::thread([&]
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				if (!finished.wait_for(lock, timeout, [&] { return done; }))
+				{
+					OutTimedOut = true;
+					Worker.Kill();
+				}
+			});
+		}
+
+		const auto start = Clock::now();
+		const bool read = Distributed::ReadResult(Worker.Output(), Job, Width, OutData);
+		const Clock::duration elapsed = Clock::now() - start;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			done = true;
+		}
+		finished.notify_one();
+		if (watchdog.joinable())
+		{
+			watchdog.join();
+		}
+
+		if (!read || OutTimedOut)
+		{
+			return false;
+		}
+
+		Clock::rep previous = m_SlowestJob.load();
+		while (previous < elapsed.count() && !m_SlowestJob.compare_exchange_weak(previous, elapsed.count()))
+		{
+		}
+		return true;
+	}
+
+	std::string m_WorkerCommand;
+	std::vector<std::string> m_Launchers;
+	int m_WorkerCount;
+	std::chrono::seconds m_Timeout;
+	int m_MaxAttempts;
+	std::atomic<std::chrono::steady_clock::rep> m_SlowestJob{ 0 };
+};
@@ -0,0 +1,239 @@
+#pragma once
+
+#include "Vec3.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Everything the integrator learns from one camera sample.
+struct PathSample
+{
+	Colour Direct;		//Emission seen directly or after a single bounce, plus the background
+	Colour Indirect;	//Everything that took two or more bounces
+	Colour Albedo;
+	Vec3 Normal;
+	float Depth = 0.0f;
+	uint32_t MaterialId = 0;	//0 when the camera ray missed
+};
+
+// A set of named per-pixel layers (AOVs) filled in the same pass as the beauty image. Layers hold sums over samples so
+// framebuffers from different tiles, sample ranges, cache files and worker processes combine with Merge; Resolve turns
+// a layer into per-pixel values. Rows are stored bottom first, like the rest of the renderer.
+class Framebuffer
+{
+public:
+	enum class Layer { Beauty, Albedo, Normal, Depth, MaterialId, SampleCount, Variance, Direct, Indirect, Count };
+
+	struct LayerInfo
+	{
+		const char* Name;
+		int Channels;
+	};
+
+	static const LayerInfo& Info(const Layer L)
+	{
+		static const LayerInfo layers[] = {
+			{ "beauty", 3 }, { "albedo", 3 }, { "normal", 3 }, { "depth", 1 }, { "material_id", 1 },
+			{ "sample_count", 1 }, { "variance", 1 }, { "direct", 3 }, { "indirect", 3 }
+		};
+		return layers[static_cast<int>(L)];
+	}
+
+	Framebuffer() {}
+	Framebuffer(const int Width, const int Height) : m_Width(Width), m_Height(Height)
+	{
+		size_t offset = 0;
+		for (int layer = 0; layer < LayerCount; layer++)
+		{
+			m_Offsets[layer] = offset;
+			offset += static_cast<size_t>(Info(static_cast<Layer>(layer)).Channels) * PixelCount();
+		}
+
+		m_Data.assign(offset, 0.0f);
+	}
+
+	int Width() const { return m_Width; }
+	int Height() const { return m_Height; }
+	size_t PixelCount() const { return static_cast<size_t>(m_Width) * m_Height; }
+
+	// All layers live in one block so a framebuffer can be written and read back with a single call.
+	float* Data() { return m_Data.data(); }
+	const float* Data() const { return m_Data.data(); }
+	size_t FloatCount() const { return m_Data.size(); }
+
+	float* Pixel(const Layer L, const int X, const int Y)
+	{
+		return m_Data.data() + m_Offsets[static_cast<int>(L)] + (((static_cast<size_t>(Y) * m_Width) + X) * Info(L).Channels);
+	}
+
+	const float* Pixel(const Layer L, const int X, const int Y) const
+	{
+		return m_Data.data() + m_Offsets[static_cast<int>(L)] + (((static_cast<size_t>(Y) * m_Width) + X) * Info(L).Channels);
+	}
+
+	void AddSample(const int X, const int Y, const PathSample& Sample)
+	{
+		const Colour radiance = Sample.Direct + Sample.Indirect;
+		const float luminance = Luminance(radiance);
+
+		Add3(Layer::Beauty, X, Y, radiance);
+		Add3(Layer::Albedo, X, Y, Sample.Albedo);
+		Add3(Layer::Normal, X, Y, Sample.Normal);
+		*Pixel(Layer::Depth, X, Y) += Sample.Depth;
+		*Pixel(Layer::SampleCount, X, Y) += 1.0f;
+		*Pixel(Layer::Variance, X, Y) += luminance * luminance;
+		Add3(Layer::Direct, X, Y, Sample.Direct);
+		Add3(Layer::Indirect, X, Y, Sample.Indirect);
+
+		//Ids can't be averaged, so a pixel keeps the id of the first sample that hit something
+		float& materialId = *Pixel(Layer::MaterialId, X, Y);
+		if (materialId == 0.0f)
+		{
+			materialId = static_cast<float>(Sample.MaterialId);
+		}
+	}
+
+	// Adds Source into this framebuffer with its bottom-left pixel at (OffsetX, OffsetY).
+	void Merge(const Framebuffer& Source, const int OffsetX, const int OffsetY)
+	{
+		for (int layer = 0; layer < LayerCount; layer++)
+		{
+			const Layer l = static_cast<Layer>(layer);
+			const int channels = Info(l).Channels;
+			for (int y = 0; y < Source.Height(); y++)
+			{
+				const float* source = Source.Pixel(l, 0, y);
+				float* destination = Pixel(l, OffsetX, OffsetY + y);
+				const int count = Source.Width() * channels;
+				if (l == Layer::MaterialId)
+				{
+					for (int idx = 0; idx < count; idx++)
+					{
+						destination[idx] = destination[idx] != 0.0f ? destination[idx] : source[idx];
+					}
+				}
+				else
+				{
+					for (int idx = 0; idx < count; idx++)
+					{
+						destination[idx] += source[idx];
+					}
+				}
+			}
+		}
+	}
+
+	// A copy of the Width by Height pixels with their bottom-left pixel at (X, Y).
+	Framebuffer Crop(const int X, const int Y, const int Width, const int Height) const
+	{
+		Framebuffer result(Width, Height);
+		result.CopyRows(*this, X, Y, 0, 0);
+		return result;
+	}
+
+	// Overwrites the pixels under Source, placed with its bottom-left pixel at (OffsetX, OffsetY).
+	void Paste(const Framebuffer& Source, const int OffsetX, const int OffsetY)
+	{
+		CopyRows(Source, 0, 0, OffsetX, OffsetY);
+	}
+
+	// Per-pixel value of a layer: sums are divided by the pixel's sample count, variance is the sample variance of
+	// the beauty luminance, and ids and counts are returned as stored.
+	Vec3 Resolve(const Layer L, const int X, const int Y) const
+	{
+		const float samples = *Pixel(Layer::SampleCount, X, Y);
+		const float* value = Pixel(L, X, Y);
+
+		switch (L)
+		{
+		case Layer::MaterialId:
+		case Layer::SampleCount:
+			return Vec3(value[0]);
+		case Layer::Variance:
+		{
+			if (samples < 2.0f) { return Vec3(0.0f); }
+			const float mean = Luminance(Get3(Layer::Beauty, X, Y)) / samples;
+			return Vec3(std::max((value[0] - (samples * mean * mean)) / (samples - 1.0f), 0.0f));
+		}
+		default:
+		{
+			const float scale = samples > 0.0f ? 1.0f / samples : 0.0f;
+			return Info(L).Channels == 3 ? Get3(L, X, Y) * scale : Vec3(value[0] * scale);
+		}
+		}
+	}
+
+	// Writes a resolved layer as a little-endian PFM (colour or greyscale to match the layer).
+	bool WritePFM(const Layer L, const std::string& Path) const
+	{
+		std::ofstream file(Path, std::ios::binary);
+		if (!file)
+		{
+			return false;
+		}
+
+		const int channels = Info(L).Channels;
+		file << (channels == 3 ? "PF" : "Pf") << "\n" << m_Width << ' ' << m_Height << "\n-1.0\n";
+
+		//PFM scanlines run bottom to top, which is already our row order
+		std::vector<float> row(static_cast<size_t>(m_Width) * channels);
+		for (int y = 0; y < m_Height; y++)
+		{
+			for (int x = 0; x < m_Width; x++)
+			{
+				const Vec3 value = Resolve(L, x, y);
+				for (int c = 0; c < channels; c++)
+				{
+					row[(static_cast<size_t>(x) * channels) + c] = value[c];
+				}
+			}
+
+			file.write(reinterpret_cast<const char*>(row.data()), row.size() * sizeof(float));
+		}
+
+		return static_cast<bool>(file);
+	}
+
+	static float Luminance(const Colour& C) { return (0.2126f * C.x()) + (0.7152f * C.y()) + (0.0722f * C.z()); }
+
+private:
+	static constexpr int LayerCount = static_cast<int>(Layer::Count);
+
+	// Copies the pixels of Source starting at (SourceX, SourceY) to (X, Y) here, as many as fit in whichever is smaller.
+	void CopyRows(const Framebuffer& Source, const int SourceX, const int SourceY, const int X, const int Y)
+	{
+		const int width = std::min(Source.Width() - SourceX, m_Width - X);
+		const int height = std::min(Source.Height() - SourceY, m_Height - Y);
+		for (int layer = 0; layer < LayerCount; layer++)
+		{
+			const Layer l = static_cast<Layer>(layer);
+			for (int y = 0; y < height; y++)
+			{
+				const float* source = Source.Pixel(l, SourceX, SourceY + y);
+				std::copy(source, source + (static_cast<size_t>(width) * Info(l).Channels), Pixel(l, X, Y + y));
+			}
+		}
+	}
+
+	Vec3 Get3(const Layer L, const int X, const int Y) const
+	{
+		const float* value = Pixel(L, X, Y);
+		return Vec3(value[0], value[1], value[2]);
+	}
+
+	void Add3(const Layer L, const int X, const int Y, const Vec3& Value)
+	{
+		float* value = Pixel(L, X, Y);
+		value[0] += Value.x();
+		value[1] += Value.y();
+		value[2] += Value.z();
+	}
+
+	int m_Width = 0;
+	int m_Height = 0;
+	size_t m_Offsets[LayerCount] = {};
+	std::vector<float> m_Data;
+};
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+
+#ifdef __linux__
+	#include <linux/perf_event.h>
+	#include <sys/ioctl.h>
+	#include <sys/syscall.h>
+	#include <unistd.h>
+#endif
+
+// Counts a CPU event, such as cache misses, on the calling thread and every thread it starts while counting. Only
+// Linux's perf events are supported; elsewhere, or where the kernel or a virtual machine doesn't expose the counters,
+// Available is false and Stop returns zero.
+class HardwareCounter
+{
+public:
+	enum class Event
+	{
+		CacheMisses,	//References that missed the last level of cache
+		L1DataMisses	//Loads that missed the level 1 data cache
+	};
+
+	explicit HardwareCounter(const Event Counted)
+	{
+#ifdef __linux__
+		perf_event_attr attributes{};
+		attributes.size = sizeof(attributes);
+		if (Counted == Event::CacheMisses)
+		{
+			attributes.type = PERF_TYPE_HARDWARE;
+			attributes.config = PERF_COUNT_HW_CACHE_MISSES;
+		}
+		else
+		{
+			attributes.type = PERF_TYPE_HW_CACHE;
+			attributes.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		}
+		attributes.disabled = 1;
+		attributes.inherit = 1;	//Threads count into this one's total once they've been joined
+		attributes.exclude_kernel = 1;
+		attributes.exclude_hv = 1;
+		m_File = static_cast<int>(syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0));
+#endif
+	}
+
+	~HardwareCounter()
+	{
+#ifdef __linux__
+		if (m_File >= 0) { close(m_File); }
+#endif
+	}
+
+	HardwareCounter(const HardwareCounter&) = delete;
+	HardwareCounter& operator=(const HardwareCounter&) = delete;
+
+	bool Available() const { return m_File >= 0; }
+
+	void Start()
+	{
+#ifdef __linux__
+		if (m_File >= 0)
+		{
+			ioctl(m_File, PERF_EVENT_IOC_RESET, 0);
+			ioctl(m_File, PERF_EVENT_IOC_ENABLE, 0);
+		}
+#endif
+	}
+
+	// Stops counting and returns the count since Start. Threads started in between must have finished.
+	uint64_t Stop()
+	{
+		uint64_t count = 0;
+#ifdef __linux__
+		if (m_File >= 0)
+		{
+			ioctl(m_File, PERF_EVENT_IOC_DISABLE, 0);
+			if (read(m_File, &count, sizeof(count)) != sizeof(count))
+			{
+				count = 0;
+			}
+		}
+#endif
+		return count;
+	}
+
+private:
+	int m_File = -1;
+};
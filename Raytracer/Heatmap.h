@@ -0,0 +1,53 @@
+#pragma once
+
+#include "Vec3.h"
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace Heatmap
+{
+	// Black -> blue -> cyan -> green -> yellow -> red -> white, T in [0, 1].
+	inline Colour Ramp(float T)
+	{
+		static const Colour stops[] = {
+			Colour(0.0f, 0.0f, 0.0f), Colour(0.0f, 0.0f, 1.0f), Colour(0.0f, 1.0f, 1.0f), Colour(0.0f, 1.0f, 0.0f),
+			Colour(1.0f, 1.0f, 0.0f), Colour(1.0f, 0.0f, 0.0f), Colour(1.0f, 1.0f, 1.0f)
+		};
+		constexpr int lastStop = static_cast<int>(sizeof(stops) / sizeof(stops[0])) - 1;
+
+		T = std::clamp(T, 0.0f, 1.0f) * lastStop;
+		const int stop = std::min(static_cast<int>(T), lastStop - 1);
+		const float blend = T - stop;
+		return ((1.0f - blend) * stops[stop]) + (blend * stops[stop + 1]);
+	}
+
+	// Writes Values (bottom row first, like the accumulation buffer) as a false colour PPM scaled to the largest value.
+	inline bool Write(const std::string& Path, const int Width, const int Height, const std::vector<float>& Values)
+	{
+		std::ofstream file(Path);
+		if (!file)
+		{
+			return false;
+		}
+
+		const float maxValue = Values.empty() ? 0.0f : *std::max_element(Values.begin(), Values.end());
+		const float scale = maxValue > 0.0f ? 1.0f / maxValue : 0.0f;
+
+		file << "P3\n" << Width << ' ' << Height << "\n255\n";
+		for (int y = Height - 1; y >= 0; y--)
+		{
+			for (int x = 0; x < Width; x++)
+			{
+				const Colour colour = Ramp(Values[(static_cast<size_t>(y) * Width) + x] * scale);
+				file << static_cast<int>(255.99f * std::clamp(colour.x(), 0.0f, 0.999f)) << ' '
+					<< static_cast<int>(255.99f * std::clamp(colour.y(), 0.0f, 0.999f)) << ' '
+					<< static_cast<int>(255.99f * std::clamp(colour.z(), 0.0f, 0.999f)) << '\n';
+			}
+		}
+
+		return static_cast<bool>(file);
+	}
+}
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "AABB.h"
+#include "Archive.h"
+#include "Matrix.h"
 #include "Ray.h"
 #include "Vec3.h"
 #include <memory>
@@ -17,7 +19,7 @@ struct HitRecord
 	Vec3 Normal;
 	std::shared_ptr<Material> HitMaterial;
 
-	HitRecord() : HasHit(false), T(-1.0f), Position(), Normal(), HitMaterial(nullptr) {}
+	HitRecord() : HasHit(false), T(-1.0f), U(0.0f), V(0.0f), Position(), FrontFace(false), Normal(), HitMaterial(nullptr) {}
 	HitRecord(const float T, const Point3& Pos, const Vec3& Normal, const Vec3& RayDirection, std::shared_ptr<Material> Material,
 		const float u, const float v) 
 		: HasHit(true), T(T), Position(Pos), FrontFace(Dot(RayDirection, Normal) < 0.0f), Normal(FrontFace ? Normal : -Normal), 
@@ -38,120 +40,68 @@ public:
 	virtual bool BoundingBox(const float T0, const float T1, AABB& OutBox) const = 0;
 };
 
-class Translate : public IHittable
+// An instance of another hittable placed by an affine transform. Rays are carried into the object's space once by the
+// inverse, and the hit is carried back by the forward matrix. Wrapping a Transform in another one doesn't nest: the
+// two matrices are multiplied and the outer instance points straight at the inner object.
+class Transform final : public IHittable
 {
 public:
-	Translate(std::shared_ptr<IHittable> Subject, const Vec3& Displacement) : m_Object(Subject), m_Displacement(Displacement)
-	{}
-
-	virtual bool Hit(const Ray& R, float TMin, float TMax, HitRecord& OutHit) const override
+	Transform() {}
+	Transform(std::shared_ptr<IHittable> Subject, const Matrix3x4& ToWorld) : m_Object(Subject), m_ToWorld(ToWorld)
 	{
-		Ray moved(R.Origin() - m_Displacement, R.Direction(), R.Time());
-		if (!m_Object->Hit(moved, TMin, TMax, OutHit))
+		if (const auto inner = std::dynamic_pointer_cast<Transform>(Subject))
 		{
-			return false;
+			m_Object = inner->m_Object;
+			m_ToWorld = ToWorld * inner->m_ToWorld;
 		}
 
-		OutHit.Position += m_Displacement;
-		OutHit.SetFaceNormal(R, OutHit.Normal);
-		return true;
+		m_ToLocal = m_ToWorld.Inverse();
 	}
 
-	virtual bool BoundingBox(const float T0, const float T1, AABB& OutBox) const override
+	virtual bool Hit(const Ray& R, float TMin, float TMax, HitRecord& OutHit) const override
 	{
-		if (!m_Object->BoundingBox(T0, T1, OutBox))
+		//The direction isn't renormalised, so distances along the ray are the same in both spaces
+		const Ray local(m_ToLocal.TransformPoint(R.Origin()), m_ToLocal.TransformVector(R.Direction()), R.Time());
+		if (!m_Object->Hit(local, TMin, TMax, OutHit))
 		{
 			return false;
 		}
 
-		OutBox = { OutBox.Min() + m_Displacement, OutBox.Max() + m_Displacement };
+		//The local normal already faces against the local ray, and the inverse transpose keeps it facing against R
+		OutHit.Position = m_ToWorld.TransformPoint(OutHit.Position);
+		OutHit.Normal = Normalised(m_ToLocal.TransformNormal(OutHit.Normal));
 		return true;
 	}
-private:
-	std::shared_ptr<IHittable> m_Object;
-	Point3 m_Displacement;
-};
 
-class RotateY : public IHittable
-{
-public:
-	RotateY(std::shared_ptr<IHittable> Subject, const float Theta) : m_Object(Subject)
+	virtual bool BoundingBox(const float T0, const float T1, AABB& OutBox) const override
 	{
-		const float radians = Common::DegreesToRadians(Theta);
-		m_SinTheta = std::sin(radians);
-		m_CosTheta = std::cos(radians);
-		m_HasBox = m_Object->BoundingBox(0.0f, 1.0f, m_Box);
-
-		Point3 min(Common::Infinity);
-		Point3 max(-Common::Infinity);
-
-		for (int i = 0; i < 2; i++)
+		AABB local;
+		if (!m_Object->BoundingBox(T0, T1, local))
 		{
-			for (int j = 0; j < 2; j++)
-			{
-				for (int k = 0; k < 2; k++)
-				{
-					const float x = (i * m_Box.Max().x()) + (1 - i) * m_Box.Min().x();
-					const float y = (j * m_Box.Max().y()) + (1 - j) * m_Box.Min().y();
-					const float z = (k * m_Box.Max().z()) + (1 - k) * m_Box.Min().z();
-
-					const float newX = (m_CosTheta * x) + (m_SinTheta * z);
-					const float newZ = -(m_SinTheta * x) + (m_CosTheta * z);
-
-					Vec3 tester(newX, y, newZ);
-					for (int c = 0; c < 3; c++)
-					{
-						min[c] = std::fminf(min[c], tester[c]);
-						max[c] = std::fmaxf(min[c], tester[c]);
-					}
-				}
-			}
+			return false;
 		}
 
-		m_Box = { min, max };
+		OutBox = m_ToWorld.TransformBox(local);
+		return true;
 	}
 
-	virtual bool Hit(const Ray& R, float TMin, float TMax, HitRecord& OutHit) const override
+	bool Serialise(ArchiveWriter& Out) const
 	{
-		Point3 origin = R.Origin();
-		Vec3 direction = R.Direction();
-
-		origin[0] = (m_CosTheta * R.Origin()[0]) - (m_SinTheta * R.Origin()[2]);
-		origin[2] = (m_SinTheta * R.Origin()[0]) + (m_CosTheta * R.Origin()[2]);
-		
-		direction[0] = (m_CosTheta * R.Direction()[0]) - (m_SinTheta * R.Direction()[2]);
-		direction[2] = (m_SinTheta * R.Direction()[0]) + (m_CosTheta * R.Direction()[2]);
-
-		Ray rotated(origin, direction, R.Time());
-		if (!m_Object->Hit(rotated, TMin, TMax, OutHit))
-		{
-			return false;
-		}
-
-		Point3 hitPos = OutHit.Position;
-		Vec3 hitNormal = OutHit.Normal;
-
-		hitPos[0] = (m_CosTheta * OutHit.Position[0]) + (m_SinTheta * OutHit.Position[2]);
-		hitPos[2] = -(m_SinTheta * OutHit.Position[0]) + (m_CosTheta * OutHit.Position[2]);
-
-		hitNormal[0] = (m_CosTheta * OutHit.Normal[0]) + (m_SinTheta * OutHit.Normal[2]);
-		hitNormal[2] = -(m_SinTheta * OutHit.Normal[0]) + (m_CosTheta * OutHit.Normal[2]);
-
-		OutHit.Position = hitPos;
-		OutHit.SetFaceNormal(rotated, hitNormal);
-
-		return true;
+		Out.Write(m_ToWorld);
+		Out.Write(m_ToLocal);
+		return Out.WriteObject(m_Object);
 	}
 
-	virtual bool BoundingBox(const float T0, const float T1, AABB& OutBox) const override
+	void Deserialise(ArchiveReader& In)
 	{
-		OutBox = m_Box;
-		return m_HasBox;
+		m_ToWorld = In.Read<Matrix3x4>();
+		m_ToLocal = In.Read<Matrix3x4>();
+		m_Object = In.ReadObject();
 	}
 
 private:
+
 	std::shared_ptr<IHittable> m_Object;
-	float m_SinTheta, m_CosTheta;
-	bool m_HasBox;
-	AABB m_Box;
-};
\ No newline at end of file
+	Matrix3x4 m_ToWorld;
+	Matrix3x4 m_ToLocal;
+};
@@ -0,0 +1,286 @@
+#pragma once
+
+#include "AABB.h"
+#include "Archive.h"
+#include "BVHStats.h"
+#include "BoundingVolumeHierarchy.h"
+#include "Common.h"
+#include "Hittable.h"
+#include "Matrix.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <numeric>
+#include <unordered_map>
+#include <vector>
+
+// The top level of a two-level hierarchy: a BVH over instances, each of which places a shared bottom-level BVH in
+// the world with an affine transform. The geometry is only stored once however many times it's placed, so memory
+// grows with the unique geometry and each instance costs two matrices and a box.
+//
+// Instances can be moved after the tree is built with SetTransform. The tree keeps its shape, and Refit only grows
+// or shrinks its boxes to match, which is cheap enough to do every frame; Build again if instances move far enough
+// that the old grouping no longer suits them.
+class InstanceHierarchy final : public IHittable
+{
+public:
+	InstanceHierarchy() {}
+
+	// Places Geometry in the world. Takes effect when the hierarchy is next built.
+	uint32_t Add(std::shared_ptr<const BoundingVolumeHierarchy> Geometry, const Matrix3x4& ToWorld)
+	{
+		m_Instances.emplace_back();
+		m_Instances.back().Geometry = std::move(Geometry);
+		SetTransform(static_cast<uint32_t>(m_Instances.size() - 1), ToWorld);
+		return static_cast<uint32_t>(m_Instances.size() - 1);
+	}
+
+	// Moves an instance. The tree's boxes won't account for it until the next Refit or Build.
+	void SetTransform(const uint32_t InstanceIdx, const Matrix3x4& ToWorld)
+	{
+		Instance& instance = m_Instances[InstanceIdx];
+		instance.ToWorld = ToWorld;
+		instance.ToLocal = ToWorld.Inverse();
+
+		AABB local;
+		instance.Geometry->BoundingBox(0.0f, 0.0f, local);
+		instance.Bounds = ToWorld.TransformBox(local);
+	}
+
+	void Build()
+	{
+		m_Nodes.clear();
+		m_Order.resize(m_Instances.size());
+		std::iota(m_Order.begin(), m_Order.end(), 0u);
+
+		if (!m_Instances.empty())
+		{
+			m_Nodes.reserve(2 * m_Instances.size());
+			Build(0, m_Order.size());
+		}
+	}
+
+	// Recomputes every node's box from the instances' current bounds without changing the tree. Children always
+	// come after their parent, so one backwards pass sees both children of a node before the node itself.
+	void Refit()
+	{
+		for (size_t nodeIdx = m_Nodes.size(); nodeIdx-- > 0;)
+		{
+			Node& node = m_Nodes[nodeIdx];
+			node.Box = node.Count == 0
+				? AABB(m_Nodes[nodeIdx + 1].Box, m_Nodes[node.Offset].Box)
+				: m_Instances[m_Order[node.Offset]].Bounds;
+		}
+	}
+
+	virtual bool Hit(const Ray& R, float TMin, float TMax, HitRecord& OutHit) const override
+	{
+		if (m_Nodes.empty())
+		{
+			return false;
+		}
+
+		const bool directionNegative[3] = { R.Direction().x() < 0.0f, R.Direction().y() < 0.0f, R.Direction().z() < 0.0f };
+
+		uint32_t stack[m_MaxDepth];
+		int stackSize = 0;
+		uint32_t current = 0;
+		bool anyHit = false;
+
+		while (true)
+		{
+			const Node& node = m_Nodes[current];
+			BVH_STAT(BVHStats::CountNodes(); BVHStats::CountBoxes(1));
+			if (node.Box.Hit(R, TMin, TMax))
+			{
+				if (node.Count == 0)
+				{
+					const bool leftFirst = !directionNegative[node.Axis];
+					stack[stackSize++] = leftFirst ? node.Offset : current + 1;
+					current = leftFirst ? current + 1 : node.Offset;
+					continue;
+				}
+
+				if (m_Instances[m_Order[node.Offset]].Hit(R, TMin, TMax, OutHit))
+				{
+					anyHit = true;
+					TMax = OutHit.T;
+				}
+			}
+
+			if (stackSize == 0)
+			{
+				return anyHit;
+			}
+			current = stack[--stackSize];
+		}
+	}
+
+	virtual bool BoundingBox(const float T0, const float T1, AABB& OutBox) const override
+	{
+		if (m_Nodes.empty())
+		{
+			return false;
+		}
+
+		OutBox = m_Nodes[0].Box;
+		return true;
+	}
+
+	size_t InstanceCount() const { return m_Instances.size(); }
+
+	// Nodes are stored as they are in memory, so files written with a different layout can't be read.
+	static constexpr size_t NodeSize() { return sizeof(Node); }
+
+	// Instances of the same geometry share it again after loading, so it's written once however often it's placed.
+	bool Serialise(ArchiveWriter& Out) const
+	{
+		std::vector<const BoundingVolumeHierarchy*> geometries;
+		std::unordered_map<const BoundingVolumeHierarchy*, uint32_t> geometryIndices;
+		for (const Instance& instance : m_Instances)
+		{
+			if (geometryIndices.try_emplace(instance.Geometry.get(), static_cast<uint32_t>(geometries.size())).second)
+			{
+				geometries.push_back(instance.Geometry.get());
+			}
+		}
+
+		Out.Write<uint64_t>(geometries.size());
+		for (const BoundingVolumeHierarchy* geometry : geometries)
+		{
+			if (!geometry->Serialise(Out))
+			{
+				return false;
+			}
+		}
+
+		Out.Write<uint64_t>(m_Instances.size());
+		for (const Instance& instance : m_Instances)
+		{
+			Out.Write(geometryIndices[instance.Geometry.get()]);
+			Out.Write(instance.ToWorld);
+			Out.Write(instance.ToLocal);
+			Out.Write(instance.Bounds);
+		}
+
+		Out.WriteArray(m_Order);
+		Out.WriteArray(m_Nodes);
+		return true;
+	}
+
+	void Deserialise(ArchiveReader& In)
+	{
+		std::vector<std::shared_ptr<const BoundingVolumeHierarchy>> geometries;
+		const uint64_t geometryCount = In.Read<uint64_t>();
+		for (uint64_t idx = 0; idx < geometryCount && !In.Failed; idx++)
+		{
+			const auto geometry = std::make_shared<BoundingVolumeHierarchy>();
+			geometry->Deserialise(In);
+			geometries.push_back(geometry);
+		}
+
+		const uint64_t instanceCount = In.Read<uint64_t>();
+		for (uint64_t idx = 0; idx < instanceCount && !In.Failed; idx++)
+		{
+			const uint32_t geometryIdx = In.Read<uint32_t>();
+			if (geometryIdx >= geometries.size())
+			{
+				In.Failed = true;
+				return;
+			}
+
+			Instance& instance = m_Instances.emplace_back();
+			instance.Geometry = geometries[geometryIdx];
+			instance.ToWorld = In.Read<Matrix3x4>();
+			instance.ToLocal = In.Read<Matrix3x4>();
+			instance.Bounds = In.Read<AABB>();
+		}
+
+		In.ReadArray(m_Order);
+		In.ReadArray(m_Nodes);
+	}
+
+private:
+
+	struct Instance
+	{
+		std::shared_ptr<const BoundingVolumeHierarchy> Geometry;
+		Matrix3x4 ToWorld;
+		Matrix3x4 ToLocal;
+		AABB Bounds;	//World space
+
+		// Same as Transform::Hit: the ray goes into the geometry's space unnormalised, so distances carry over.
+		bool Hit(const Ray& R, const float TMin, const float TMax, HitRecord& OutHit) const
+		{
+			const Ray local(ToLocal.TransformPoint(R.Origin()), ToLocal.TransformVector(R.Direction()), R.Time());
+			if (!Geometry->Hit(local, TMin, TMax, OutHit))
+			{
+				return false;
+			}
+
+			OutHit.Position = ToWorld.TransformPoint(OutHit.Position);
+			OutHit.Normal = Normalised(ToLocal.TransformNormal(OutHit.Normal));
+			return true;
+		}
+	};
+
+	struct Node
+	{
+		AABB Box;
+		uint32_t Offset;	//Interior nodes: index of the right child (the left one follows the node). Leaves: position in m_Order
+		uint16_t Count;		//1 for leaves, 0 for interior nodes
+		uint8_t Axis;
+	};
+
+	static constexpr int m_MaxDepth = 64;
+
+	// Splits at the median instance along the longest axis of the instances' centres. Unlike the bottom level this
+	// doesn't draw on the random generator, so rebuilding mid-render can't change what gets sampled.
+	uint32_t Build(const size_t Start, const size_t End)
+	{
+		const uint32_t nodeIdx = static_cast<uint32_t>(m_Nodes.size());
+		m_Nodes.emplace_back();
+
+		if (End - Start == 1)
+		{
+			m_Nodes[nodeIdx] = { m_Instances[m_Order[Start]].Bounds, static_cast<uint32_t>(Start), 1, 0 };
+			return nodeIdx;
+		}
+
+		Point3 centreMin(Common::Infinity);
+		Point3 centreMax(-Common::Infinity);
+		for (size_t idx = Start; idx < End; idx++)
+		{
+			const Point3 centre = Centre(m_Order[idx]);
+			for (int c = 0; c < 3; c++)
+			{
+				centreMin[c] = std::fminf(centreMin[c], centre[c]);
+				centreMax[c] = std::fmaxf(centreMax[c], centre[c]);
+			}
+		}
+
+		const Vec3 extent = centreMax - centreMin;
+		const int axis = (extent.x() >= extent.y() && extent.x() >= extent.z()) ? 0 : (extent.y() >= extent.z()) ? 1 : 2;
+
+		const size_t mid = Start + ((End - Start) / 2);
+		std::nth_element(m_Order.begin() + Start, m_Order.begin() + mid, m_Order.begin() + End,
+			[&](const uint32_t A, const uint32_t B) { return Centre(A)[axis] < Centre(B)[axis]; });
+
+		const uint32_t left = Build(Start, mid);
+		const uint32_t right = Build(mid, End);
+
+		m_Nodes[nodeIdx] = { AABB(m_Nodes[left].Box, m_Nodes[right].Box), right, 0, static_cast<uint8_t>(axis) };
+		return nodeIdx;
+	}
+
+	Point3 Centre(const uint32_t InstanceIdx) const
+	{
+		const AABB& box = m_Instances[InstanceIdx].Bounds;
+		return 0.5f * (box.Min() + box.Max());
+	}
+
+	std::vector<Instance> m_Instances;
+	std::vector<uint32_t> m_Order;	//Instance indices in leaf order
+	std::vector<Node> m_Nodes;
+};
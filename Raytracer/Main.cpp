@@ -1,30 +1,44 @@
 #include "AARect.h"
+#include "BVHStats.h"
 #include "BoundingVolumeHierarchy.h"
 #include "Box.h"
 #include "Camera.h"
 #include "Common.h"
 #include "ConstantMedium.h"
 #include "Colour.h"
+#include "Denoiser.h"
+#include "Distributed.h"
+#include "Framebuffer.h"
+#include "HardwareCounter.h"
+#include "Heatmap.h"
 #include "HittableList.h"
+#include "InstanceHierarchy.h"
 #include "Material.h"
 #include "MovingSphere.h"
+#include "RenderCache.h"
+#include "SceneCache.h"
+#include "SelfTest.h"
 #include "Sphere.h"
 #include "Ray.h"
+#include "TileScheduler.h"
 #include "Vec3.h"
+#include "WavefrontIntegrator.h"
 
+#include <atomic>
 #include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
-#include <thread>
-#include <future>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
 #include <vector>
 
-enum class Scene { Cover, Nuts, Noise, Earth, LightSimple, Cornell, SmokeCornell, Final };
-
-struct ScanlineResult
-{
-	int ScanlineIndex;
-	std::vector<Colour> ScanlineData;
-};
+enum class Scene { Cover, Nuts, Noise, Earth, LightSimple, Cornell, SmokeCornell, Final, Instances };
 
 struct Settings
 {
@@ -34,55 +48,270 @@ struct Settings
 	int SamplesPerPixel;
 	Scene SelectedScene;
 	Colour Background;
+	bool UseRenderCache = true;
+	const char* CacheDirectory = "RenderCache";
+	bool UseSceneCache = true;
+	int TileSize = 16;
+	int PilotSamples = 0;
+	double PilotSplitFactor = 4.0;
+	int SamplesPerTask = 256;
+	int PacketSize = 8;
+	bool Wavefront = false;
+	bool Denoise = false;
+	const char* AOVDirectory = nullptr;
+	const char* CostHeatmapPath = "TileCost.ppm";
+	const char* BVHStatsPath = "BVHStats.json";	//Only written when built with RAYTRACER_BVH_STATS
+	const char* TraversalHeatmapDirectory = nullptr;	//Only used when built with RAYTRACER_BVH_STATS
 
 	constexpr int Height() const { return static_cast<int>(Width / AspectRatio); }
 };
 
-Colour RayColour(const Ray& R, const Colour& Background, const BoundingVolumeHierarchy& world, int Depth)
+// Follows one camera path, splitting its radiance into direct and indirect parts and noting what the first hit looked like.
+// The camera ray's first intersection comes in already found, usually by packet traversal; the bounces after it are
+// incoherent and are traced one ray at a time.
+PathSample TracePath(const Ray& CameraRay, const bool PrimaryHit, const HitRecord& Primary, const Colour& Background,
+	const BoundingVolumeHierarchy& World, const int MaxDepth)
+{
+	PathSample sample;
+	Ray ray = CameraRay;
+	Colour throughput{ 1.0f };
+
+	for (int bounce = 0; bounce < MaxDepth; bounce++)
+	{
+		Colour& contribution = bounce <= 1 ? sample.Direct : sample.Indirect;
+
+		HitRecord hit = bounce == 0 ? Primary : HitRecord();
+		BVH_STAT(if (bounce > 0) { BVHStats::BeginRays(bounce); });
+		const bool hasHit = bounce == 0 ? PrimaryHit : World.Hit(ray, 0.001f, Common::Infinity, hit);
+		if (!hasHit)
+		{
+			contribution += throughput * Background;
+			if (bounce == 0)
+			{
+				sample.Albedo = Background;
+			}
+			break;
+		}
+
+		Ray scattered;
+		Colour attenuation;
+		const Colour emitted = hit.HitMaterial->Emit(hit.U, hit.V, hit.Position);
+		const bool scatters = hit.HitMaterial->Scatter(ray, hit, attenuation, scattered);
+		contribution += throughput * emitted;
+
+		if (bounce == 0)
+		{
+			sample.Albedo = scatters ? attenuation : emitted;
+			sample.Normal = hit.Normal;
+			sample.Depth = hit.T * ray.Direction().Length();
+			sample.MaterialId = hit.HitMaterial->Id();
+		}
+
+		if (!scatters)
+		{
+			break;
+		}
+
+		throughput = throughput * attenuation;
+		ray = scattered;
+	}
+
+	return sample;
+}
+
+// Finds the first hits of Rays N at a time and hands each one to Shade along with its index in the batch.
+template<int N, typename ShadeFunction>
+void TracePackets(const RayBatch& Rays, const BoundingVolumeHierarchy& World, const ShadeFunction& Shade)
 {
-	if (Depth <= 0)
+	for (size_t first = 0; first < Rays.Size(); first += N)
 	{
-		return Colour{ 0.0f };
+		const int count = static_cast<int>(std::min<size_t>(N, Rays.Size() - first));
+		RayPacket<N> packet(Rays, first, count, 0.001f);
+		HitRecord hits[N];
+		BVH_STAT(BVHStats::BeginRays(0, count));
+		const uint32_t hitMask = World.HitPacket(packet, hits);
+
+		for (int lane = 0; lane < count; lane++)
+		{
+			Shade(first + lane, packet.Get(lane), (hitMask >> lane) & 1u, hits[lane]);
+		}
 	}
+}
 
-	HitRecord hit;
-	if (!world.Hit(R, 0.001f, Common::Infinity, hit))
+// Adds samples SampleStart to SampleStart + SampleCount - 1 of every pixel in Region to Result, which covers just the
+// region. Each pixel's samples are added one after another in order and every sample seeds its own random sequences,
+// so tracing a range in one call or in several consecutive ones gives the same sums.
+void TraceTile(const Tile& Region, const int SampleStart, const int SampleCount, const Camera& Camera, const BoundingVolumeHierarchy& World, const Settings& Config,
+	Framebuffer& Result)
+{
+	if (Config.Wavefront)
 	{
-		return Background;
+		thread_local WavefrontIntegrator wavefront;
+		wavefront.Render(Region, SampleStart, SampleCount, Camera, World, Config.Background, Config.MaxDepth, Config.Width, Config.Height(), Result);
+		return;
 	}
 
-	Ray scattered;
-	Colour attenuation;
-	Colour emitted = hit.HitMaterial->Emit(hit.U, hit.V, hit.Position);
+	//Primary rays are generated a scanline and a handful of samples at a time, which keeps each batch small enough to stay in cache
+	constexpr int batchSamples = 16;
+	thread_local RayBatchBuffer buffer;
 
-	if (!hit.HitMaterial->Scatter(R, hit, attenuation, scattered))
+	for (int y = Region.Y0; y < Region.Y1; y++)
 	{
-		return emitted;
-	}
+		const Tile row{ Region.X0, y, Region.X1, y + 1 };
+		for (int sampleOffset = 0; sampleOffset < SampleCount; sampleOffset += batchSamples)
+		{
+			const int samples = std::min(batchSamples, SampleCount - sampleOffset);
+			const RayBatch rays = buffer.View(static_cast<size_t>(row.PixelCount()) * samples);
+			Camera.GenerateRays(row, SampleStart + sampleOffset, samples, Config.Width, Config.Height(), rays);
 
-	return emitted + attenuation * RayColour(scattered, Background, world, Depth - 1);
+			auto addSample = [&](const size_t Idx, const Ray& CameraRay, const bool PrimaryHit, const HitRecord& Primary)
+			{
+				const int x = row.X0 + static_cast<int>(Idx / samples);
+				Common::SeedSample(x, y, SampleStart + sampleOffset + static_cast<int>(Idx % samples), Common::SampleStream::Path);
+				Result.AddSample(x - Region.X0, y - Region.Y0, TracePath(CameraRay, PrimaryHit, Primary, Config.Background, World, Config.MaxDepth));
+			};
+
+			switch (Config.PacketSize)
+			{
+			case 4:
+				TracePackets<4>(rays, World, addSample);
+				break;
+			case 8:
+				TracePackets<8>(rays, World, addSample);
+				break;
+			case 16:
+				TracePackets<16>(rays, World, addSample);
+				break;
+			default:
+				for (size_t idx = 0; idx < rays.Size(); idx++)
+				{
+					HitRecord primary;
+					const Ray cameraRay = rays.Get(idx);
+					BVH_STAT(BVHStats::BeginRays(0));
+					const bool primaryHit = World.Hit(cameraRay, 0.001f, Common::Infinity, primary);
+					addSample(idx, cameraRay, primaryHit, primary);
+				}
+				break;
+			}
+		}
+	}
 }
 
-ScanlineResult TraceScanline(const int Scanline, const Camera& Camera, const BoundingVolumeHierarchy& World, const Settings& Config)
+// Renders Job's rows as tiles on all cores. With a pilot pass, the first few samples of every tile are timed and the
+// rest are scheduled longest-first; the pilot samples still count towards the image.
+//
+// Samples are traced in chunks that start at multiples of Config.SamplesPerTask, each chunk of a tile into its own
+// buffer, and a tile's chunks are summed in order. Along with per-sample seeding that makes every pixel independent
+// of how the image was cut into tiles and jobs: the pilot samples are just the start of each tile's first chunk, so
+// rendering with or without a pilot pass, locally or on workers, gives the same image bit for bit.
+Framebuffer RenderRows(const RenderJob& Job, const Camera& Camera, const BoundingVolumeHierarchy& World, const Settings& Config,
+	const bool ReportProgress, std::vector<float>* OutPixelCost = nullptr)
 {
-	ScanlineResult result;
-	result.ScanlineIndex = Scanline;
+	Framebuffer rows(Config.Width, Job.RowCount);
+	if (Job.SampleCount <= 0)
+	{
+		return rows;
+	}
+
+	std::vector<Tile> tiles = Tiles::Split({ 0, Job.FirstRow, Config.Width, Job.FirstRow + Job.RowCount }, Config.TileSize);
 
-	for (int x = 0; x < Config.Width; x++)
+	//Chunks are counted from sample 0, not from the job's first sample, so jobs that split a frame's samples between them
+	//still cut them in the same places
+	const int64_t chunkSize = Config.SamplesPerTask > 0 ? Config.SamplesPerTask : std::numeric_limits<int>::max();
+	const int sampleEnd = Job.SampleStart + Job.SampleCount;
+	const int64_t firstChunk = Job.SampleStart / chunkSize;
+	const int tasksPerTile = static_cast<int>(((sampleEnd - 1) / chunkSize) - firstChunk + 1);
+	auto chunkBegin = [&](const int Task) { return static_cast<int>(std::max<int64_t>(Job.SampleStart, (firstChunk + Task) * chunkSize)); };
+	auto chunkEnd = [&](const int Task) { return static_cast<int>(std::min<int64_t>(sampleEnd, (firstChunk + Task + 1) * chunkSize)); };
+
+	//The pilot pass traces into the rows directly, and stops at the end of the first chunk
+	int pilotSamples = 0;
+	if (Config.PilotSamples > 0 && Job.SampleCount > Config.PilotSamples)
 	{
-		Colour pixelColour{ 0.0f, 0.0f, 0.0f };
-		for (int sample = 0; sample < Config.SamplesPerPixel; sample++)
+		pilotSamples = std::min(Config.PilotSamples, chunkEnd(0) - Job.SampleStart);
+		std::vector<double> costs(tiles.size());
+		Parallel::For(tiles.size(), [&](const size_t Idx)
 		{
-			const float u = (static_cast<float>(x) + Common::Random()) / (Config.Width - 1);
-			const float v = (static_cast<float>(Scanline) + Common::Random()) / (Config.Height() - 1);
-			Ray ray = Camera.GetRay(u, v);
-			pixelColour += RayColour(ray, Config.Background, World, Config.MaxDepth);
+			const Tile& tile = tiles[Idx];
+			Framebuffer pixels(tile.Width(), tile.Height());
+			const auto start = std::chrono::steady_clock::now();
+			TraceTile(tile, Job.SampleStart, pilotSamples, Camera, World, Config, pixels);
+			costs[Idx] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+			//Tiles never overlap, so no locking is needed
+			rows.Paste(pixels, tile.X0, tile.Y0 - Job.FirstRow);
+		});
+
+		if (OutPixelCost)
+		{
+			OutPixelCost->assign(rows.PixelCount(), 0.0f);
+			for (size_t idx = 0; idx < tiles.size(); idx++)
+			{
+				const float costPerPixel = static_cast<float>(costs[idx] / tiles[idx].PixelCount());
+				for (int y = tiles[idx].Y0; y < tiles[idx].Y1; y++)
+				{
+					float* row = OutPixelCost->data() + (static_cast<size_t>(y - Job.FirstRow) * Config.Width);
+					std::fill(row + tiles[idx].X0, row + tiles[idx].X1, costPerPixel);
+				}
+			}
 		}
 
-		result.ScanlineData.push_back(pixelColour);
+		tiles = Tiles::Schedule(tiles, costs, Config.PilotSplitFactor);
 	}
 
-	return result;
+	//Splitting along the sample dimension as well keeps every core busy when a frame has fewer tiles than threads
+	std::vector<std::vector<Framebuffer>> partials(tiles.size(), std::vector<Framebuffer>(tasksPerTile));
+	std::unique_ptr<std::atomic<int>[]> tasksLeft(new std::atomic<int>[tiles.size()]);
+	for (size_t idx = 0; idx < tiles.size(); idx++)
+	{
+		tasksLeft[idx] = tasksPerTile;
+	}
+
+	std::mutex progressMutex;
+	size_t tilesRemaining = tiles.size();
+	Parallel::For(tiles.size() * tasksPerTile, [&](const size_t Idx)
+	{
+		const size_t tileIdx = Idx / tasksPerTile;
+		const int task = static_cast<int>(Idx % tasksPerTile);
+		const Tile& tile = tiles[tileIdx];
+
+		//The first chunk carries on from the pilot samples already in the rows
+		Framebuffer& partial = partials[tileIdx][task];
+		int first = chunkBegin(task);
+		if (task == 0 && pilotSamples > 0)
+		{
+			partial = rows.Crop(tile.X0, tile.Y0 - Job.FirstRow, tile.Width(), tile.Height());
+			first += pilotSamples;
+		}
+		else
+		{
+			partial = Framebuffer(tile.Width(), tile.Height());
+		}
+		TraceTile(tile, first, chunkEnd(task) - first, Camera, World, Config, partial);
+
+		//Whichever task completes a tile does the reduction, always in the same order, so the sum doesn't depend on timing
+		if (--tasksLeft[tileIdx] > 0)
+		{
+			return;
+		}
+
+		std::vector<Framebuffer>& tilePartials = partials[tileIdx];
+		for (int other = 1; other < tasksPerTile; other++)
+		{
+			tilePartials[0].Merge(tilePartials[other], 0, 0);
+		}
+
+		rows.Paste(tilePartials[0], tile.X0, tile.Y0 - Job.FirstRow);
+		std::vector<Framebuffer>().swap(tilePartials);
+
+		if (ReportProgress)
+		{
+			std::lock_guard<std::mutex> lock(progressMutex);
+			std::cerr << "\rTiles remaining: " << --tilesRemaining << ' ' << std::flush;
+		}
+	});
+
+	return rows;
 }
 
 BoundingVolumeHierarchy CoverScene()
@@ -207,13 +436,11 @@ BoundingVolumeHierarchy CornellBox()
 	objects.Add(std::make_shared<XYRect>(0.0f, 555.0f, 0.0f, 555.0f, 555.0f, white));
 
 	std::shared_ptr<IHittable> box1 = std::make_shared<Box>(Point3(0.0f), Point3(165.0f, 330.0f, 165.0f), white);
-	box1 = std::make_shared<RotateY>(box1, 15.0f);
-	box1 = std::make_shared<Translate>(box1, Vec3(265.0f, 0.0f, 295.0f));
+	box1 = std::make_shared<Transform>(box1, Matrix3x4::Translation(Vec3(265.0f, 0.0f, 295.0f)) * Matrix3x4::RotationY(15.0f));
 	objects.Add(box1);
 
 	std::shared_ptr<IHittable> box2 = std::make_shared<Box>(Point3(0.0f), Point3(165.0f), white);
-	box2 = std::make_shared<RotateY>(box2, -18.0f);
-	box2 = std::make_shared<Translate>(box2, Vec3(130.0f, 0.0f, 65.0f));
+	box2 = std::make_shared<Transform>(box2, Matrix3x4::Translation(Vec3(130.0f, 0.0f, 65.0f)) * Matrix3x4::RotationY(-18.0f));
 	objects.Add(box2);
 
 	return BoundingVolumeHierarchy(objects);
@@ -236,12 +463,10 @@ BoundingVolumeHierarchy CornellSmoke()
 	objects.Add(std::make_shared<XYRect>(0.0f, 555.0f, 0.0f, 555.0f, 555.0f, white));
 
 	std::shared_ptr<IHittable> box1 = std::make_shared<Box>(Point3(0.0f), Point3(165.0f, 330.0f, 165.0f), white);
-	box1 = std::make_shared<RotateY>(box1, 15.0f);
-	box1 = std::make_shared<Translate>(box1, Vec3(265.0f, 0.0f, 295.0f));
+	box1 = std::make_shared<Transform>(box1, Matrix3x4::Translation(Vec3(265.0f, 0.0f, 295.0f)) * Matrix3x4::RotationY(15.0f));
 
 	std::shared_ptr<IHittable> box2 = std::make_shared<Box>(Point3(0.0f), Point3(165.0f), white);
-	box2 = std::make_shared<RotateY>(box2, -18.0f);
-	box2 = std::make_shared<Translate>(box2, Vec3(130.0f, 0.0f, 65.0f));
+	box2 = std::make_shared<Transform>(box2, Matrix3x4::Translation(Vec3(130.0f, 0.0f, 65.0f)) * Matrix3x4::RotationY(-18.0f));
 
 	objects.Add(std::make_shared<ConstantMedium>(box1, 0.01f, Colour(0.0f)));
 	objects.Add(std::make_shared<ConstantMedium>(box2, 0.01f, Colour(1.0f)));
@@ -304,137 +529,676 @@ BoundingVolumeHierarchy FinalScene()
 		boxes2.Add(std::make_shared<Sphere>(Point3::Random(0.0f, 165.0f), 10.0f, white));
 	}
 
-	objects.Add(std::make_shared<Translate>(
-		std::make_shared<RotateY>(
-			std::make_shared<BoundingVolumeHierarchy>(boxes2, 0.0f, 1.0f), 15.0f),
-		Vec3(-100.0f, 270.0f, 395.0f)
-		)
-	);
+	std::shared_ptr<InstanceHierarchy> cluster = std::make_shared<InstanceHierarchy>();
+	cluster->Add(std::make_shared<BoundingVolumeHierarchy>(boxes2, 0.0f, 1.0f),
+		Matrix3x4::Translation(Vec3(-100.0f, 270.0f, 395.0f)) * Matrix3x4::RotationY(15.0f));
+	cluster->Build();
+	objects.Add(cluster);
 
-	return BoundingVolumeHierarchy(objects);
+	return BoundingVolumeHierarchy(objects, 0.0f, 1.0f);
 }
 
-int main(int argc, char** argv)
+// FinalScene's cluster of spheres placed ten thousand times. Every instance shares one bottom-level BVH.
+BoundingVolumeHierarchy InstancedClusters()
 {
-	using Clock = std::chrono::high_resolution_clock;
-	const auto startTime = Clock::now();
+	HittableList spheres;
+	for (int idx = 0; idx < 1000; idx++)
+	{
+		const Colour albedo = Colour::Random() * Colour::Random();
+		spheres.Add(std::make_shared<Sphere>(Point3::Random(0.0f, 165.0f), 10.0f, std::make_shared<Lambertian>(albedo)));
+	}
+	const std::shared_ptr<const BoundingVolumeHierarchy> cluster = std::make_shared<BoundingVolumeHierarchy>(spheres);
 
-	Settings settings{ 1200, 16.0f / 9.0f, 50, 500, Scene::Cover, Colour{0.0f} };
+	const int clustersPerSide = 100;
+	const float spacing = 250.0f;
+	std::shared_ptr<InstanceHierarchy> instances = std::make_shared<InstanceHierarchy>();
+	for (int i = 0; i < clustersPerSide; i++)
+	{
+		for (int j = 0; j < clustersPerSide; j++)
+		{
+			const Vec3 position((i - (clustersPerSide / 2)) * spacing, 0.0f, (j - (clustersPerSide / 2)) * spacing);
+			instances->Add(cluster, Matrix3x4::Translation(position) * Matrix3x4::RotationY(Common::Random(0.0f, 360.0f)) * Matrix3x4::Translation(Vec3(-82.5f, 0.0f, -82.5f)));
+		}
+	}
+	instances->Build();
+
+	HittableList objects;
+	objects.Add(instances);
 
-	Point3 lookFrom;
-	Point3 lookAt;
-	Vec3 up = Vec3(0.0f, 1.0f, 0.0f);
-	float focalDistance = 10.0f;
-	float aperture = 0.1f;
-	float fov = 20.0f;
+	std::shared_ptr<Texture> checkerTexture = std::make_shared<CheckerTexture>(Colour(0.2f, 0.3f, 0.1f), Colour(0.9f));
+	objects.Add(std::make_shared<XZRect>(-20000.0f, 20000.0f, -20000.0f, 20000.0f, -10.0f, std::make_shared<Lambertian>(checkerTexture)));
 
-	BoundingVolumeHierarchy world;
-	switch (settings.SelectedScene)
+	return BoundingVolumeHierarchy(objects);
+}
+
+// How one of the built-in scenes is built and looked at.
+struct SceneSetup
+{
+	BoundingVolumeHierarchy (*Build)() = nullptr;
+	Point3 LookFrom;
+	Point3 LookAt;
+	Vec3 Up = Vec3(0.0f, 1.0f, 0.0f);
+	float FocalDistance = 10.0f;
+	float Aperture = 0.1f;
+	float Fov = 20.0f;
+};
+
+// Also changes whatever settings the selected scene needs, such as its size and background.
+SceneSetup SetUpScene(Settings& Config)
+{
+	SceneSetup scene;
+	switch (Config.SelectedScene)
 	{
 	case Scene::Cover:
-		world = CoverScene();
-		lookFrom = Point3(13.0f, 2.0f, 3.0f);
-		lookAt = Point3(0.0f, 0.0f, 0.0f);
-		settings.Background = Colour(0.7f, 0.8f, 1.0f);
+		scene.Build = CoverScene;
+		scene.LookFrom = Point3(13.0f, 2.0f, 3.0f);
+		scene.LookAt = Point3(0.0f, 0.0f, 0.0f);
+		Config.Background = Colour(0.7f, 0.8f, 1.0f);
 		break;
 	case Scene::Nuts:
-		world = TwoSpheres();
-		lookFrom = Point3(13.0f, 2.0f, 3.0f);
-		lookAt = Point3(0.0f, 0.0f, 0.0f);
-		focalDistance = 10.0f;
-		settings.Background = Colour(0.7f, 0.8f, 1.0f);
+		scene.Build = TwoSpheres;
+		scene.LookFrom = Point3(13.0f, 2.0f, 3.0f);
+		scene.LookAt = Point3(0.0f, 0.0f, 0.0f);
+		scene.FocalDistance = 10.0f;
+		Config.Background = Colour(0.7f, 0.8f, 1.0f);
 		break;
 	case Scene::Noise:
-		world = TwoPerlinSpheres();
-		lookFrom = Point3(13.0f, 2.0f, 3.0f);
-		lookAt = Point3(0.0f, 0.0f, 0.0f);
-		settings.Background = Colour(0.7f, 0.8f, 1.0f);
+		scene.Build = TwoPerlinSpheres;
+		scene.LookFrom = Point3(13.0f, 2.0f, 3.0f);
+		scene.LookAt = Point3(0.0f, 0.0f, 0.0f);
+		Config.Background = Colour(0.7f, 0.8f, 1.0f);
 		break;
 	case Scene::Earth:
-		world = Earth();
-		lookFrom = Point3(13.0f, 2.0f, 3.0f);
-		lookAt = Point3(0.0f, 0.0f, 0.0f);
-		focalDistance = 10.0f;
-		settings.Background = Colour(0.7f, 0.8f, 1.0f);
+		scene.Build = Earth;
+		scene.LookFrom = Point3(13.0f, 2.0f, 3.0f);
+		scene.LookAt = Point3(0.0f, 0.0f, 0.0f);
+		scene.FocalDistance = 10.0f;
+		Config.Background = Colour(0.7f, 0.8f, 1.0f);
 		break;
 	case Scene::LightSimple:
-		world = SimpleLight();
-		lookFrom = Point3(26.0f, 3.0f, 6.0f);
-		lookAt = Point3(0.0f, 3.0f, 0.0f);
-		settings.Background = Colour(0.0f);
-		settings.SamplesPerPixel = 400;
+		scene.Build = SimpleLight;
+		scene.LookFrom = Point3(26.0f, 3.0f, 6.0f);
+		scene.LookAt = Point3(0.0f, 3.0f, 0.0f);
+		Config.Background = Colour(0.0f);
+		Config.SamplesPerPixel = 400;
 		break;
 	case Scene::Cornell:
-		world = CornellBox();
-		settings.AspectRatio = 1.0;
-		settings.Width = 600;
-		settings.SamplesPerPixel = 200;
-		settings.Background = Colour(0.0f);
-		lookFrom = Point3(278.0f, 278.0f, -800.0f);
-		lookAt = Point3(278.0f, 278.0f, 0.0f);
-		fov = 40.0f;
+		scene.Build = CornellBox;
+		Config.AspectRatio = 1.0;
+		Config.Width = 600;
+		Config.SamplesPerPixel = 200;
+		Config.Background = Colour(0.0f);
+		scene.LookFrom = Point3(278.0f, 278.0f, -800.0f);
+		scene.LookAt = Point3(278.0f, 278.0f, 0.0f);
+		scene.Fov = 40.0f;
 		break;
 	case Scene::SmokeCornell:
-		world = CornellSmoke();
-		settings.AspectRatio = 1.0;
-		settings.Width = 600;
-		settings.SamplesPerPixel = 200;
-		settings.Background = Colour(0.0f);
-		lookFrom = Point3(278.0f, 278.0f, -800.0f);
-		lookAt = Point3(278.0f, 278.0f, 0.0f);
-		fov = 40.0f;
+		scene.Build = CornellSmoke;
+		Config.AspectRatio = 1.0;
+		Config.Width = 600;
+		Config.SamplesPerPixel = 200;
+		Config.Background = Colour(0.0f);
+		scene.LookFrom = Point3(278.0f, 278.0f, -800.0f);
+		scene.LookAt = Point3(278.0f, 278.0f, 0.0f);
+		scene.Fov = 40.0f;
 		break;
 	case Scene::Final:
-		world = FinalScene();
-		settings.AspectRatio = 1.0;
-		settings.Width = 800;
-		settings.SamplesPerPixel = 10000;
-		settings.Background = Colour(0.0f);
-		lookFrom = Point3(478.0f, 278.0f, -600.0f);
-		lookAt = Point3(278.0f, 278.0f, 0.0f);
-		fov = 40.0f;
+		scene.Build = FinalScene;
+		Config.AspectRatio = 1.0;
+		Config.Width = 800;
+		Config.SamplesPerPixel = 10000;
+		Config.Background = Colour(0.0f);
+		scene.LookFrom = Point3(478.0f, 278.0f, -600.0f);
+		scene.LookAt = Point3(278.0f, 278.0f, 0.0f);
+		scene.Fov = 40.0f;
+		break;
+	case Scene::Instances:
+		scene.Build = InstancedClusters;
+		Config.Background = Colour(0.7f, 0.8f, 1.0f);
+		scene.LookFrom = Point3(-1500.0f, 900.0f, -2500.0f);
+		scene.LookAt = Point3(0.0f, 0.0f, 0.0f);
+		scene.Aperture = 0.0f;
+		scene.Fov = 40.0f;
 		break;
 	}
 
-	Camera camera(lookFrom, lookAt, up, fov, settings.AspectRatio, aperture, focalDistance, 0.0f, 1.0f);
+	return scene;
+}
+
+#ifdef RAYTRACER_BVH_STATS
+// Traces one camera ray through the middle of every pixel, one at a time rather than in packets so each pixel's cost
+// is its own, and writes false colour heatmaps of what they cost into Directory: BVH nodes visited, primitives tested
+// and nanoseconds taken. The counts come from BVHStats, so this only exists in builds with RAYTRACER_BVH_STATS.
+// Timings are clamped to their 99th percentile before scaling, so a ray that happened to be preempted doesn't
+// leave the rest of the image black.
+void RenderTraversalHeatmaps(const Camera& Camera, const BoundingVolumeHierarchy& World, const Settings& Config, const std::filesystem::path& Directory)
+{
+	const size_t pixelCount = static_cast<size_t>(Config.Width) * Config.Height();
+	std::vector<float> nodes(pixelCount, 0.0f);
+	std::vector<float> primitives(pixelCount, 0.0f);
+	std::vector<float> nanoseconds(pixelCount, 0.0f);
 
-	std::cout << "P3\n" << settings.Width << ' ' << settings.Height() << "\n255\n";
+	Parallel::For(static_cast<size_t>(Config.Height()), [&](const size_t Row)
+	{
+		Common::Seed({ static_cast<uint32_t>(Row) });
+		for (int x = 0; x < Config.Width; x++)
+		{
+			const size_t pixel = (Row * Config.Width) + x;
+			//The centre of the pixel, mapped onto the screen the same way GenerateRays maps the render's samples
+			const Ray ray = Camera.GetRay((x + 0.5f) / (Config.Width - 1), (Row + 0.5f) / (Config.Height() - 1));
+			HitRecord hit;
+
+			BVHStats::BeginRays(0);
+			const BVHStats::Work before = BVHStats::Local().Bounces[0];
+			const auto start = std::chrono::steady_clock::now();
+			World.Hit(ray, 0.001f, Common::Infinity, hit);
+			nanoseconds[pixel] = std::chrono::duration<float, std::nano>(std::chrono::steady_clock::now() - start).count();
+			const BVHStats::Work& after = BVHStats::Local().Bounces[0];
+			nodes[pixel] = static_cast<float>(after.Nodes - before.Nodes);
+			primitives[pixel] = static_cast<float>(after.Primitives - before.Primitives);
+		}
+	});
 
-	constexpr int ConcurrentThreadCount = 64;
-	std::future<ScanlineResult> jobs[ConcurrentThreadCount];
-	const auto finishedSetup = Clock::now();
+	std::vector<float> sorted = nanoseconds;
+	const auto percentile = sorted.begin() + ((sorted.size() * 99) / 100);
+	std::nth_element(sorted.begin(), percentile, sorted.end());
+	for (float& time : nanoseconds)
+	{
+		time = std::min(time, *percentile);
+	}
+
+	std::error_code error;
+	std::filesystem::create_directories(Directory, error);
 
-	int scanLineIdx = settings.Height() - 1;
-	while (scanLineIdx > 0)
+	auto write = [&](const char* Name, const std::vector<float>& Values)
 	{
-		int runningThreads = 0;
-		for (int threadIdx = 0; threadIdx < ConcurrentThreadCount; threadIdx++)
+		const std::filesystem::path path = Directory / Name;
+		if (!Heatmap::Write(path.string(), Config.Width, Config.Height(), Values))
+		{
+			std::cerr << "Couldn't write traversal heatmap " << path.string() << "\n";
+			return;
+		}
+
+		double total = 0.0;
+		for (const float value : Values)
 		{
-			if (scanLineIdx >= 0)
+			total += value;
+		}
+		std::cerr << std::left << std::setw(26) << Name << std::right << std::fixed << std::setprecision(1) << " mean " << std::setw(10) << total / Values.size()
+			<< "  max " << std::setw(10) << *std::max_element(Values.begin(), Values.end()) << "\n";
+	};
+
+	write("TraversalNodes.ppm", nodes);
+	write("TraversalPrimitives.ppm", primitives);
+	write("TraversalTime.ppm", nanoseconds);
+}
+#endif
+
+// Builds the top level of every built-in scene with each of the BVH's build methods, timing the build and a render of
+// SamplesPerPixel through the result and counting the cache misses the render takes. Every method rebuilds the same
+// objects, so the scenes are identical whichever builds them; trees nested inside the scenes keep the default method.
+// Each node layout builds the whole scene again from the same seed, so nested trees are laid out that way too.
+void BenchmarkBuilders(const Settings& Base, const int SamplesPerPixel)
+{
+	using Clock = std::chrono::high_resolution_clock;
+	using Method = BoundingVolumeHierarchy::BuildMethod;
+	using Layout = BoundingVolumeHierarchy::NodeLayout;
+	constexpr const char* sceneNames[] = { "Cover", "Nuts", "Noise", "Earth", "LightSimple", "Cornell", "SmokeCornell", "Final", "Instances" };
+	constexpr std::pair<Method, const char*> methods[] = { { Method::Median, "median" }, { Method::BinnedSAH, "sah" }, { Method::Spatial, "spatial" } };
+	constexpr std::pair<Layout, const char*> layouts[] = { { Layout::DepthFirst, "depth" }, { Layout::Treelets, "treelet" } };
+	const Layout defaultLayout = BoundingVolumeHierarchy::DefaultLayout;
+
+	HardwareCounter cacheMisses(HardwareCounter::Event::CacheMisses);
+	HardwareCounter l1Misses(HardwareCounter::Event::L1DataMisses);
+	if (!cacheMisses.Available() || !l1Misses.Available())
+	{
+		std::cerr << "Cache miss counters aren't available here, so those columns are left out.\n";
+	}
+
+	//Counts are in millions, or a dash where the counter isn't available
+	auto printCount = [](const HardwareCounter& Counter, const uint64_t Count)
+	{
+		if (Counter.Available())
+		{
+			std::cout << std::setw(12) << std::setprecision(2) << Count / 1.0e6;
+		}
+		else
+		{
+			std::cout << std::setw(12) << "-";
+		}
+	};
+
+	std::cout << std::left << std::setw(14) << "scene" << std::setw(9) << "layout" << std::setw(10) << "builder" << std::right << std::setw(12) << "build (ms)"
+		<< std::setw(12) << "render (s)" << std::setw(12) << "LLC miss M" << std::setw(12) << "L1D miss M" << std::setw(10) << "nodes" << std::setw(10) << "node KB" << std::setw(10) << "store KB"
+		<< std::setw(12) << "references" << std::setw(10) << "SAH cost" << "\n";
+
+	for (int sceneIdx = 0; sceneIdx < static_cast<int>(std::size(sceneNames)); sceneIdx++)
+	{
+		Settings config = Base;
+		config.SelectedScene = static_cast<Scene>(sceneIdx);
+		const SceneSetup scene = SetUpScene(config);
+		config.SamplesPerPixel = SamplesPerPixel;
+
+		const Camera camera(scene.LookFrom, scene.LookAt, scene.Up, scene.Fov, config.AspectRatio, scene.Aperture, scene.FocalDistance, 0.0f, 1.0f);
+
+		for (const auto& [layout, layoutName] : layouts)
+		{
+			BoundingVolumeHierarchy::DefaultLayout = layout;
+			Common::Generator().seed(Common::RandomEngine::DefaultSeed);
+
+			//Each method rebuilds the scene's top level tree, so that one has to keep its objects
+			BoundingVolumeHierarchy::DefaultRefittable = true;
+			const BoundingVolumeHierarchy world = scene.Build();
+			BoundingVolumeHierarchy::DefaultRefittable = false;
+
+			for (const auto& [method, methodName] : methods)
 			{
-				jobs[threadIdx] = std::async(&TraceScanline, scanLineIdx, camera, world, settings);
-				scanLineIdx--;
-				runningThreads++;
+				BoundingVolumeHierarchy tree = world;
+				const auto buildStart = Clock::now();
+				tree.Rebuild(method);
+				tree.Freeze();
+				const auto renderStart = Clock::now();
+				cacheMisses.Start();
+				l1Misses.Start();
+				RenderRows({ 0, config.Height(), 0, SamplesPerPixel }, camera, tree, config, false);
+				const uint64_t l1Count = l1Misses.Stop();
+				const uint64_t cacheCount = cacheMisses.Stop();
+				const auto renderEnd = Clock::now();
+
+				const BoundingVolumeHierarchy::BuildStats stats = tree.Stats();
+				std::cout << std::left << std::setw(14) << sceneNames[sceneIdx] << std::setw(9) << layoutName << std::setw(10) << methodName << std::right << std::fixed
+					<< std::setw(12) << std::setprecision(2) << std::chrono::duration<double, std::milli>(renderStart - buildStart).count()
+					<< std::setw(12) << std::setprecision(3) << std::chrono::duration<double>(renderEnd - renderStart).count();
+				printCount(cacheMisses, cacheCount);
+				printCount(l1Misses, l1Count);
+				std::cout << std::setw(10) << stats.Nodes << std::setw(10) << std::setprecision(1) << stats.NodeBytes / 1024.0 << std::setw(10) << stats.StoreBytes / 1024.0 << std::setw(12) << stats.References
+					<< std::setw(10) << std::setprecision(2) << stats.Cost << "\n";
 			}
 		}
+	}
+
+	BoundingVolumeHierarchy::DefaultLayout = defaultLayout;
+}
+
+// Runs SelfTest's checks, then renders small versions of a plain and a smoky scene in ways that must give the same
+// image bit for bit, and reports any that don't. Returns whether they all passed.
+bool RunSelfTests(const Settings& Base)
+{
+	auto identical = [](const Framebuffer& A, const Framebuffer& B)
+	{
+		return A.FloatCount() == B.FloatCount() && std::memcmp(A.Data(), B.Data(), A.FloatCount() * sizeof(float)) == 0;
+	};
 
-		for (int threadIdx = 0; threadIdx < runningThreads; threadIdx++)
+	bool passed = true;
+	auto check = [&](const std::string& Name, const bool Result)
+	{
+		std::cerr << (Result ? "pass  " : "FAIL  ") << Name << "\n";
+		passed = passed && Result;
+	};
+
+	check("instances: refit after SetTransform matches a fresh build", SelfTest::InstanceRefitMatchesBuild());
+	check("bvh: refit after Replace matches a fresh build", SelfTest::BVHRefitMatchesBuild());
+	check("bvh: every build method and layout finds the same hits as a list", SelfTest::BuildMethodsMatchList());
+	check("bvh: moving quantized nodes find the same hits as a list", SelfTest::MovingTreeMatchesList());
+	check("ray query: batches find the same hits as a list", SelfTest::RayQueryMatchesList());
+	check("scene cache: a saved and loaded world finds the same hits", SelfTest::SceneCacheRoundTrip());
+
+	for (const Scene selected : { Scene::Cover, Scene::SmokeCornell })
+	{
+		Settings config = Base;
+		config.SelectedScene = selected;
+		const SceneSetup scene = SetUpScene(config);
+		config.Width = 48;
+		config.MaxDepth = 8;
+		config.TileSize = 8;
+		config.SamplesPerTask = 3;
+		config.PilotSplitFactor = 1.0;
+		const BoundingVolumeHierarchy world = scene.Build();
+		const Camera camera(scene.LookFrom, scene.LookAt, scene.Up, scene.Fov, config.AspectRatio, scene.Aperture, scene.FocalDistance, 0.0f, 1.0f);
+		const RenderJob frame{ 0, config.Height(), 0, 7 };
+		const std::string sceneName = selected == Scene::Cover ? "cover" : "smoke";
+
+		for (const bool wavefront : { false, true })
+		{
+			config.Wavefront = wavefront;
+			const std::string prefix = sceneName + (wavefront ? ", wavefront: " : ", packets: ");
+			config.PilotSamples = 0;
+			const Framebuffer plain = RenderRows(frame, camera, world, config, false);
+
+			//The pilot pass times tiles and splits the slow ones, so it cuts the frame differently on every run
+			config.PilotSamples = 2;
+			check(prefix + "pilot render matches plain render", identical(plain, RenderRows(frame, camera, world, config, false)));
+			config.PilotSamples = 4;
+			check(prefix + "pilot filling the first chunk matches plain render", identical(plain, RenderRows(frame, camera, world, config, false)));
+
+			//Workers render bands of rows, which needn't line up with the tiles a local render uses
+			config.PilotSamples = 2;
+			Framebuffer banded(config.Width, config.Height());
+			for (int firstRow = 0; firstRow < config.Height(); firstRow += 5)
+			{
+				const RenderJob band{ firstRow, std::min(5, config.Height() - firstRow), frame.SampleStart, frame.SampleCount };
+				banded.Merge(RenderRows(band, camera, world, config, false), 0, firstRow);
+			}
+			check(prefix + "bands of rows with a pilot pass match plain render", identical(plain, banded));
+			config.PilotSamples = 0;
+		}
+	}
+
+	return passed;
+}
+
+int main(int argc, char** argv)
+{
+	using Clock = std::chrono::high_resolution_clock;
+	const auto startTime = Clock::now();
+
+	Settings settings{ 1200, 16.0f / 9.0f, 50, 500, Scene::Cover, Colour{0.0f} };
+
+	int workerCount = 0;
+	std::vector<std::string> launchers;
+	std::string workerCommand = std::string("\"") + argv[0] + "\"";
+	std::string workerArguments; //Options that change what gets traced, passed on so workers match a local render
+	bool isWorker = false;
+	int workerTimeout = 0;
+	int samplesPerPixel = 0;
+	int benchmarkSamples = 0;
+	bool selfTest = false;
+
+	for (int argIdx = 1; argIdx < argc; argIdx++)
+	{
+		if (std::strcmp(argv[argIdx], "--spp") == 0 && argIdx + 1 < argc)
+		{
+			samplesPerPixel = std::stoi(argv[++argIdx]);
+		}
+		else if (std::strcmp(argv[argIdx], "--no-cache") == 0)
+		{
+			settings.UseRenderCache = false;
+		}
+		else if (std::strcmp(argv[argIdx], "--no-scene-cache") == 0)
+		{
+			settings.UseSceneCache = false;
+			workerArguments += " --no-scene-cache";
+		}
+		else if (std::strcmp(argv[argIdx], "--pilot") == 0 && argIdx + 1 < argc)
+		{
+			settings.PilotSamples = std::clamp(std::stoi(argv[++argIdx]), 0, 4);
+			workerArguments += " --pilot " + std::to_string(settings.PilotSamples);
+		}
+		else if (std::strcmp(argv[argIdx], "--samples-per-task") == 0 && argIdx + 1 < argc)
+		{
+			settings.SamplesPerTask = std::stoi(argv[++argIdx]);
+			workerArguments += " --samples-per-task " + std::to_string(settings.SamplesPerTask);
+		}
+		else if (std::strcmp(argv[argIdx], "--packet") == 0 && argIdx + 1 < argc)
+		{
+			//1 traces camera rays one at a time; 4, 8 and 16 trace them as packets
+			settings.PacketSize = std::stoi(argv[++argIdx]);
+			workerArguments += " --packet " + std::to_string(settings.PacketSize);
+		}
+		else if (std::strcmp(argv[argIdx], "--bvh") == 0 && argIdx + 1 < argc)
+		{
+			//median, sah or spatial. Median draws on the random generator while building, so workers must match
+			const std::string method = argv[++argIdx];
+			BoundingVolumeHierarchy::DefaultBuildMethod = method == "spatial" ? BoundingVolumeHierarchy::BuildMethod::Spatial
+				: method == "sah" ? BoundingVolumeHierarchy::BuildMethod::BinnedSAH : BoundingVolumeHierarchy::BuildMethod::Median;
+			workerArguments += " --bvh " + method;
+		}
+		else if (std::strcmp(argv[argIdx], "--bvh-layout") == 0 && argIdx + 1 < argc)
+		{
+			//depth or treelet. Only where nodes sit in memory changes, so the image doesn't and workers needn't match
+			BoundingVolumeHierarchy::DefaultLayout = std::strcmp(argv[++argIdx], "depth") == 0
+				? BoundingVolumeHierarchy::NodeLayout::DepthFirst : BoundingVolumeHierarchy::NodeLayout::Treelets;
+		}
+		else if (std::strcmp(argv[argIdx], "--bvh-benchmark") == 0 && argIdx + 1 < argc)
+		{
+			benchmarkSamples = std::stoi(argv[++argIdx]);
+		}
+		else if (std::strcmp(argv[argIdx], "--self-test") == 0)
+		{
+			selfTest = true;
+		}
+		else if (std::strcmp(argv[argIdx], "--wavefront") == 0)
+		{
+			settings.Wavefront = true;
+			workerArguments += " --wavefront";
+		}
+		else if (std::strcmp(argv[argIdx], "--denoise") == 0)
+		{
+			settings.Denoise = true;
+		}
+		else if (std::strcmp(argv[argIdx], "--aovs") == 0 && argIdx + 1 < argc)
+		{
+			settings.AOVDirectory = argv[++argIdx];
+		}
+		else if (std::strcmp(argv[argIdx], "--traversal-heatmaps") == 0 && argIdx + 1 < argc)
+		{
+#ifdef RAYTRACER_BVH_STATS
+			settings.TraversalHeatmapDirectory = argv[++argIdx];
+#else
+			std::cerr << "--traversal-heatmaps counts nodes and primitives with BVHStats, so it needs a build with RAYTRACER_BVH_STATS.\n";
+			return 1;
+#endif
+		}
+		else if (std::strcmp(argv[argIdx], "--workers") == 0 && argIdx + 1 < argc)
+		{
+			workerCount = std::stoi(argv[++argIdx]);
+		}
+		else if (std::strcmp(argv[argIdx], "--launch") == 0 && argIdx + 1 < argc)
+		{
+			launchers.emplace_back(argv[++argIdx]);
+		}
+		else if (std::strcmp(argv[argIdx], "--worker-exe") == 0 && argIdx + 1 < argc)
+		{
+			workerCommand = argv[++argIdx];
+		}
+		else if (std::strcmp(argv[argIdx], "--worker-timeout") == 0 && argIdx + 1 < argc)
+		{
+			//Seconds a worker may spend on one job. Without it, a job may take four times the slowest one so far
+			workerTimeout = std::stoi(argv[++argIdx]);
+		}
+		else if (std::strcmp(argv[argIdx], "--worker") == 0)
+		{
+			isWorker = true;
+		}
+	}
+
+	if (selfTest)
+	{
+		return RunSelfTests(settings) ? 0 : 1;
+	}
+
+	if (benchmarkSamples > 0)
+	{
+		BenchmarkBuilders(settings, benchmarkSamples);
+		return 0;
+	}
+
+	const SceneSetup scene = SetUpScene(settings);
+	if (samplesPerPixel > 0)
+	{
+		settings.SamplesPerPixel = samplesPerPixel;
+	}
+
+	//A cached scene is exactly what building it would give, so workers can load it too; only the coordinator writes it
+	const SceneCache sceneCache(settings.CacheDirectory, SceneCache::KeyFor(static_cast<int>(settings.SelectedScene), BoundingVolumeHierarchy::DefaultBuildMethod));
+	BoundingVolumeHierarchy world;
+	if (settings.UseSceneCache && sceneCache.Load(world))
+	{
+		std::cerr << "Loaded scene from " << sceneCache.Path().string() << "\n";
+	}
+	else
+	{
+		world = scene.Build();
+		if (settings.UseSceneCache && !isWorker && !sceneCache.Save(world))
 		{
-			ScanlineResult result = jobs[threadIdx].get();
-			for (const Colour& colour : result.ScanlineData)
+			std::cerr << "Couldn't save scene to " << sceneCache.Path().string() << "\n";
+		}
+	}
+
+	Camera camera(scene.LookFrom, scene.LookAt, scene.Up, scene.Fov, settings.AspectRatio, scene.Aperture, scene.FocalDistance, 0.0f, 1.0f);
+
+#ifdef RAYTRACER_BVH_STATS
+	if (settings.TraversalHeatmapDirectory)
+	{
+		RenderTraversalHeatmaps(camera, world, settings, settings.TraversalHeatmapDirectory);
+		return 0;
+	}
+#endif
+
+	if (isWorker)
+	{
+		//Scenes are built deterministically, so a worker only needs to be told which rows and samples to trace. It
+		//keeps the scene for every job the coordinator sends, until the coordinator closes its stdin.
+		Distributed::SetBinaryStdout();
+		RenderJob job{};
+		while (Distributed::ReadJob(stdin, job))
+		{
+			if (!Distributed::WriteResult(stdout, job, RenderRows(job, camera, world, settings, false)))
 			{
-				WriteColour(std::cout, colour, settings.SamplesPerPixel);
+				return 1;
 			}
 		}
+		return 0;
+	}
 
-		std::cerr << "\rScanlines remaining: " << scanLineIdx << ' ' << std::flush;
+	//Everything that changes the image except the sample count goes into the key, so a cached buffer can only be extended.
+	//That includes the whole scene and the build that made it: code changes can change a scene without moving the camera.
+	uint64_t sceneHash = 0;
+	if (settings.UseRenderCache && !SceneCache::ContentHash(world, sceneHash))
+	{
+		std::cerr << "The scene holds objects that can't be hashed, so the render won't be cached.\n";
+		settings.UseRenderCache = false;
+	}
+
+	Hasher cacheKey;
+	cacheKey.Add(static_cast<int>(settings.SelectedScene));
+	cacheKey.Add(settings.Width);
+	cacheKey.Add(settings.AspectRatio);
+	cacheKey.Add(settings.MaxDepth);
+	cacheKey.Add(settings.Background);
+	cacheKey.Add(scene.LookFrom);
+	cacheKey.Add(scene.LookAt);
+	cacheKey.Add(scene.Up);
+	cacheKey.Add(scene.Fov);
+	cacheKey.Add(scene.Aperture);
+	cacheKey.Add(scene.FocalDistance);
+	cacheKey.Add(BoundingVolumeHierarchy::DefaultBuildMethod);
+	cacheKey.Add(sceneHash);
+	cacheKey.AddBytes(RenderCache::BuildStamp, sizeof(RenderCache::BuildStamp));
+
+	const RenderCache cache(settings.CacheDirectory, cacheKey.Value());
+	Framebuffer accumulation(settings.Width, settings.Height());
+	int cachedSamples = 0;
+	if (settings.UseRenderCache && cache.Load(settings.Width, settings.Height(), accumulation, cachedSamples))
+	{
+		std::cerr << "Continuing from " << cachedSamples << " cached samples in " << cache.Path().string() << "\n";
+	}
+
+	const int samplesToRender = std::max(settings.SamplesPerPixel - cachedSamples, 0);
+	const int totalSamples = cachedSamples + samplesToRender;
+
+	const auto finishedSetup = Clock::now();
+
+	if (samplesToRender > 0 && workerCount > 0)
+	{
+		//Several bands per worker so a slow or dead worker only holds up a small part of the image. Every pixel is
+		//seeded and summed the same way whichever band it's in, so the image matches a local render bit for bit.
+		const int rowsPerJob = std::max(settings.Height() / (workerCount * 4 * settings.TileSize), 1) * settings.TileSize;
+		std::vector<RenderJob> renderJobs;
+		for (int firstRow = 0; firstRow < settings.Height(); firstRow += rowsPerJob)
+		{
+			renderJobs.push_back({ firstRow, std::min(rowsPerJob, settings.Height() - firstRow), cachedSamples, samplesToRender });
+		}
+
+		Coordinator coordinator(workerCommand + workerArguments, launchers, workerCount, std::chrono::seconds(workerTimeout));
+		coordinator.Run(renderJobs, settings.Width,
+			[&](const RenderJob& Job) { return RenderRows(Job, camera, world, settings, false); },
+			accumulation);
+	}
+	else if (samplesToRender > 0)
+	{
+		std::vector<float> pixelCost;
+		accumulation.Merge(RenderRows({ 0, settings.Height(), cachedSamples, samplesToRender }, camera, world, settings, true, &pixelCost), 0, 0);
+
+		if (!pixelCost.empty() && !Heatmap::Write(settings.CostHeatmapPath, settings.Width, settings.Height(), pixelCost))
+		{
+			std::cerr << "\nCouldn't write tile cost heatmap " << settings.CostHeatmapPath << "\n";
+		}
 	}
 
 	const auto finishedRender = Clock::now();
 
+#ifdef RAYTRACER_BVH_STATS
+	//Only counts rays traced in this process, so a distributed render leaves out whatever its workers traced
+	std::ofstream statsFile(settings.BVHStatsPath);
+	BVHStats::WriteJson(statsFile, world.Shape(), BVHStats::Collect());
+	if (!statsFile)
+	{
+		std::cerr << "\nCouldn't write BVH statistics " << settings.BVHStatsPath << "\n";
+	}
+#endif
+
+	if (settings.UseRenderCache && samplesToRender > 0 && !cache.Save(accumulation, totalSamples))
+	{
+		std::cerr << "\nCouldn't write render cache " << cache.Path().string() << "\n";
+	}
+
+	if (settings.AOVDirectory)
+	{
+		std::error_code error;
+		std::filesystem::create_directories(settings.AOVDirectory, error);
+		for (int layer = 0; layer < static_cast<int>(Framebuffer::Layer::Count); layer++)
+		{
+			const Framebuffer::Layer l = static_cast<Framebuffer::Layer>(layer);
+			const std::filesystem::path path = std::filesystem::path(settings.AOVDirectory) / (std::string(Framebuffer::Info(l).Name) + ".pfm");
+			if (!accumulation.WritePFM(l, path.string()))
+			{
+				std::cerr << "\nCouldn't write AOV " << path.string() << "\n";
+			}
+		}
+	}
+
+	std::vector<Colour> image;
+	if (settings.Denoise)
+	{
+		image = Denoiser::Denoise(accumulation, Denoiser::Parameters{});
+	}
+	else
+	{
+		image.reserve(accumulation.PixelCount());
+		for (int y = 0; y < settings.Height(); y++)
+		{
+			for (int x = 0; x < settings.Width; x++)
+			{
+				image.push_back(accumulation.Resolve(Framebuffer::Layer::Beauty, x, y));
+			}
+		}
+	}
+
+	const auto finishedDenoise = Clock::now();
+
+	std::cout << "P3\n" << settings.Width << ' ' << settings.Height() << "\n255\n";
+	for (int y = settings.Height() - 1; y >= 0; y--)
+	{
+		for (int x = 0; x < settings.Width; x++)
+		{
+			WriteColour(std::cout, image[(static_cast<size_t>(y) * settings.Width) + x], 1);
+		}
+	}
+
 	using DurationUnit = std::chrono::duration<float>;
 	const DurationUnit setupDuration = std::chrono::duration_cast<DurationUnit>(finishedSetup - startTime);
 	const DurationUnit renderDuration = std::chrono::duration_cast<DurationUnit>(finishedRender - finishedSetup);
-	const DurationUnit totalDuration = std::chrono::duration_cast<DurationUnit>(finishedRender - startTime);
-	std::cerr << "\nDone.\nSetup time: " << setupDuration.count() << "s\nRender time: " << renderDuration.count() << "s\nTotal time: " << totalDuration.count() << "s";
+	const DurationUnit denoiseDuration = std::chrono::duration_cast<DurationUnit>(finishedDenoise - finishedRender);
+	const DurationUnit totalDuration = std::chrono::duration_cast<DurationUnit>(finishedDenoise - startTime);
+	std::cerr << "\nDone.\nSetup time: " << setupDuration.count() << "s\nRender time: " << renderDuration.count() << "s";
+	if (settings.Denoise)
+	{
+		std::cerr << "\nDenoise time: " << denoiseDuration.count() << "s";
+	}
+	std::cerr << "\nTotal time: " << totalDuration.count() << "s";
+	if (settings.Wavefront)
+	{
+		WavefrontIntegrator::ReportShading(std::cerr);
+	}
 }
\ No newline at end of file
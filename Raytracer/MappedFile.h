@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+
+#ifdef _WIN32
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#ifndef WIN32_LEAN_AND_MEAN
+		#define WIN32_LEAN_AND_MEAN
+	#endif
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+// A whole file mapped read-only into memory, so it can be used where it lies instead of being read into a buffer.
+// Data is null if the file couldn't be opened or is empty.
+class MappedFile
+{
+public:
+	explicit MappedFile(const std::filesystem::path& Path)
+	{
+#ifdef _WIN32
+		m_File = CreateFileW(Path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		LARGE_INTEGER size;
+		if (m_File == INVALID_HANDLE_VALUE || !GetFileSizeEx(m_File, &size) || size.QuadPart == 0)
+		{
+			return;
+		}
+
+		m_Mapping = CreateFileMappingW(m_File, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (m_Mapping == nullptr)
+		{
+			return;
+		}
+
+		m_Data = static_cast<const uint8_t*>(MapViewOfFile(m_Mapping, FILE_MAP_READ, 0, 0, 0));
+		m_Size = m_Data ? static_cast<size_t>(size.QuadPart) : 0;
+#else
+		m_File = open(Path.c_str(), O_RDONLY);
+		struct stat info;
+		if (m_File < 0 || fstat(m_File, &info) != 0 || info.st_size == 0)
+		{
+			return;
+		}
+
+		void* data = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, m_File, 0);
+		if (data == MAP_FAILED)
+		{
+			return;
+		}
+
+		m_Data = static_cast<const uint8_t*>(data);
+		m_Size = static_cast<size_t>(info.st_size);
+#endif
+	}
+
+	~MappedFile()
+	{
+#ifdef _WIN32
+		if (m_Data) { UnmapViewOfFile(m_Data); }
+		if (m_Mapping) { CloseHandle(m_Mapping); }
+		if (m_File != INVALID_HANDLE_VALUE) { CloseHandle(m_File); }
+#else
+		if (m_Data) { munmap(const_cast<uint8_t*>(m_Data), m_Size); }
+		if (m_File >= 0) { close(m_File); }
+#endif
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	const uint8_t* Data() const { return m_Data; }
+	size_t Size() const { return m_Size; }
+
+private:
+#ifdef _WIN32
+	HANDLE m_File = INVALID_HANDLE_VALUE;
+	HANDLE m_Mapping = nullptr;
+#else
+	int m_File = -1;
+#endif
+	const uint8_t* m_Data = nullptr;
+	size_t m_Size = 0;
+};
@@ -1,25 +1,68 @@
 #pragma once
 
+#include "Archive.h"
 #include "Common.h"
 #include "Colour.h"
 #include "Hittable.h"
 #include "Ray.h"
 #include "Texture.h"
 
+#include <algorithm>
+#include <memory>
+
 struct HitRecord;
 
 class Material
 {
 public:
+	// Every concrete material is final, so code that has switched on the type can call it without virtual dispatch.
+	enum class Type { Lambertian, Metal, Dielectric, DiffuseLight, Isotropic, Count };
+
+	Material(const Type MaterialType, const Texture::Type TextureType = Texture::Type::None)
+		: m_Id(m_NextId++), m_Type(MaterialType), m_TextureType(TextureType)
+	{}
+
 	virtual bool Scatter(const Ray& R, const HitRecord& Hit, Colour& Attenuation, Ray& Scattered) const = 0;
 	virtual Colour Emit(const float U, const float V, const Point3& P) const { return Colour{ 0.0f }; }
+
+	//Scenes are built in a fixed order, so ids are stable between runs
+	uint32_t Id() const { return m_Id; }
+	Type GetType() const { return m_Type; }
+	Texture::Type GetTextureType() const { return m_TextureType; }
+
+	static const char* TypeName(const Type T)
+	{
+		static const char* names[] = { "Lambertian", "Metal", "Dielectric", "DiffuseLight", "Isotropic" };
+		return names[static_cast<int>(T)];
+	}
+
+	// Writes the type, the id and then the material's own fields, which Deserialise makes a material of that type
+	// from. The id comes back too, so materials sort the same way after loading, and ids handed out afterwards
+	// don't clash with it.
+	void Serialise(ArchiveWriter& Out) const
+	{
+		Out.Write(m_Type);
+		Out.Write(m_Id);
+		SerialiseFields(Out);
+	}
+
+	static std::shared_ptr<Material> Deserialise(ArchiveReader& In);
+
+protected:
+	virtual void SerialiseFields(ArchiveWriter& Out) const = 0;
+
+private:
+	inline static uint32_t m_NextId = 1; //0 is reserved for "no material"
+	uint32_t m_Id;
+	Type m_Type;
+	Texture::Type m_TextureType;
 };
 
-class Lambertian : public Material
+class Lambertian final : public Material
 {
 public:
-	Lambertian(const Colour& Albedo) : m_Albedo(std::make_shared<SolidColour>(Albedo)) {}
-	Lambertian(const std::shared_ptr<Texture> Albedo) : m_Albedo(Albedo) {}
+	Lambertian(const Colour& Albedo) : Lambertian(std::make_shared<SolidColour>(Albedo)) {}
+	Lambertian(const std::shared_ptr<Texture> Albedo) : Material(Type::Lambertian, Albedo->GetType()), m_Albedo(Albedo) {}
 
 	virtual bool Scatter(const Ray& R, const HitRecord& Hit, Colour& Attenuation, Ray& Scattered) const override
 	{
@@ -36,14 +79,23 @@ public:
 		return true;
 	}
 
+	static std::shared_ptr<Lambertian> DeserialiseFields(ArchiveReader& In)
+	{
+		const std::shared_ptr<Texture> albedo = In.ReadTexture();
+		return albedo ? std::make_shared<Lambertian>(albedo) : nullptr;
+	}
+
+protected:
+	virtual void SerialiseFields(ArchiveWriter& Out) const override { Out.WriteTexture(m_Albedo); }
+
 private:
 	std::shared_ptr<Texture> m_Albedo;
 };
 
-class Metal : public Material
+class Metal final : public Material
 {
 public:
-	Metal(const Colour& Albedo, const float Fuzziness) : m_Albedo(Albedo), m_Fuzziness(Fuzziness < 1 ? Fuzziness : 1.0f) {}
+	Metal(const Colour& Albedo, const float Fuzziness) : Material(Type::Metal), m_Albedo(Albedo), m_Fuzziness(Fuzziness < 1 ? Fuzziness : 1.0f) {}
 
 	virtual bool Scatter(const Ray& R, const HitRecord& Hit, Colour& Attenuation, Ray& Scattered) const override
 	{
@@ -53,15 +105,30 @@ public:
 
 		return (Dot(Scattered.Direction(), Hit.Normal) > 0.0f);
 	}
+
+	static std::shared_ptr<Metal> DeserialiseFields(ArchiveReader& In)
+	{
+		const Colour albedo = In.Read<Colour>();
+		return std::make_shared<Metal>(albedo, In.Read<float>());
+	}
+
+protected:
+	virtual void SerialiseFields(ArchiveWriter& Out) const override
+	{
+		Out.Write(m_Albedo);
+		Out.Write(m_Fuzziness);
+	}
+
 private:
+
 	Colour m_Albedo;
 	float m_Fuzziness;
 };
 
-class Dielectric : public Material
+class Dielectric final : public Material
 {
 public:
-	Dielectric(const float IndexOfRefraction) : m_IR(IndexOfRefraction) {}
+	Dielectric(const float IndexOfRefraction) : Material(Type::Dielectric), m_IR(IndexOfRefraction) {}
 	virtual bool Scatter(const Ray& R, const HitRecord& Hit, Colour& Attenuation, Ray& Scattered) const override
 	{
 		Attenuation = { 1.0f };
@@ -86,6 +153,11 @@ public:
 		return true;
 	}
 
+	static std::shared_ptr<Dielectric> DeserialiseFields(ArchiveReader& In) { return std::make_shared<Dielectric>(In.Read<float>()); }
+
+protected:
+	virtual void SerialiseFields(ArchiveWriter& Out) const override { Out.Write(m_IR); }
+
 private:
 	static float Reflectance(const float cosine, const float refIdx)
 	{
@@ -94,14 +166,14 @@ private:
 		r0 = r0 * r0;
 		return r0 + ((1.0f - r0) * std::powf(1.0f - cosine, 5.0f));
 	}
-private:
+
 	float m_IR;
 };
 
-class DiffuseLight : public Material
+class DiffuseLight final : public Material
 {
 public:
-	DiffuseLight(std::shared_ptr<Texture> Emit) : m_Emit(Emit) {}
+	DiffuseLight(std::shared_ptr<Texture> Emit) : Material(Type::DiffuseLight, Emit->GetType()), m_Emit(Emit) {}
 	DiffuseLight(const Colour& Emit) : DiffuseLight(std::make_shared<SolidColour>(Emit)) {}
 
 	virtual bool Scatter(const Ray& R, const HitRecord& Hit, Colour& Attenuation, Ray& Scattered) const override { return false; }
@@ -110,14 +182,24 @@ public:
 		return m_Emit->Value(u, v, P);
 	}
 
+	static std::shared_ptr<DiffuseLight> DeserialiseFields(ArchiveReader& In)
+	{
+		const std::shared_ptr<Texture> emit = In.ReadTexture();
+		return emit ? std::make_shared<DiffuseLight>(emit) : nullptr;
+	}
+
+protected:
+	virtual void SerialiseFields(ArchiveWriter& Out) const override { Out.WriteTexture(m_Emit); }
+
 private:
+
 	std::shared_ptr<Texture> m_Emit;
 };
 
-class Isotropic : public Material
+class Isotropic final : public Material
 {
 public:
-	Isotropic(std::shared_ptr<Texture> Tex) : m_Albedo(Tex) {}
+	Isotropic(std::shared_ptr<Texture> Tex) : Material(Type::Isotropic, Tex->GetType()), m_Albedo(Tex) {}
 	Isotropic(const Colour& Albedo) : Isotropic(std::make_shared<SolidColour>(Albedo)) {}
 
 	virtual bool Scatter(const Ray& R, const HitRecord& Hit, Colour& Attenuation, Ray& Scattered) const override
@@ -128,6 +210,43 @@ public:
 		return true;
 	}
 
+	static std::shared_ptr<Isotropic> DeserialiseFields(ArchiveReader& In)
+	{
+		const std::shared_ptr<Texture> albedo = In.ReadTexture();
+		return albedo ? std::make_shared<Isotropic>(albedo) : nullptr;
+	}
+
+protected:
+	virtual void SerialiseFields(ArchiveWriter& Out) const override { Out.WriteTexture(m_Albedo); }
+
 private:
+
 	std::shared_ptr<Texture> m_Albedo;
-};
\ No newline at end of file
+};
+
+inline std::shared_ptr<Material> Material::Deserialise(ArchiveReader& In)
+{
+	const Type type = In.Read<Type>();
+	const uint32_t id = In.Read<uint32_t>();
+
+	std::shared_ptr<Material> material;
+	switch (type)
+	{
+	case Type::Lambertian:		material = Lambertian::DeserialiseFields(In); break;
+	case Type::Metal:			material = Metal::DeserialiseFields(In); break;
+	case Type::Dielectric:		material = Dielectric::DeserialiseFields(In); break;
+	case Type::DiffuseLight:	material = DiffuseLight::DeserialiseFields(In); break;
+	case Type::Isotropic:		material = Isotropic::DeserialiseFields(In); break;
+	default:					break;
+	}
+
+	if (In.Failed || !material)
+	{
+		In.Failed = true;
+		return nullptr;
+	}
+
+	material->m_Id = id;
+	m_NextId = std::max(m_NextId, id + 1);
+	return material;
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include "AABB.h"
+#include "Common.h"
+#include "Vec3.h"
+
+#include <cmath>
+
+// An affine transform stored as the top three rows of a 4x4 matrix: a 3x3 linear part and a translation column.
+// Products compose right to left, so (A * B) applies B first.
+class Matrix3x4
+{
+public:
+	Matrix3x4() : m_M{ { 1.0f, 0.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, 1.0f, 0.0f } } {}
+
+	static Matrix3x4 Identity() { return Matrix3x4(); }
+
+	static Matrix3x4 Translation(const Vec3& Offset)
+	{
+		Matrix3x4 result;
+		result.m_M[0][3] = Offset.x();
+		result.m_M[1][3] = Offset.y();
+		result.m_M[2][3] = Offset.z();
+		return result;
+	}
+
+	static Matrix3x4 RotationY(const float Degrees)
+	{
+		const float radians = Common::DegreesToRadians(Degrees);
+		const float sinTheta = std::sin(radians);
+		const float cosTheta = std::cos(radians);
+
+		Matrix3x4 result;
+		result.m_M[0][0] = cosTheta;
+		result.m_M[0][2] = sinTheta;
+		result.m_M[2][0] = -sinTheta;
+		result.m_M[2][2] = cosTheta;
+		return result;
+	}
+
+	static Matrix3x4 Scaling(const Vec3& Factors)
+	{
+		Matrix3x4 result;
+		result.m_M[0][0] = Factors.x();
+		result.m_M[1][1] = Factors.y();
+		result.m_M[2][2] = Factors.z();
+		return result;
+	}
+
+	float operator()(const int Row, const int Column) const { return m_M[Row][Column]; }
+
+	Point3 TransformPoint(const Point3& P) const
+	{
+		return Point3(
+			(m_M[0][0] * P.x()) + (m_M[0][1] * P.y()) + (m_M[0][2] * P.z()) + m_M[0][3],
+			(m_M[1][0] * P.x()) + (m_M[1][1] * P.y()) + (m_M[1][2] * P.z()) + m_M[1][3],
+			(m_M[2][0] * P.x()) + (m_M[2][1] * P.y()) + (m_M[2][2] * P.z()) + m_M[2][3]);
+	}
+
+	Vec3 TransformVector(const Vec3& V) const
+	{
+		return Vec3(
+			(m_M[0][0] * V.x()) + (m_M[0][1] * V.y()) + (m_M[0][2] * V.z()),
+			(m_M[1][0] * V.x()) + (m_M[1][1] * V.y()) + (m_M[1][2] * V.z()),
+			(m_M[2][0] * V.x()) + (m_M[2][1] * V.y()) + (m_M[2][2] * V.z()));
+	}
+
+	// Multiplies by the transpose of the linear part. Called on the inverse, this carries normals the other way.
+	Vec3 TransformNormal(const Vec3& N) const
+	{
+		return Vec3(
+			(m_M[0][0] * N.x()) + (m_M[1][0] * N.y()) + (m_M[2][0] * N.z()),
+			(m_M[0][1] * N.x()) + (m_M[1][1] * N.y()) + (m_M[2][1] * N.z()),
+			(m_M[0][2] * N.x()) + (m_M[1][2] * N.y()) + (m_M[2][2] * N.z()));
+	}
+
+	// The smallest axis-aligned box around all eight corners of Box once they've been transformed.
+	AABB TransformBox(const AABB& Box) const
+	{
+		Point3 min(Common::Infinity);
+		Point3 max(-Common::Infinity);
+		for (int corner = 0; corner < 8; corner++)
+		{
+			const Point3 p = TransformPoint(Point3(
+				(corner & 1) ? Box.Max().x() : Box.Min().x(),
+				(corner & 2) ? Box.Max().y() : Box.Min().y(),
+				(corner & 4) ? Box.Max().z() : Box.Min().z()));
+
+			for (int c = 0; c < 3; c++)
+			{
+				min[c] = std::fminf(min[c], p[c]);
+				max[c] = std::fmaxf(max[c], p[c]);
+			}
+		}
+
+		return { min, max };
+	}
+
+	Matrix3x4 operator*(const Matrix3x4& Rhs) const
+	{
+		Matrix3x4 result;
+		for (int row = 0; row < 3; row++)
+		{
+			for (int column = 0; column < 4; column++)
+			{
+				result.m_M[row][column] = (m_M[row][0] * Rhs.m_M[0][column]) + (m_M[row][1] * Rhs.m_M[1][column]) + (m_M[row][2] * Rhs.m_M[2][column]);
+			}
+			result.m_M[row][3] += m_M[row][3];
+		}
+		return result;
+	}
+
+	// Inverts the linear part by cofactors and carries the translation through it. The transform must not be singular.
+	Matrix3x4 Inverse() const
+	{
+		const float c00 = (m_M[1][1] * m_M[2][2]) - (m_M[1][2] * m_M[2][1]);
+		const float c01 = (m_M[1][2] * m_M[2][0]) - (m_M[1][0] * m_M[2][2]);
+		const float c02 = (m_M[1][0] * m_M[2][1]) - (m_M[1][1] * m_M[2][0]);
+		const float inverseDeterminant = 1.0f / ((m_M[0][0] * c00) + (m_M[0][1] * c01) + (m_M[0][2] * c02));
+
+		Matrix3x4 result;
+		result.m_M[0][0] = c00 * inverseDeterminant;
+		result.m_M[1][0] = c01 * inverseDeterminant;
+		result.m_M[2][0] = c02 * inverseDeterminant;
+		result.m_M[0][1] = ((m_M[0][2] * m_M[2][1]) - (m_M[0][1] * m_M[2][2])) * inverseDeterminant;
+		result.m_M[1][1] = ((m_M[0][0] * m_M[2][2]) - (m_M[0][2] * m_M[2][0])) * inverseDeterminant;
+		result.m_M[2][1] = ((m_M[0][1] * m_M[2][0]) - (m_M[0][0] * m_M[2][1])) * inverseDeterminant;
+		result.m_M[0][2] = ((m_M[0][1] * m_M[1][2]) - (m_M[0][2] * m_M[1][1])) * inverseDeterminant;
+		result.m_M[1][2] = ((m_M[0][2] * m_M[1][0]) - (m_M[0][0] * m_M[1][2])) * inverseDeterminant;
+		result.m_M[2][2] = ((m_M[0][0] * m_M[1][1]) - (m_M[0][1] * m_M[1][0])) * inverseDeterminant;
+
+		const Vec3 translation = result.TransformVector(Vec3(m_M[0][3], m_M[1][3], m_M[2][3]));
+		result.m_M[0][3] = -translation.x();
+		result.m_M[1][3] = -translation.y();
+		result.m_M[2][3] = -translation.z();
+		return result;
+	}
+
+private:
+	float m_M[3][4];
+};
@@ -1,9 +1,10 @@
 #pragma once
 
+#include "Archive.h"
 #include "Common.h"
 #include "Hittable.h"
 
-class MovingSphere : public IHittable
+class MovingSphere final : public IHittable
 {
 public:
 	MovingSphere(){}
@@ -11,7 +12,17 @@ public:
 		: m_Centre0(Centre0), m_Centre1(Centre1), m_T0(T0), m_T1(T1), m_Radius(Radius), m_Material(Mat)
 	{}
 
-	Point3 Position(const float Time) const { return m_Centre0 + ((Time - m_T0) / (m_T1 - m_T0)) * (m_Centre1 - m_Centre0); }
+	Point3 Position(const float Time) const
+	{
+		const float timeRange = m_T1 - m_T0;
+		return timeRange != 0.0f ? m_Centre0 + ((Time - m_T0) / timeRange) * (m_Centre1 - m_Centre0) : m_Centre0;
+	}
+	Point3 Centre0() const { return m_Centre0; }
+	Point3 Centre1() const { return m_Centre1; }
+	float T0() const { return m_T0; }
+	float T1() const { return m_T1; }
+	float Radius() const { return m_Radius; }
+	std::shared_ptr<Material> Mat() const { return m_Material; }
 
 	virtual bool Hit(const Ray& R, float TMin, float TMax, HitRecord& OutHit) const override
 	{
@@ -65,6 +76,27 @@ public:
 		return { phi / (2 * Common::pi), theta / Common::pi };
 	}
 
+	bool Serialise(ArchiveWriter& Out) const
+	{
+		Out.Write(m_Centre0);
+		Out.Write(m_Centre1);
+		Out.Write(m_T0);
+		Out.Write(m_T1);
+		Out.Write(m_Radius);
+		Out.WriteMaterial(m_Material);
+		return true;
+	}
+
+	void Deserialise(ArchiveReader& In)
+	{
+		m_Centre0 = In.Read<Point3>();
+		m_Centre1 = In.Read<Point3>();
+		m_T0 = In.Read<float>();
+		m_T1 = In.Read<float>();
+		m_Radius = In.Read<float>();
+		m_Material = In.ReadMaterial();
+	}
+
 private:
 	Point3 m_Centre0, m_Centre1;
 	float m_T0, m_T1;
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+// Allocates from the start of a memory page, so an array whose elements divide the page size evenly has every
+// PageSize / sizeof(T)'th element start a page of its own.
+template<typename T>
+struct PageAllocator
+{
+	using value_type = T;
+
+	static constexpr size_t PageSize = 4096;
+
+	PageAllocator() = default;
+	template<typename U>
+	PageAllocator(const PageAllocator<U>&) {}
+
+	T* allocate(const size_t Count)
+	{
+		return static_cast<T*>(::operator new(Count * sizeof(T), std::align_val_t{ PageSize }));
+	}
+
+	void deallocate(T* Pointer, const size_t)
+	{
+		::operator delete(Pointer, std::align_val_t{ PageSize });
+	}
+
+	template<typename U>
+	bool operator==(const PageAllocator<U>&) const { return true; }
+};
+
+template<typename T>
+using PageVector = std::vector<T, PageAllocator<T>>;
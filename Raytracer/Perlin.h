@@ -1,5 +1,6 @@
 #pragma once
 
+#include "Archive.h"
 #include "Common.h"
 #include "Vec3.h"
 
@@ -66,6 +67,24 @@ public:
 
 		return std::fabsf(accum);
 	}
+
+	void Serialise(ArchiveWriter& Out) const
+	{
+		Out.WriteArray(m_RandVec, m_PointCount);
+		Out.WriteArray(m_PermX, m_PointCount);
+		Out.WriteArray(m_PermY, m_PointCount);
+		Out.WriteArray(m_PermZ, m_PointCount);
+	}
+
+	// Overwrites the tables the constructor made.
+	void Deserialise(ArchiveReader& In)
+	{
+		In.ReadArray(m_RandVec, m_PointCount);
+		In.ReadArray(m_PermX, m_PointCount);
+		In.ReadArray(m_PermY, m_PointCount);
+		In.ReadArray(m_PermZ, m_PointCount);
+	}
+
 private:
 	static int* GeneratePerm()
 	{
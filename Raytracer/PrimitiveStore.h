@@ -0,0 +1,257 @@
+#pragma once
+
+#include "AARect.h"
+#include "Archive.h"
+#include "Box.h"
+#include "Hittable.h"
+#include "MovingSphere.h"
+#include "Sphere.h"
+#include "SphereBlock.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+// Holds the objects under a BVH by value, one contiguous array per primitive type, and hands out tagged indices:
+// the top bits name the type and the rest index that type's array. Hit switches on the tag and calls the concrete
+// (final) class directly, so the common primitives are tested without a virtual call or a pointer chase. Anything
+// else - media, transforms, nested hierarchies - is kept as a shared IHittable in the generic array. Small groups of
+// spheres can instead be packed into a SphereBlock and tested eight at a time.
+class PrimitiveStore
+{
+public:
+	enum class Type : uint32_t { Sphere, MovingSphere, XYRect, XZRect, YZRect, Box, SphereBlock, Generic };
+
+	static constexpr int TypeBits = 3;
+	static constexpr int IndexBits = 32 - TypeBits;
+	static constexpr uint32_t IndexMask = (1u << IndexBits) - 1;
+
+	static Type TypeOf(const uint32_t Tagged) { return static_cast<Type>(Tagged >> IndexBits); }
+	static uint32_t IndexOf(const uint32_t Tagged) { return Tagged & IndexMask; }
+
+	uint32_t Add(const std::shared_ptr<IHittable>& Object)
+	{
+		if (const auto sphere = std::dynamic_pointer_cast<Sphere>(Object))
+		{
+			return Push(m_Spheres, *sphere, Type::Sphere);
+		}
+		if (const auto movingSphere = std::dynamic_pointer_cast<MovingSphere>(Object))
+		{
+			return Push(m_MovingSpheres, *movingSphere, Type::MovingSphere);
+		}
+		if (const auto rect = std::dynamic_pointer_cast<XYRect>(Object))
+		{
+			return Push(m_XYRects, *rect, Type::XYRect);
+		}
+		if (const auto rect = std::dynamic_pointer_cast<XZRect>(Object))
+		{
+			return Push(m_XZRects, *rect, Type::XZRect);
+		}
+		if (const auto rect = std::dynamic_pointer_cast<YZRect>(Object))
+		{
+			return Push(m_YZRects, *rect, Type::YZRect);
+		}
+		if (const auto box = std::dynamic_pointer_cast<Box>(Object))
+		{
+			return Push(m_Boxes, *box, Type::Box);
+		}
+
+		return Push(m_Generic, Object, Type::Generic);
+	}
+
+	static bool IsSphere(const std::shared_ptr<IHittable>& Object)
+	{
+		return std::dynamic_pointer_cast<Sphere>(Object) || std::dynamic_pointer_cast<MovingSphere>(Object);
+	}
+
+	// Packs Objects, which must all be spheres and number at most SphereBlock::Width, into one entry.
+	uint32_t AddSphereBlock(const std::span<const std::shared_ptr<IHittable>> Objects)
+	{
+		SphereBlock block;
+		MakeBlock(Objects, block);
+		return Push(m_SphereBlocks, block, Type::SphereBlock);
+	}
+
+	// Overwrites the entry Tagged with Object's current state, so a refit needn't copy everything again. Returns false,
+	// leaving the entry as it was, if Object isn't of the type the entry holds.
+	bool Update(const uint32_t Tagged, const std::shared_ptr<IHittable>& Object)
+	{
+		const uint32_t idx = IndexOf(Tagged);
+		switch (TypeOf(Tagged))
+		{
+		case Type::Sphere:			return Assign(m_Spheres[idx], Object);
+		case Type::MovingSphere:	return Assign(m_MovingSpheres[idx], Object);
+		case Type::XYRect:			return Assign(m_XYRects[idx], Object);
+		case Type::XZRect:			return Assign(m_XZRects[idx], Object);
+		case Type::YZRect:			return Assign(m_YZRects[idx], Object);
+		case Type::Box:				return Assign(m_Boxes[idx], Object);
+		case Type::SphereBlock:		return false;
+		default:					m_Generic[idx] = Object; return true;
+		}
+	}
+
+	// Likewise for a sphere block, which Objects must all still be spheres for.
+	bool UpdateSphereBlock(const uint32_t Tagged, const std::span<const std::shared_ptr<IHittable>> Objects)
+	{
+		SphereBlock block;
+		if (TypeOf(Tagged) != Type::SphereBlock || !MakeBlock(Objects, block))
+		{
+			return false;
+		}
+		m_SphereBlocks[IndexOf(Tagged)] = block;
+		return true;
+	}
+
+	bool Hit(const uint32_t Tagged, const Ray& R, const float TMin, const float TMax, HitRecord& OutHit) const
+	{
+		const uint32_t idx = IndexOf(Tagged);
+		switch (TypeOf(Tagged))
+		{
+		case Type::Sphere:			return m_Spheres[idx].Hit(R, TMin, TMax, OutHit);
+		case Type::MovingSphere:	return m_MovingSpheres[idx].Hit(R, TMin, TMax, OutHit);
+		case Type::XYRect:			return m_XYRects[idx].Hit(R, TMin, TMax, OutHit);
+		case Type::XZRect:			return m_XZRects[idx].Hit(R, TMin, TMax, OutHit);
+		case Type::YZRect:			return m_YZRects[idx].Hit(R, TMin, TMax, OutHit);
+		case Type::Box:				return m_Boxes[idx].Hit(R, TMin, TMax, OutHit);
+		case Type::SphereBlock:		return HitSphereBlock(m_SphereBlocks[idx], R, TMin, TMax, OutHit);
+		default:					return m_Generic[idx]->Hit(R, TMin, TMax, OutHit);
+		}
+	}
+
+	// Memory held by the copies, not counting the materials and generic objects they point to.
+	size_t Bytes() const
+	{
+		return (m_Spheres.size() * sizeof(Sphere)) + (m_MovingSpheres.size() * sizeof(MovingSphere)) + (m_XYRects.size() * sizeof(XYRect))
+			+ (m_XZRects.size() * sizeof(XZRect)) + (m_YZRects.size() * sizeof(YZRect)) + (m_Boxes.size() * sizeof(Box))
+			+ (m_SphereBlocks.size() * sizeof(SphereBlock)) + (m_Generic.size() * sizeof(std::shared_ptr<IHittable>))
+			+ (m_Materials.size() * sizeof(std::shared_ptr<Material>));
+	}
+
+	// Fails if a generic object is of a kind that can't be stored.
+	bool Serialise(ArchiveWriter& Out) const
+	{
+		Out.WriteEach(m_Spheres);
+		Out.WriteEach(m_MovingSpheres);
+		Out.WriteEach(m_XYRects);
+		Out.WriteEach(m_XZRects);
+		Out.WriteEach(m_YZRects);
+		Out.WriteEach(m_Boxes);
+		Out.WriteArray(m_SphereBlocks);
+
+		Out.Write<uint64_t>(m_Materials.size());
+		for (const std::shared_ptr<Material>& material : m_Materials)
+		{
+			Out.WriteMaterial(material);
+		}
+
+		Out.Write<uint64_t>(m_Generic.size());
+		return std::all_of(m_Generic.begin(), m_Generic.end(), [&](const std::shared_ptr<IHittable>& Object) { return Out.WriteObject(Object); });
+	}
+
+	void Deserialise(ArchiveReader& In)
+	{
+		In.ReadEach(m_Spheres);
+		In.ReadEach(m_MovingSpheres);
+		In.ReadEach(m_XYRects);
+		In.ReadEach(m_XZRects);
+		In.ReadEach(m_YZRects);
+		In.ReadEach(m_Boxes);
+		In.ReadArray(m_SphereBlocks);
+
+		const uint64_t materialCount = In.Read<uint64_t>();
+		for (uint64_t idx = 0; idx < materialCount && !In.Failed; idx++)
+		{
+			MaterialIndex(In.ReadMaterial());
+		}
+
+		const uint64_t genericCount = In.Read<uint64_t>();
+		for (uint64_t idx = 0; idx < genericCount && !In.Failed; idx++)
+		{
+			m_Generic.push_back(In.ReadObject());
+		}
+	}
+
+private:
+
+	bool HitSphereBlock(const SphereBlock& Block, const Ray& R, const float TMin, const float TMax, HitRecord& OutHit) const
+	{
+		float t;
+		const int lane = Block.Intersect(R, TMin, TMax, t);
+		if (lane < 0)
+		{
+			return false;
+		}
+
+		//Only the nearest sphere gets a full hit record, built the same way Sphere::Hit builds one
+		const Point3 pos = R.At(t);
+		const Vec3 outNormal = (pos - Block.Centre(lane, R.Time())) * Block.InverseRadius[lane];
+		const auto [u, v] = Sphere::GetUV(outNormal);
+		OutHit = { t, pos, outNormal, R.Direction(), m_Materials[Block.Materials[lane]], u, v };
+		return true;
+	}
+
+	// Fills Block with Objects, returning false if any of them isn't a sphere.
+	bool MakeBlock(const std::span<const std::shared_ptr<IHittable>> Objects, SphereBlock& Block)
+	{
+		for (const std::shared_ptr<IHittable>& object : Objects)
+		{
+			if (const auto sphere = std::dynamic_pointer_cast<Sphere>(object))
+			{
+				Block.Add(*sphere, MaterialIndex(sphere->Mat()));
+			}
+			else if (const auto movingSphere = std::dynamic_pointer_cast<MovingSphere>(object))
+			{
+				Block.Add(*movingSphere, MaterialIndex(movingSphere->Mat()));
+			}
+			else
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	template<typename T>
+	static bool Assign(T& Entry, const std::shared_ptr<IHittable>& Object)
+	{
+		const auto value = std::dynamic_pointer_cast<T>(Object);
+		if (!value)
+		{
+			return false;
+		}
+		Entry = *value;
+		return true;
+	}
+
+	uint32_t MaterialIndex(const std::shared_ptr<Material>& Mat)
+	{
+		const auto [entry, inserted] = m_MaterialIndices.try_emplace(Mat.get(), static_cast<uint32_t>(m_Materials.size()));
+		if (inserted)
+		{
+			m_Materials.push_back(Mat);
+		}
+		return entry->second;
+	}
+
+	template<typename T>
+	static uint32_t Push(std::vector<T>& Array, const T& Value, const Type Tag)
+	{
+		Array.push_back(Value);
+		return (static_cast<uint32_t>(Tag) << IndexBits) | static_cast<uint32_t>(Array.size() - 1);
+	}
+
+	std::vector<Sphere> m_Spheres;
+	std::vector<MovingSphere> m_MovingSpheres;
+	std::vector<XYRect> m_XYRects;
+	std::vector<XZRect> m_XZRects;
+	std::vector<YZRect> m_YZRects;
+	std::vector<Box> m_Boxes;
+	std::vector<SphereBlock> m_SphereBlocks;
+	std::vector<std::shared_ptr<IHittable>> m_Generic;
+
+	std::vector<std::shared_ptr<Material>> m_Materials;
+	std::unordered_map<const Material*, uint32_t> m_MaterialIndices;
+};
@@ -0,0 +1,135 @@
+#pragma once
+
+#include "AABB.h"
+#include "Vec3.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+
+// A BVH node with up to four children, whose boxes are stored as 8-bit steps from the corner of the node's own box:
+// 64 bytes for four boxes, where a single binary node takes 56 for one. Each axis steps by a power of two, so a plane
+// decodes with an exact multiply and one add, and the boxes are rounded outwards when stored, so they only ever grow.
+//
+// Nodes of moving trees keep each child's box at both ends of the node's time segment, as the binary nodes do, on one
+// grid that spans the node's box over the whole segment. The second set of planes pushes them past one cache line, so
+// they take two: 128 bytes for four children, where the three binary nodes they replace take 168. A ray tests the
+// boxes interpolated to its own time, which still contain everything below them, since each pair of stored planes is
+// outside the pair they were rounded from.
+template<int Times>
+struct alignas(64) BasicQuantizedNode
+{
+	static_assert(Times == 1 || Times == 2, "A node holds its children's boxes at one time or at both ends of a segment");
+
+	static constexpr int Width = 4;
+	static constexpr uint32_t LeafFlag = 1u << 31;	//Marks a child that is one primitive; the rest is its index
+
+	float Origin[3];
+	int8_t Exponent[3];
+	uint8_t ChildCount;
+	uint32_t Children[Width];	//Quantized node indices, or primitive indices with LeafFlag set
+	uint8_t Low[Times][3][Width];
+	uint8_t High[Times][3][Width];
+
+	// Bounds must contain every child's box. Only moving nodes read EndChildBoxes, the boxes at the end of the segment.
+	void SetBounds(const AABB& Bounds, const AABB* ChildBoxes, const AABB* EndChildBoxes, const int Count)
+	{
+		ChildCount = static_cast<uint8_t>(Count);
+		for (int axis = 0; axis < 3; axis++)
+		{
+			//The smallest power of two that spans the box in 255 steps
+			int exponent;
+			std::frexp((Bounds.Max()[axis] - Bounds.Min()[axis]) / 255.0f, &exponent);
+			Exponent[axis] = static_cast<int8_t>(std::clamp(exponent, -126, 127));
+			Origin[axis] = Bounds.Min()[axis];
+
+			const float step = Step(axis);
+			for (int child = 0; child < Count; child++)
+			{
+				for (int time = 0; time < Times; time++)
+				{
+					const AABB& box = time == 0 ? ChildBoxes[child] : EndChildBoxes[child];
+					const float min = box.Min()[axis];
+					const float max = box.Max()[axis];
+
+					//Subtracting the origin can round either way, so nudge each plane until it decodes outside the child
+					int low = std::clamp(static_cast<int>(std::floor((min - Origin[axis]) / step)), 0, 255);
+					while (low > 0 && Decode(axis, low) > min) { low--; }
+					int high = std::clamp(static_cast<int>(std::ceil((max - Origin[axis]) / step)), 0, 255);
+					while (high < 255 && Decode(axis, high) < max) { high++; }
+
+					Low[time][axis][child] = static_cast<uint8_t>(low);
+					High[time][axis][child] = static_cast<uint8_t>(high);
+				}
+			}
+		}
+	}
+
+	float Step(const int Axis) const { return std::bit_cast<float>(static_cast<uint32_t>(Exponent[Axis] + 127) << 23); }
+	float Decode(const int Axis, const int Steps) const { return Origin[Axis] + (Steps * Step(Axis)); }
+
+	// The child's box at the start of the segment, or at its end when Time is 1.
+	AABB ChildBox(const int Child, const int Time = 0) const
+	{
+		return {
+			Point3(Decode(0, Low[Time][0][Child]), Decode(1, Low[Time][1][Child]), Decode(2, Low[Time][2][Child])),
+			Point3(Decode(0, High[Time][0][Child]), Decode(1, High[Time][1][Child]), Decode(2, High[Time][2][Child])) };
+	}
+
+	// The child's box over the whole segment.
+	AABB SweptChildBox(const int Child) const
+	{
+		return Times == 1 ? ChildBox(Child) : AABB(ChildBox(Child, 0), ChildBox(Child, Times - 1));
+	}
+
+	// The same slab test as AABB::Hit for each child, with its box interpolated to Blend of the way through the
+	// segment in moving nodes. Returns a mask of the children the ray enters within [TMin, TMax], and where it enters
+	// each one in OutEntry.
+	uint32_t Intersect(const Point3& RayOrigin, const Vec3& InverseDirection, const float TMin, const float TMax, const float Blend,
+		float (&OutEntry)[Width]) const
+	{
+		const float step[3] = { Step(0), Step(1), Step(2) };
+
+		uint32_t mask = 0;
+		for (int child = 0; child < ChildCount; child++)
+		{
+			float entry = TMin;
+			float exit = TMax;
+			for (int axis = 0; axis < 3; axis++)
+			{
+				float low = Origin[axis] + (Low[0][axis][child] * step[axis]);
+				float high = Origin[axis] + (High[0][axis][child] * step[axis]);
+				if constexpr (Times == 2)
+				{
+					//Interpolated the same way as the binary nodes' BoxAt
+					low += Blend * (Origin[axis] + (Low[1][axis][child] * step[axis]) - low);
+					high += Blend * (Origin[axis] + (High[1][axis][child] * step[axis]) - high);
+				}
+
+				float t0 = (low - RayOrigin[axis]) * InverseDirection[axis];
+				float t1 = (high - RayOrigin[axis]) * InverseDirection[axis];
+				if (InverseDirection[axis] < 0.0f)
+				{
+					std::swap(t0, t1);
+				}
+
+				entry = t0 > entry ? t0 : entry;
+				exit = t1 < exit ? t1 : exit;
+			}
+
+			if (exit > entry)
+			{
+				mask |= 1u << child;
+				OutEntry[child] = entry;
+			}
+		}
+		return mask;
+	}
+};
+
+using QuantizedNode = BasicQuantizedNode<1>;
+using MovingQuantizedNode = BasicQuantizedNode<2>;
+
+static_assert(sizeof(QuantizedNode) == 64, "A quantized node should fill exactly one cache line");
+static_assert(sizeof(MovingQuantizedNode) == 128, "A moving quantized node should fill exactly two cache lines");
@@ -2,6 +2,9 @@
 
 #include "Vec3.h"
 
+#include <span>
+#include <vector>
+
 class Ray
 {
 public:
@@ -19,4 +22,51 @@ private:
 	Point3 m_Origin;
 	Vec3 m_Direction;
 	float m_Time;
+};
+
+// Structure-of-arrays view of a batch of rays, so kernels over many rays can run as plain loops over floats.
+struct RayBatch
+{
+	std::span<float> OriginX, OriginY, OriginZ;
+	std::span<float> DirectionX, DirectionY, DirectionZ;
+	std::span<float> Time;
+
+	size_t Size() const { return Time.size(); }
+	Ray Get(const size_t Idx) const
+	{
+		return Ray(Point3(OriginX[Idx], OriginY[Idx], OriginZ[Idx]), Vec3(DirectionX[Idx], DirectionY[Idx], DirectionZ[Idx]), Time[Idx]);
+	}
+
+	void Set(const size_t Idx, const Ray& R) const
+	{
+		OriginX[Idx] = R.Origin().x();
+		OriginY[Idx] = R.Origin().y();
+		OriginZ[Idx] = R.Origin().z();
+		DirectionX[Idx] = R.Direction().x();
+		DirectionY[Idx] = R.Direction().y();
+		DirectionZ[Idx] = R.Direction().z();
+		Time[Idx] = R.Time();
+	}
+};
+
+// Owns the storage behind a RayBatch; reuse one per thread to avoid reallocating for every batch.
+class RayBatchBuffer
+{
+public:
+	RayBatch View(const size_t Count)
+	{
+		if (m_Data.size() < Count * m_Streams)
+		{
+			m_Data.resize(Count * m_Streams);
+		}
+
+		float* data = m_Data.data();
+		return { { data, Count }, { data + Count, Count }, { data + (2 * Count), Count },
+			{ data + (3 * Count), Count }, { data + (4 * Count), Count }, { data + (5 * Count), Count },
+			{ data + (6 * Count), Count } };
+	}
+
+private:
+	static constexpr size_t m_Streams = 7;
+	std::vector<float> m_Data;
 };
\ No newline at end of file
@@ -0,0 +1,194 @@
+#pragma once
+
+#include "AABB.h"
+#include "Common.h"
+#include "Ray.h"
+#include "SIMD.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <type_traits>
+
+// N rays that are traced through the BVH together with one traversal stack. Lanes past Count are padding: they
+// repeat the first ray and are left out of every mask so they never hit anything.
+template<int N>
+class RayPacket
+{
+public:
+	static_assert(N % Float4::Width == 0 && N <= 32, "Packets are made of whole SSE registers and fit a 32 bit mask");
+
+	static constexpr int Size = N;
+	using Lanes = std::conditional_t<N % Float8::Width == 0, Float8, Float4>;
+	static constexpr int Blocks = N / Lanes::Width;
+
+	// Takes Count consecutive rays of Batch starting at First.
+	RayPacket(const RayBatch& Batch, const size_t First, const int Count, const float TMin, const float TMax = Common::Infinity)
+		: m_TMin(TMin), m_Count(Count)
+	{
+		for (int lane = 0; lane < N; lane++)
+		{
+			SetLane(lane, Batch.Get(First + (lane < Count ? lane : 0)), TMax);
+		}
+
+		Finish(TMax);
+	}
+
+	// Gathers the rays of Batch named by Indices[0..Count), for ray streams that have been sorted by index.
+	RayPacket(const RayBatch& Batch, const uint32_t* Indices, const int Count, const float TMin, const float TMax = Common::Infinity)
+		: m_TMin(TMin), m_Count(Count)
+	{
+		for (int lane = 0; lane < N; lane++)
+		{
+			SetLane(lane, Batch.Get(Indices[lane < Count ? lane : 0]), TMax);
+		}
+
+		Finish(TMax);
+	}
+
+	int Count() const { return m_Count; }
+	// Whether every ray heads the same way along each axis, so whole nodes can be ruled out for the packet at once.
+	bool Coherent() const { return m_Coherent; }
+	uint32_t LaneMask() const { return m_LaneMask; }
+	const Ray& Get(const int Lane) const { return m_Rays[Lane]; }
+	float TMin() const { return m_TMin; }
+	float TMax(const int Lane) const { return m_TMax[Lane]; }
+
+	// Called when a lane finds a closer hit, so later boxes are tested against the shorter interval.
+	void Shorten(const int Lane, const float T)
+	{
+		m_TMax[Lane] = T;
+
+		m_FarthestTMax = -Common::Infinity;
+		for (int lane = 0; lane < m_Count; lane++)
+		{
+			m_FarthestTMax = std::max(m_FarthestTMax, m_TMax[lane]);
+		}
+	}
+
+	// Bit i is set when ray i enters Box within its current interval.
+	uint32_t Intersects(const AABB& Box) const
+	{
+		if (m_Coherent && IntervalMiss(Box))
+		{
+			return 0;
+		}
+
+		const Lanes minX(Box.Min().x()), minY(Box.Min().y()), minZ(Box.Min().z());
+		const Lanes maxX(Box.Max().x()), maxY(Box.Max().y()), maxZ(Box.Max().z());
+		const Lanes tMin(m_TMin);
+
+		uint32_t mask = 0;
+		for (int block = 0; block < Blocks; block++)
+		{
+			const int first = block * Lanes::Width;
+
+			const Lanes originX = Lanes::Load(m_OriginX + first), inverseX = Lanes::Load(m_InverseX + first);
+			const Lanes originY = Lanes::Load(m_OriginY + first), inverseY = Lanes::Load(m_InverseY + first);
+			const Lanes originZ = Lanes::Load(m_OriginZ + first), inverseZ = Lanes::Load(m_InverseZ + first);
+
+			const Lanes x0 = (minX - originX) * inverseX, x1 = (maxX - originX) * inverseX;
+			const Lanes y0 = (minY - originY) * inverseY, y1 = (maxY - originY) * inverseY;
+			const Lanes z0 = (minZ - originZ) * inverseZ, z1 = (maxZ - originZ) * inverseZ;
+
+			const Lanes tNear = Max(Max(Min(x0, x1), Min(y0, y1)), Max(Min(z0, z1), tMin));
+			const Lanes tFar = Min(Min(Max(x0, x1), Max(y0, y1)), Min(Max(z0, z1), Lanes::Load(m_TMax + first)));
+
+			mask |= static_cast<uint32_t>(MoveMask(tNear < tFar)) << first;
+		}
+
+		return mask & m_LaneMask;
+	}
+
+private:
+	// Bounds the slab distances of every ray in the packet at once. If even the most favourable combination of
+	// origin and direction can't get through the box, none of the rays can, and the per-ray test is skipped.
+	bool IntervalMiss(const AABB& Box) const
+	{
+		float nearLower = m_TMin;
+		float farUpper = m_FarthestTMax;
+
+		for (int axis = 0; axis < 3; axis++)
+		{
+			//Coherent packets share the sign of each direction component, so they all enter through the same face
+			const bool negative = m_InverseMax[axis] < 0.0f;
+			const float entry = negative ? Box.Max()[axis] : Box.Min()[axis];
+			const float exit = negative ? Box.Min()[axis] : Box.Max()[axis];
+
+			nearLower = std::max(nearLower, ProductLower(entry - m_OriginMax[axis], entry - m_OriginMin[axis], m_InverseMin[axis], m_InverseMax[axis]));
+			farUpper = std::min(farUpper, ProductUpper(exit - m_OriginMax[axis], exit - m_OriginMin[axis], m_InverseMin[axis], m_InverseMax[axis]));
+		}
+
+		return nearLower >= farUpper;
+	}
+
+	static float ProductLower(const float A0, const float A1, const float B0, const float B1)
+	{
+		return std::min(std::min(A0 * B0, A0 * B1), std::min(A1 * B0, A1 * B1));
+	}
+
+	static float ProductUpper(const float A0, const float A1, const float B0, const float B1)
+	{
+		return std::max(std::max(A0 * B0, A0 * B1), std::max(A1 * B0, A1 * B1));
+	}
+
+	void SetLane(const int Lane, const Ray& R, const float TMax)
+	{
+		m_Rays[Lane] = R;
+		m_OriginX[Lane] = R.Origin().x();
+		m_OriginY[Lane] = R.Origin().y();
+		m_OriginZ[Lane] = R.Origin().z();
+		m_InverseX[Lane] = 1.0f / R.Direction().x();
+		m_InverseY[Lane] = 1.0f / R.Direction().y();
+		m_InverseZ[Lane] = 1.0f / R.Direction().z();
+		m_TMax[Lane] = TMax;
+	}
+
+	void Finish(const float TMax)
+	{
+		m_LaneMask = m_Count >= 32 ? ~0u : (1u << m_Count) - 1;
+		m_FarthestTMax = TMax;
+		ComputeBounds();
+	}
+
+	void ComputeBounds()
+	{
+		const float* origins[] = { m_OriginX, m_OriginY, m_OriginZ };
+		const float* inverses[] = { m_InverseX, m_InverseY, m_InverseZ };
+
+		m_Coherent = true;
+		for (int axis = 0; axis < 3; axis++)
+		{
+			m_OriginMin[axis] = m_OriginMax[axis] = origins[axis][0];
+			m_InverseMin[axis] = m_InverseMax[axis] = inverses[axis][0];
+			for (int lane = 1; lane < m_Count; lane++)
+			{
+				m_OriginMin[axis] = std::min(m_OriginMin[axis], origins[axis][lane]);
+				m_OriginMax[axis] = std::max(m_OriginMax[axis], origins[axis][lane]);
+				m_InverseMin[axis] = std::min(m_InverseMin[axis], inverses[axis][lane]);
+				m_InverseMax[axis] = std::max(m_InverseMax[axis], inverses[axis][lane]);
+			}
+
+			//The interval test needs every ray heading the same way along each axis, and finite slopes
+			const bool sameSign = m_InverseMin[axis] > 0.0f || m_InverseMax[axis] < 0.0f;
+			m_Coherent = m_Coherent && sameSign && std::isfinite(m_InverseMin[axis]) && std::isfinite(m_InverseMax[axis]);
+		}
+	}
+
+	Ray m_Rays[N];
+	alignas(32) float m_OriginX[N];
+	alignas(32) float m_OriginY[N];
+	alignas(32) float m_OriginZ[N];
+	alignas(32) float m_InverseX[N];
+	alignas(32) float m_InverseY[N];
+	alignas(32) float m_InverseZ[N];
+	alignas(32) float m_TMax[N];
+	float m_TMin;
+	float m_FarthestTMax;
+	int m_Count;
+	uint32_t m_LaneMask;
+
+	bool m_Coherent;
+	Vec3 m_OriginMin, m_OriginMax;
+	Vec3 m_InverseMin, m_InverseMax;
+};
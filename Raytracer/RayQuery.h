@@ -0,0 +1,175 @@
+#pragma once
+
+#include "BoundingVolumeHierarchy.h"
+#include "Common.h"
+#include "Hittable.h"
+#include "HittableList.h"
+#include "Material.h"
+#include "Ray.h"
+#include "RayPacket.h"
+#include "TileScheduler.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <span>
+
+struct RayIn
+{
+	Point3 Origin;
+	Vec3 Direction;		//Needn't be normalised; T is measured in multiples of it
+	float TMin = 0.001f;
+	float TMax = Common::Infinity;
+	float Time = 0.0f;	//Within the shutter interval the scene was committed with, for moving objects
+};
+
+// On a miss, T is infinite, MaterialId is UINT32_MAX and everything else is zero.
+struct HitOut
+{
+	bool Hit;
+	bool FrontFace;		//Whether the ray hit the outside of the surface. Normal always faces the ray
+	float T;
+	float U, V;
+	Point3 Position;
+	Vec3 Normal;
+	uint32_t MaterialId;
+};
+
+// The tracer's intersection core on its own, for tools that bring their own rays: visibility precomputation, lightmap
+// baking and the like. Objects are added, Commit builds the BVH over them, and then batches of any size can be
+// queried, from any number of threads at once. Each batch is cut into chunks traced on all cores. Intersect traces
+// each chunk as 8-ray packets, so batches whose neighbouring rays start close together and point the same way go
+// fastest. A packet is cut short wherever TMin changes from one ray to the next, and one that ends up with fewer
+// than MinPacketRays rays, or whose rays don't all head the same way along each axis, is traced a ray at a time
+// instead, so an incoherent batch costs about what tracing its rays singly would. Occluded traces single rays, and
+// stops at the first hit each one finds.
+class RayQueryScene
+{
+public:
+	static constexpr size_t ChunkSize = 1024;
+	static constexpr int MinPacketRays = 4;
+
+	// Takes effect at the next Commit.
+	void Add(std::shared_ptr<IHittable> Object)
+	{
+		m_Objects.Add(std::move(Object));
+	}
+
+	// Builds the tree over everything added so far. T0 and T1 are the shutter interval moving objects are bounded over.
+	void Commit(const BoundingVolumeHierarchy::BuildMethod Method = BoundingVolumeHierarchy::BuildMethod::BinnedSAH, const float T0 = 0.0f, const float T1 = 0.0f)
+	{
+		m_World = BoundingVolumeHierarchy(m_Objects, T0, T1, 1, Method);
+		m_Committed = true;
+	}
+
+	bool Committed() const { return m_Committed; }
+	const BoundingVolumeHierarchy& World() const { return m_World; }
+
+	// Finds every ray's closest hit. Returns false, writing nothing, if the scene hasn't been committed or the spans
+	// differ in length.
+	bool Intersect(const std::span<const RayIn> Rays, const std::span<HitOut> OutHits) const
+	{
+		if (!m_Committed || Rays.size() != OutHits.size())
+		{
+			return false;
+		}
+
+		constexpr int packetSize = 8;
+		ForEachChunk(Rays.size(), [&](const size_t First, const size_t Count)
+		{
+			thread_local RayBatchBuffer buffer;
+			const RayBatch batch = buffer.View(Count);
+			for (size_t idx = 0; idx < Count; idx++)
+			{
+				const RayIn& ray = Rays[First + idx];
+				batch.Set(idx, Ray(ray.Origin, ray.Direction, ray.Time));
+			}
+
+			for (size_t start = 0; start < Count;)
+			{
+				//Packets share one TMin, so a change in it starts the next packet
+				const float tMin = Rays[First + start].TMin;
+				int lanes = 1;
+				while (lanes < packetSize && start + lanes < Count && Rays[First + start + lanes].TMin == tMin)
+				{
+					lanes++;
+				}
+
+				RayPacket<packetSize> packet(batch, start, lanes, tMin);
+				HitRecord hits[packetSize];
+				if (lanes >= MinPacketRays && packet.Coherent())
+				{
+					for (int lane = 0; lane < lanes; lane++)
+					{
+						packet.Shorten(lane, Rays[First + start + lane].TMax);
+					}
+
+					const uint32_t hitMask = m_World.HitPacket(packet, hits);
+					for (int lane = 0; lane < lanes; lane++)
+					{
+						Write((hitMask >> lane) & 1u, hits[lane], OutHits[First + start + lane]);
+					}
+				}
+				else
+				{
+					for (int lane = 0; lane < lanes; lane++)
+					{
+						const RayIn& ray = Rays[First + start + lane];
+						const bool hit = m_World.Hit(packet.Get(lane), ray.TMin, ray.TMax, hits[lane]);
+						Write(hit, hits[lane], OutHits[First + start + lane]);
+					}
+				}
+				start += lanes;
+			}
+		});
+		return true;
+	}
+
+	// Finds whether each ray hits anything between its TMin and TMax. Returns false, writing nothing, if the scene
+	// hasn't been committed or the spans differ in length.
+	bool Occluded(const std::span<const RayIn> Rays, const std::span<bool> OutOccluded) const
+	{
+		if (!m_Committed || Rays.size() != OutOccluded.size())
+		{
+			return false;
+		}
+
+		ForEachChunk(Rays.size(), [&](const size_t First, const size_t Count)
+		{
+			for (size_t idx = First; idx < First + Count; idx++)
+			{
+				const RayIn& ray = Rays[idx];
+				OutOccluded[idx] = m_World.Occluded(Ray(ray.Origin, ray.Direction, ray.Time), ray.TMin, ray.TMax);
+			}
+		});
+		return true;
+	}
+
+private:
+	static void Write(const bool Hit, const HitRecord& Record, HitOut& Out)
+	{
+		if (!Hit)
+		{
+			Out = { false, false, Common::Infinity, 0.0f, 0.0f, Point3(0.0f), Vec3(0.0f), UINT32_MAX };
+			return;
+		}
+
+		Out = { true, Record.FrontFace, Record.T, Record.U, Record.V, Record.Position, Record.Normal,
+			Record.HitMaterial ? Record.HitMaterial->Id() : UINT32_MAX };
+	}
+
+	// Calls Body(First, Count) for each chunk of a batch of Size rays, spread over every core.
+	template<typename Function>
+	static void ForEachChunk(const size_t Size, const Function& Body)
+	{
+		Parallel::For((Size + ChunkSize - 1) / ChunkSize, [&](const size_t Chunk)
+		{
+			const size_t first = Chunk * ChunkSize;
+			Body(first, std::min(ChunkSize, Size - first));
+		});
+	}
+
+	HittableList m_Objects;
+	BoundingVolumeHierarchy m_World;
+	bool m_Committed = false;
+};
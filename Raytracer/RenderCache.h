@@ -0,0 +1,134 @@
+#pragma once
+
+#include "Framebuffer.h"
+#include "Vec3.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+
+// FNV-1a over the raw bytes of whatever is added, used to key cached renders and scenes.
+class Hasher
+{
+public:
+	template<typename T>
+	void Add(const T& Value)
+	{
+		AddBytes(&Value, sizeof(T));
+	}
+
+	void AddBytes(const void* Data, const size_t Size)
+	{
+		const unsigned char* bytes = static_cast<const unsigned char*>(Data);
+		for (size_t idx = 0; idx < Size; idx++)
+		{
+			m_Hash ^= bytes[idx];
+			m_Hash *= 1099511628211ull;
+		}
+	}
+
+	void Add(const Vec3& Value)
+	{
+		Add(Value.x());
+		Add(Value.y());
+		Add(Value.z());
+	}
+
+	uint64_t Value() const { return m_Hash; }
+private:
+	uint64_t m_Hash = 14695981039346656037ull;
+};
+
+// Stores the summed (not yet averaged) framebuffer of a render along with how many samples went into it,
+// so a later run with the same key can keep adding samples instead of starting over.
+class RenderCache
+{
+public:
+	RenderCache(const std::filesystem::path& Directory, const uint64_t Key) : m_Directory(Directory), m_Key(Key) {}
+
+	// When the program was compiled. Scenes are made by code, so a file written by any other build might not describe
+	// what this one would make, and keys include this to tell them apart.
+	static constexpr char BuildStamp[] = __DATE__ " " __TIME__;
+
+	std::filesystem::path Path() const
+	{
+		std::stringstream name;
+		name << std::hex << std::setw(16) << std::setfill('0') << m_Key << ".rtcache";
+		return m_Directory / name.str();
+	}
+
+	bool Load(const int Width, const int Height, Framebuffer& OutFrame, int& OutSamples) const
+	{
+		std::ifstream file(Path(), std::ios::binary);
+		if (!file)
+		{
+			return false;
+		}
+
+		Header header;
+		file.read(reinterpret_cast<char*>(&header), sizeof(Header));
+		if (!file || header.Magic != m_Magic || header.Version != m_Version || header.Key != m_Key
+			|| header.Width != Width || header.Height != Height)
+		{
+			return false;
+		}
+
+		Framebuffer frame(Width, Height);
+		file.read(reinterpret_cast<char*>(frame.Data()), frame.FloatCount() * sizeof(float));
+		if (!file)
+		{
+			return false;
+		}
+
+		OutFrame = std::move(frame);
+		OutSamples = header.Samples;
+		return true;
+	}
+
+	bool Save(const Framebuffer& Frame, const int Samples) const
+	{
+		std::error_code error;
+		std::filesystem::create_directories(m_Directory, error);
+
+		//Write to a temporary file first so an interrupted save never leaves a truncated cache behind
+		const std::filesystem::path tempPath = Path().string() + ".tmp";
+		{
+			std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+			if (!file)
+			{
+				return false;
+			}
+
+			const Header header{ m_Magic, m_Version, m_Key, Frame.Width(), Frame.Height(), Samples };
+			file.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+			file.write(reinterpret_cast<const char*>(Frame.Data()), Frame.FloatCount() * sizeof(float));
+			if (!file)
+			{
+				return false;
+			}
+		}
+
+		std::filesystem::rename(tempPath, Path(), error);
+		return !error;
+	}
+
+private:
+	struct Header
+	{
+		uint32_t Magic;
+		uint32_t Version;
+		uint64_t Key;
+		int32_t Width;
+		int32_t Height;
+		int32_t Samples;
+	};
+
+	static constexpr uint32_t m_Magic = 0x43415452; //"RTAC"
+	static constexpr uint32_t m_Version = 6;
+
+	std::filesystem::path m_Directory;
+	uint64_t m_Key;
+};
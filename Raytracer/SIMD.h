@@ -0,0 +1,159 @@
+#pragma once
+
+#include <immintrin.h>
+
+// SSE/AVX wrappers for the hot loops. Float4 and Float8 are N floats operated on at once; comparisons return
+// lane masks for Select, Any and All. Float8 uses AVX when the compiler targets it (/arch:AVX2 in the AVX2
+// configurations, or -mavx) and a pair of SSE registers otherwise.
+
+class Float4
+{
+public:
+	static constexpr int Width = 4;
+
+	Float4() : m_V(_mm_setzero_ps()) {}
+	Float4(const __m128 V) : m_V(V) {}
+	explicit Float4(const float V) : m_V(_mm_set1_ps(V)) {}
+	Float4(const float A, const float B, const float C, const float D) : m_V(_mm_setr_ps(A, B, C, D)) {}
+
+	static Float4 Load(const float* Source) { return _mm_loadu_ps(Source); }
+	void Store(float* Destination) const { _mm_storeu_ps(Destination, m_V); }
+
+	float operator[](const int Lane) const
+	{
+		alignas(16) float lanes[Width];
+		_mm_store_ps(lanes, m_V);
+		return lanes[Lane];
+	}
+
+	__m128 Native() const { return m_V; }
+
+private:
+	__m128 m_V;
+};
+
+inline Float4 operator+(const Float4& lhs, const Float4& rhs) { return _mm_add_ps(lhs.Native(), rhs.Native()); }
+inline Float4 operator-(const Float4& lhs, const Float4& rhs) { return _mm_sub_ps(lhs.Native(), rhs.Native()); }
+inline Float4 operator*(const Float4& lhs, const Float4& rhs) { return _mm_mul_ps(lhs.Native(), rhs.Native()); }
+inline Float4 operator/(const Float4& lhs, const Float4& rhs) { return _mm_div_ps(lhs.Native(), rhs.Native()); }
+inline Float4 operator-(const Float4& v) { return _mm_xor_ps(v.Native(), _mm_set1_ps(-0.0f)); }
+inline Float4 operator<(const Float4& lhs, const Float4& rhs) { return _mm_cmplt_ps(lhs.Native(), rhs.Native()); }
+inline Float4 operator<=(const Float4& lhs, const Float4& rhs) { return _mm_cmple_ps(lhs.Native(), rhs.Native()); }
+inline Float4 operator>(const Float4& lhs, const Float4& rhs) { return _mm_cmpgt_ps(lhs.Native(), rhs.Native()); }
+inline Float4 operator>=(const Float4& lhs, const Float4& rhs) { return _mm_cmpge_ps(lhs.Native(), rhs.Native()); }
+inline Float4 operator&(const Float4& lhs, const Float4& rhs) { return _mm_and_ps(lhs.Native(), rhs.Native()); }
+inline Float4 operator|(const Float4& lhs, const Float4& rhs) { return _mm_or_ps(lhs.Native(), rhs.Native()); }
+
+inline Float4 Min(const Float4& a, const Float4& b) { return _mm_min_ps(a.Native(), b.Native()); }
+inline Float4 Max(const Float4& a, const Float4& b) { return _mm_max_ps(a.Native(), b.Native()); }
+inline Float4 Sqrt(const Float4& v) { return _mm_sqrt_ps(v.Native()); }
+inline Float4 Abs(const Float4& v) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), v.Native()); }
+
+// Lanes where Mask is set come from IfTrue, the rest from IfFalse.
+inline Float4 Select(const Float4& Mask, const Float4& IfTrue, const Float4& IfFalse)
+{
+	return _mm_or_ps(_mm_and_ps(Mask.Native(), IfTrue.Native()), _mm_andnot_ps(Mask.Native(), IfFalse.Native()));
+}
+
+inline int MoveMask(const Float4& Mask) { return _mm_movemask_ps(Mask.Native()); }
+inline bool Any(const Float4& Mask) { return MoveMask(Mask) != 0; }
+inline bool All(const Float4& Mask) { return MoveMask(Mask) == 0xF; }
+
+#if defined(__AVX__)
+
+class Float8
+{
+public:
+	static constexpr int Width = 8;
+
+	Float8() : m_V(_mm256_setzero_ps()) {}
+	Float8(const __m256 V) : m_V(V) {}
+	explicit Float8(const float V) : m_V(_mm256_set1_ps(V)) {}
+
+	static Float8 Load(const float* Source) { return _mm256_loadu_ps(Source); }
+	void Store(float* Destination) const { _mm256_storeu_ps(Destination, m_V); }
+
+	float operator[](const int Lane) const
+	{
+		alignas(32) float lanes[Width];
+		_mm256_store_ps(lanes, m_V);
+		return lanes[Lane];
+	}
+
+	__m256 Native() const { return m_V; }
+
+private:
+	__m256 m_V;
+};
+
+inline Float8 operator+(const Float8& lhs, const Float8& rhs) { return _mm256_add_ps(lhs.Native(), rhs.Native()); }
+inline Float8 operator-(const Float8& lhs, const Float8& rhs) { return _mm256_sub_ps(lhs.Native(), rhs.Native()); }
+inline Float8 operator*(const Float8& lhs, const Float8& rhs) { return _mm256_mul_ps(lhs.Native(), rhs.Native()); }
+inline Float8 operator/(const Float8& lhs, const Float8& rhs) { return _mm256_div_ps(lhs.Native(), rhs.Native()); }
+inline Float8 operator-(const Float8& v) { return _mm256_xor_ps(v.Native(), _mm256_set1_ps(-0.0f)); }
+inline Float8 operator<(const Float8& lhs, const Float8& rhs) { return _mm256_cmp_ps(lhs.Native(), rhs.Native(), _CMP_LT_OQ); }
+inline Float8 operator<=(const Float8& lhs, const Float8& rhs) { return _mm256_cmp_ps(lhs.Native(), rhs.Native(), _CMP_LE_OQ); }
+inline Float8 operator>(const Float8& lhs, const Float8& rhs) { return _mm256_cmp_ps(lhs.Native(), rhs.Native(), _CMP_GT_OQ); }
+inline Float8 operator>=(const Float8& lhs, const Float8& rhs) { return _mm256_cmp_ps(lhs.Native(), rhs.Native(), _CMP_GE_OQ); }
+inline Float8 operator&(const Float8& lhs, const Float8& rhs) { return _mm256_and_ps(lhs.Native(), rhs.Native()); }
+inline Float8 operator|(const Float8& lhs, const Float8& rhs) { return _mm256_or_ps(lhs.Native(), rhs.Native()); }
+
+inline Float8 Min(const Float8& a, const Float8& b) { return _mm256_min_ps(a.Native(), b.Native()); }
+inline Float8 Max(const Float8& a, const Float8& b) { return _mm256_max_ps(a.Native(), b.Native()); }
+inline Float8 Sqrt(const Float8& v) { return _mm256_sqrt_ps(v.Native()); }
+inline Float8 Abs(const Float8& v) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), v.Native()); }
+inline Float8 Select(const Float8& Mask, const Float8& IfTrue, const Float8& IfFalse) { return _mm256_blendv_ps(IfFalse.Native(), IfTrue.Native(), Mask.Native()); }
+inline int MoveMask(const Float8& Mask) { return _mm256_movemask_ps(Mask.Native()); }
+
+#else
+
+class Float8
+{
+public:
+	static constexpr int Width = 8;
+
+	Float8() {}
+	Float8(const Float4& Low, const Float4& High) : m_Low(Low), m_High(High) {}
+	explicit Float8(const float V) : m_Low(V), m_High(V) {}
+
+	static Float8 Load(const float* Source) { return Float8(Float4::Load(Source), Float4::Load(Source + 4)); }
+	void Store(float* Destination) const { m_Low.Store(Destination); m_High.Store(Destination + 4); }
+
+	float operator[](const int Lane) const { return Lane < 4 ? m_Low[Lane] : m_High[Lane - 4]; }
+
+	const Float4& Low() const { return m_Low; }
+	const Float4& High() const { return m_High; }
+
+private:
+	Float4 m_Low, m_High;
+};
+
+inline Float8 operator+(const Float8& lhs, const Float8& rhs) { return Float8(lhs.Low() + rhs.Low(), lhs.High() + rhs.High()); }
+inline Float8 operator-(const Float8& lhs, const Float8& rhs) { return Float8(lhs.Low() - rhs.Low(), lhs.High() - rhs.High()); }
+inline Float8 operator*(const Float8& lhs, const Float8& rhs) { return Float8(lhs.Low() * rhs.Low(), lhs.High() * rhs.High()); }
+inline Float8 operator/(const Float8& lhs, const Float8& rhs) { return Float8(lhs.Low() / rhs.Low(), lhs.High() / rhs.High()); }
+inline Float8 operator-(const Float8& v) { return Float8(-v.Low(), -v.High()); }
+inline Float8 operator<(const Float8& lhs, const Float8& rhs) { return Float8(lhs.Low() < rhs.Low(), lhs.High() < rhs.High()); }
+inline Float8 operator<=(const Float8& lhs, const Float8& rhs) { return Float8(lhs.Low() <= rhs.Low(), lhs.High() <= rhs.High()); }
+inline Float8 operator>(const Float8& lhs, const Float8& rhs) { return Float8(lhs.Low() > rhs.Low(), lhs.High() > rhs.High()); }
+inline Float8 operator>=(const Float8& lhs, const Float8& rhs) { return Float8(lhs.Low() >= rhs.Low(), lhs.High() >= rhs.High()); }
+inline Float8 operator&(const Float8& lhs, const Float8& rhs) { return Float8(lhs.Low() & rhs.Low(), lhs.High() & rhs.High()); }
+inline Float8 operator|(const Float8& lhs, const Float8& rhs) { return Float8(lhs.Low() | rhs.Low(), lhs.High() | rhs.High()); }
+
+inline Float8 Min(const Float8& a, const Float8& b) { return Float8(Min(a.Low(), b.Low()), Min(a.High(), b.High())); }
+inline Float8 Max(const Float8& a, const Float8& b) { return Float8(Max(a.Low(), b.Low()), Max(a.High(), b.High())); }
+inline Float8 Sqrt(const Float8& v) { return Float8(Sqrt(v.Low()), Sqrt(v.High())); }
+inline Float8 Abs(const Float8& v) { return Float8(Abs(v.Low()), Abs(v.High())); }
+inline Float8 Select(const Float8& Mask, const Float8& IfTrue, const Float8& IfFalse)
+{
+	return Float8(Select(Mask.Low(), IfTrue.Low(), IfFalse.Low()), Select(Mask.High(), IfTrue.High(), IfFalse.High()));
+}
+inline int MoveMask(const Float8& Mask) { return MoveMask(Mask.Low()) | (MoveMask(Mask.High()) << 4); }
+
+#endif
+
+inline bool Any(const Float8& Mask) { return MoveMask(Mask) != 0; }
+inline bool All(const Float8& Mask) { return MoveMask(Mask) == 0xFF; }
+
+// Starts loading the cache line holding Address into every level of cache, without waiting for it.
+inline void Prefetch(const void* Address) { _mm_prefetch(static_cast<const char*>(Address), _MM_HINT_T0); }
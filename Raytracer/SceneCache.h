@@ -0,0 +1,272 @@
+#pragma once
+
+#include "AARect.h"
+#include "Archive.h"
+#include "BoundingVolumeHierarchy.h"
+#include "Box.h"
+#include "ConstantMedium.h"
+#include "Hittable.h"
+#include "InstanceHierarchy.h"
+#include "MappedFile.h"
+#include "Material.h"
+#include "MovingSphere.h"
+#include "Perlin.h"
+#include "PrimitiveStore.h"
+#include "RenderCache.h"
+#include "Sphere.h"
+#include "Texture.h"
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Stores a built scene - the BVH with its nodes and primitive arrays, and every material and texture they use - in
+// one binary file, so the next run can skip building it. Loading maps the file and copies each array out of it in
+// one go; nothing gets sorted or split again. Materials and textures shared between objects are written once and
+// shared again after loading, and keep their ids so materials sort the same way in the wavefront queues.
+//
+// The header carries a checksum of everything after it, and the key covers the scene and the build of the program
+// that wrote it: scenes are made by code, so a file from any other build might describe a different scene. A file
+// that doesn't match is ignored and the scene is built as usual.
+//
+// Each type writes and reads its own fields (see Archive.h); the cache lays out the file, and is what knows every
+// kind of object that can be held through a pointer.
+class SceneCache
+{
+public:
+	SceneCache(const std::filesystem::path& Directory, const uint64_t Key) : m_Directory(Directory), m_Key(Key) {}
+
+	static uint64_t KeyFor(const int SceneId, const BoundingVolumeHierarchy::BuildMethod Method)
+	{
+		Hasher key;
+		key.Add(SceneId);
+		key.Add(Method);
+		key.Add(BoundingVolumeHierarchy::DefaultLayout);	//The quantized nodes are saved in their layout
+		key.Add(m_Version);
+		key.AddBytes(RenderCache::BuildStamp, sizeof(RenderCache::BuildStamp));
+		key.Add(BoundingVolumeHierarchy::NodeSize());
+		key.Add(InstanceHierarchy::NodeSize());
+		key.Add(sizeof(SphereBlock));
+		return key.Value();
+	}
+
+	std::filesystem::path Path() const
+	{
+		std::stringstream name;
+		name << std::hex << std::setw(16) << std::setfill('0') << m_Key << ".rtscene";
+		return m_Directory / name.str();
+	}
+
+	bool Load(BoundingVolumeHierarchy& OutWorld) const
+	{
+		const MappedFile file(Path());
+		if (file.Data() == nullptr || file.Size() < sizeof(Header))
+		{
+			return false;
+		}
+
+		Header header;
+		std::memcpy(&header, file.Data(), sizeof(Header));
+		const uint8_t* payload = file.Data() + sizeof(Header);
+		if (header.Magic != m_Magic || header.Version != m_Version || header.Key != m_Key
+			|| header.PayloadSize != file.Size() - sizeof(Header))
+		{
+			return false;
+		}
+
+		Hasher checksum;
+		checksum.AddBytes(payload, header.PayloadSize);
+		if (checksum.Value() != header.Checksum)
+		{
+			return false;
+		}
+
+		ArchiveReader in(payload, header.PayloadSize, ReadObject, Texture::Deserialise);
+
+		//Textures are made as materials refer to them, since one can refer to another written before or after it
+		in.Position = header.TextureTableAt;
+		in.ReadArray(in.TextureOffsets);
+		in.Textures.resize(in.TextureOffsets.size());
+
+		in.Position = header.MaterialsAt;
+		const uint64_t materialCount = in.Read<uint64_t>();
+		for (uint64_t idx = 0; idx < materialCount && !in.Failed; idx++)
+		{
+			in.Materials.push_back(Material::Deserialise(in));
+		}
+
+		BoundingVolumeHierarchy world;
+		in.Position = 0;
+		if (!in.Failed)
+		{
+			world.Deserialise(in);
+		}
+		if (in.Failed)
+		{
+			return false;
+		}
+
+		OutWorld = std::move(world);
+		return true;
+	}
+
+	// Fails without writing anything if the scene holds an object the cache doesn't know how to store.
+	bool Save(const BoundingVolumeHierarchy& World) const
+	{
+		ArchiveWriter out(WriteObject);
+		Header header{ m_Magic, m_Version, m_Key };
+		if (!WritePayload(World, out, header))
+		{
+			return false;
+		}
+
+		std::error_code error;
+		std::filesystem::create_directories(m_Directory, error);
+
+		//Same as RenderCache: write beside the real file and rename, so a reader never maps a half-written one
+		const std::filesystem::path tempPath = Path().string() + ".tmp";
+		{
+			std::ofstream file(tempPath, std::ios::binary | std::ios::trunc);
+			if (!file)
+			{
+				return false;
+			}
+
+			file.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+			file.write(reinterpret_cast<const char*>(out.Bytes.data()), out.Bytes.size());
+			if (!file)
+			{
+				return false;
+			}
+		}
+
+		std::filesystem::rename(tempPath, Path(), error);
+		return !error;
+	}
+
+	// A hash of everything Save would write for World: its geometry, materials and textures. Keys of anything made
+	// from the scene, like cached renders, include it so they change whenever the scene does. Fails if the scene
+	// holds an object the cache doesn't know how to store.
+	static bool ContentHash(const BoundingVolumeHierarchy& World, uint64_t& OutHash)
+	{
+		ArchiveWriter out(WriteObject);
+		Header header{ m_Magic, m_Version, 0 };
+		if (!WritePayload(World, out, header))
+		{
+			return false;
+		}
+
+		OutHash = header.Checksum;
+		return true;
+	}
+
+private:
+	struct Header
+	{
+		uint32_t Magic;
+		uint32_t Version;
+		uint64_t Key;
+		uint64_t Checksum = 0;			//Of the payload, everything after the header
+		uint64_t PayloadSize = 0;
+		uint64_t MaterialsAt = 0;		//Offsets into the payload; the geometry starts at 0
+		uint64_t TextureTableAt = 0;
+	};
+
+	// Writes the geometry followed by the tables of materials and textures it refers to, and fills in the header's
+	// offsets, size and checksum.
+	static bool WritePayload(const BoundingVolumeHierarchy& World, ArchiveWriter& Out, Header& OutHeader)
+	{
+		if (!World.Serialise(Out))
+		{
+			return false;
+		}
+
+		//Materials only add textures and textures only add textures, so each table is complete once written
+		OutHeader.MaterialsAt = Out.Bytes.size();
+		Out.Write<uint64_t>(Out.Materials.size());
+		for (size_t idx = 0; idx < Out.Materials.size(); idx++)
+		{
+			Out.Materials[idx]->Serialise(Out);
+		}
+
+		std::vector<uint64_t> textureOffsets;
+		for (size_t idx = 0; idx < Out.Textures.size(); idx++)
+		{
+			textureOffsets.push_back(Out.Bytes.size());
+			Out.Textures[idx]->Serialise(Out);
+		}
+		OutHeader.TextureTableAt = Out.Bytes.size();
+		Out.WriteArray(textureOffsets);
+
+		OutHeader.PayloadSize = Out.Bytes.size();
+		Hasher checksum;
+		checksum.AddBytes(Out.Bytes.data(), Out.Bytes.size());
+		OutHeader.Checksum = checksum.Value();
+		return true;
+	}
+
+	enum class Kind : uint32_t { Sphere, MovingSphere, XYRect, XZRect, YZRect, Box, Transform, ConstantMedium, Hierarchy, Instances };
+
+	// Objects held through a pointer, which the store keeps in its generic array and transforms and media wrap.
+	static bool WriteObject(ArchiveWriter& Out, const std::shared_ptr<IHittable>& Object)
+	{
+		const auto write = [&](const Kind ObjectKind, const auto& Concrete)
+		{
+			Out.Write(ObjectKind);
+			return Concrete.Serialise(Out);
+		};
+
+		if (const auto sphere = std::dynamic_pointer_cast<Sphere>(Object)) { return write(Kind::Sphere, *sphere); }
+		if (const auto sphere = std::dynamic_pointer_cast<MovingSphere>(Object)) { return write(Kind::MovingSphere, *sphere); }
+		if (const auto rect = std::dynamic_pointer_cast<XYRect>(Object)) { return write(Kind::XYRect, *rect); }
+		if (const auto rect = std::dynamic_pointer_cast<XZRect>(Object)) { return write(Kind::XZRect, *rect); }
+		if (const auto rect = std::dynamic_pointer_cast<YZRect>(Object)) { return write(Kind::YZRect, *rect); }
+		if (const auto box = std::dynamic_pointer_cast<Box>(Object)) { return write(Kind::Box, *box); }
+		if (const auto transform = std::dynamic_pointer_cast<Transform>(Object)) { return write(Kind::Transform, *transform); }
+		if (const auto medium = std::dynamic_pointer_cast<ConstantMedium>(Object)) { return write(Kind::ConstantMedium, *medium); }
+		if (const auto hierarchy = std::dynamic_pointer_cast<BoundingVolumeHierarchy>(Object)) { return write(Kind::Hierarchy, *hierarchy); }
+		if (const auto instances = std::dynamic_pointer_cast<InstanceHierarchy>(Object)) { return write(Kind::Instances, *instances); }
+
+		return false;
+	}
+
+	template<typename T>
+	static std::shared_ptr<IHittable> ReadAs(ArchiveReader& In)
+	{
+		const auto object = std::make_shared<T>();
+		object->Deserialise(In);
+		return object;
+	}
+
+	static std::shared_ptr<IHittable> ReadObject(ArchiveReader& In)
+	{
+		switch (In.Read<Kind>())
+		{
+		case Kind::Sphere:			return ReadAs<Sphere>(In);
+		case Kind::MovingSphere:	return ReadAs<MovingSphere>(In);
+		case Kind::XYRect:			return ReadAs<XYRect>(In);
+		case Kind::XZRect:			return ReadAs<XZRect>(In);
+		case Kind::YZRect:			return ReadAs<YZRect>(In);
+		case Kind::Box:				return ReadAs<Box>(In);
+		case Kind::Transform:		return ReadAs<Transform>(In);
+		case Kind::ConstantMedium:	return ReadAs<ConstantMedium>(In);
+		case Kind::Hierarchy:		return ReadAs<BoundingVolumeHierarchy>(In);
+		case Kind::Instances:		return ReadAs<InstanceHierarchy>(In);
+		default:
+			In.Failed = true;
+			return nullptr;
+		}
+	}
+
+	static constexpr uint32_t m_Magic = 0x43535452; //"RTSC"
+	static constexpr uint32_t m_Version = 2;
+
+	std::filesystem::path m_Directory;
+	uint64_t m_Key;
+};
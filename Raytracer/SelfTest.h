@@ -0,0 +1,452 @@
+#pragma once
+
+#include "AABB.h"
+#include "AARect.h"
+#include "BoundingVolumeHierarchy.h"
+#include "Box.h"
+#include "Common.h"
+#include "ConstantMedium.h"
+#include "Hittable.h"
+#include "HittableList.h"
+#include "InstanceHierarchy.h"
+#include "Material.h"
+#include "Matrix.h"
+#include "MovingSphere.h"
+#include "Ray.h"
+#include "RayQuery.h"
+#include "SceneCache.h"
+#include "Sphere.h"
+#include "Texture.h"
+
+#include <cmath>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <vector>
+
+// Checks run by --self-test that don't need a render: each builds or updates something in two ways that must agree
+// and returns whether they did. Render-level checks live next to RenderRows in Main.cpp.
+namespace SelfTest
+{
+	// Count rays from points scattered around Bounds towards points inside it, the same rays for the same Seed.
+	inline std::vector<Ray> RaysThrough(const AABB& Bounds, const size_t Count, const uint32_t Seed)
+	{
+		Common::Seed({ Seed });
+		const Point3 centre = 0.5f * (Bounds.Min() + Bounds.Max());
+		const float radius = (Bounds.Max() - Bounds.Min()).Length();
+
+		std::vector<Ray> rays;
+		rays.reserve(Count);
+		for (size_t idx = 0; idx < Count; idx++)
+		{
+			const Point3 origin = centre + (radius * RandomUnitVector());
+			const Point3 target = Bounds.Min() + (Vec3::Random() * (Bounds.Max() - Bounds.Min()));
+			rays.emplace_back(origin, target - origin, Common::Random());
+		}
+		return rays;
+	}
+
+	inline bool Same(const Vec3& A, const Vec3& B, const float Tolerance = 0.0f)
+	{
+		return std::abs(A.x() - B.x()) <= Tolerance && std::abs(A.y() - B.y()) <= Tolerance && std::abs(A.z() - B.z()) <= Tolerance;
+	}
+
+	// How far apart two hits that should be the same may be, for a ray that meets the surface head on: Distance of
+	// their T and Normal in each component of their normals. Zero means they must match exactly.
+	struct Tolerance
+	{
+		float Distance = 0.0f;
+		float Normal = 0.0f;
+	};
+
+	// For hits found with different arithmetic: a sphere block's against a lone sphere's, or a build with FMA
+	// contraction, as /arch:AVX2 makes, against the plain one. T comes from a quadratic whose rounding error grows as
+	// the ray gets closer to tangent, and the normal comes from the hit point, which that error moves along the ray by
+	// far more than a small, distant sphere's radius. Measured with FMA, the worst T was 4e-5 and the worst normal 0.02
+	// off, relative to the cosine of the ray's angle to the surface.
+	inline constexpr Tolerance ArithmeticTolerance{ 2e-4f, 0.1f };
+
+	// Rays closer than this to tangent to either surface aren't compared at all when there's a tolerance: one may
+	// graze a surface the other misses and find another behind it.
+	inline constexpr float GrazingCosine = 0.05f;
+
+	// The cosine of the angle a ray with Direction meets a surface with Normal at.
+	inline float Cosine(const Vec3& Direction, const Vec3& Normal)
+	{
+		return std::abs(Dot(Direction, Normal)) / Direction.Length();
+	}
+
+	// Whether two hits of R, either of which may be a miss, are the same: at the same distance and with the same
+	// normal, within Allowed scaled up by how far the ray is from head on.
+	inline bool SameHit(const Ray& R, const bool HitsA, const HitRecord& A, const bool HitsB, const HitRecord& B, const Tolerance& Allowed)
+	{
+		if (!HitsA && !HitsB)
+		{
+			return true;
+		}
+
+		float scale = 0.0f;
+		if (Allowed.Distance > 0.0f || Allowed.Normal > 0.0f)
+		{
+			const float cosine = std::min(HitsA ? Cosine(R.Direction(), A.Normal) : 1.0f, HitsB ? Cosine(R.Direction(), B.Normal) : 1.0f);
+			if (cosine < GrazingCosine)
+			{
+				return true;
+			}
+			scale = 1.0f / cosine;
+		}
+		return HitsA == HitsB && std::abs(A.T - B.T) <= scale * Allowed.Distance * A.T && Same(A.Normal, B.Normal, scale * Allowed.Normal);
+	}
+
+	// Whether A and B find the same closest hit for every ray, as SameHit judges it.
+	inline bool SameHits(const IHittable& A, const IHittable& B, const std::vector<Ray>& Rays, const Tolerance& Allowed = {})
+	{
+		for (const Ray& ray : Rays)
+		{
+			HitRecord hitA, hitB;
+			const bool hitsA = A.Hit(ray, 0.001f, Common::Infinity, hitA);
+			const bool hitsB = B.Hit(ray, 0.001f, Common::Infinity, hitB);
+			if (!SameHit(ray, hitsA, hitA, hitsB, hitB, Allowed))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// A tree over still and moving spheres, which rays traverse through moving quantized nodes, against testing every
+	// sphere in a list, for rays at random times across the shutter interval and its segments.
+	inline bool MovingTreeMatchesList()
+	{
+		Common::Seed({ 46 });
+		HittableList objects;
+		const std::shared_ptr<Material> material = std::make_shared<Lambertian>(Colour(0.5f));
+		for (int idx = 0; idx < 200; idx++)
+		{
+			const Point3 centre = Point3::Random(0.0f, 30.0f);
+			if (idx % 2 == 0)
+			{
+				objects.Add(std::make_shared<MovingSphere>(centre, centre + Vec3::Random(-3.0f, 3.0f), 0.0f, 1.0f, 0.5f, material));
+			}
+			else
+			{
+				objects.Add(std::make_shared<Sphere>(centre, 0.5f, material));
+			}
+		}
+
+		AABB bounds;
+		objects.BoundingBox(0.0f, 1.0f, bounds);
+		const std::vector<Ray> rays = RaysThrough(bounds, 20000, 46);
+		const BoundingVolumeHierarchy single(objects, 0.0f, 1.0f, 1, BoundingVolumeHierarchy::BuildMethod::BinnedSAH);
+		const BoundingVolumeHierarchy segmented(objects, 0.0f, 1.0f, 3, BoundingVolumeHierarchy::BuildMethod::BinnedSAH);
+		return SameHits(single, objects, rays, ArithmeticTolerance) && SameHits(segmented, objects, rays, ArithmeticTolerance);
+	}
+
+	// A still scene with a ground sphere and rects that straddle most of the splits, built by every method in every
+	// node layout, against testing every object in a list. Spatial splits clip and duplicate the big objects here, so
+	// this is what checks that no clipped reference loses part of its object.
+	inline bool BuildMethodsMatchList()
+	{
+		Common::Seed({ 45 });
+		HittableList objects;
+		const std::shared_ptr<Material> material = std::make_shared<Lambertian>(Colour(0.5f));
+		objects.Add(std::make_shared<Sphere>(Point3(10.0f, -1000.0f, 10.0f), 1000.0f, material));
+		objects.Add(std::make_shared<XYRect>(-5.0f, 25.0f, 0.0f, 20.0f, 10.0f, material));
+		objects.Add(std::make_shared<YZRect>(0.0f, 20.0f, -5.0f, 25.0f, 10.0f, material));
+		objects.Add(std::make_shared<Box>(Point3(-2.0f, 0.0f, -2.0f), Point3(22.0f, 1.0f, 22.0f), material));
+		for (int idx = 0; idx < 300; idx++)
+		{
+			objects.Add(std::make_shared<Sphere>(Point3::Random(0.0f, 20.0f), Common::Random(0.1f, 1.0f), material));
+		}
+
+		const std::vector<Ray> rays = RaysThrough(AABB(Point3(-5.0f), Point3(25.0f)), 20000, 45);
+		const BoundingVolumeHierarchy::NodeLayout defaultLayout = BoundingVolumeHierarchy::DefaultLayout;
+		bool matches = true;
+		for (const auto layout : { BoundingVolumeHierarchy::NodeLayout::DepthFirst, BoundingVolumeHierarchy::NodeLayout::Treelets })
+		{
+			BoundingVolumeHierarchy::DefaultLayout = layout;
+			for (const auto method : { BoundingVolumeHierarchy::BuildMethod::Median, BoundingVolumeHierarchy::BuildMethod::BinnedSAH, BoundingVolumeHierarchy::BuildMethod::Spatial })
+			{
+				matches = matches && SameHits(BoundingVolumeHierarchy(objects, 0.0f, 0.0f, 1, method), objects, rays, ArithmeticTolerance);
+			}
+		}
+		BoundingVolumeHierarchy::DefaultLayout = defaultLayout;
+		return matches;
+	}
+
+	// A grid of instances of one cluster of spheres, some of them moved with SetTransform and refitted, against a
+	// hierarchy built from scratch with every instance already where it ended up.
+	inline bool InstanceRefitMatchesBuild()
+	{
+		Common::Seed({ 41 });
+		HittableList spheres;
+		const std::shared_ptr<Material> material = std::make_shared<Lambertian>(Colour(0.5f));
+		for (int idx = 0; idx < 50; idx++)
+		{
+			spheres.Add(std::make_shared<Sphere>(Point3::Random(0.0f, 10.0f), 1.0f, material));
+		}
+		const std::shared_ptr<const BoundingVolumeHierarchy> cluster = std::make_shared<BoundingVolumeHierarchy>(spheres);
+
+		std::vector<Matrix3x4> placements;
+		InstanceHierarchy refitted;
+		for (int idx = 0; idx < 64; idx++)
+		{
+			placements.push_back(Matrix3x4::Translation(Vec3((idx % 8) * 20.0f, 0.0f, (idx / 8) * 20.0f)));
+			refitted.Add(cluster, placements.back());
+		}
+		refitted.Build();
+
+		//Far enough that the old boxes miss most of where the moved instances now are
+		for (uint32_t idx = 0; idx < placements.size(); idx += 3)
+		{
+			placements[idx] = Matrix3x4::Translation(Vec3::Random(-60.0f, 60.0f)) * Matrix3x4::RotationY(Common::Random(0.0f, 360.0f)) * placements[idx];
+			refitted.SetTransform(idx, placements[idx]);
+		}
+		refitted.Refit();
+
+		InstanceHierarchy built;
+		for (const Matrix3x4& placement : placements)
+		{
+			built.Add(cluster, placement);
+		}
+		built.Build();
+
+		AABB bounds;
+		built.BoundingBox(0.0f, 0.0f, bounds);
+		return SameHits(refitted, built, RaysThrough(bounds, 20000, 41));
+	}
+
+	// A tree over still and moving spheres, rects and a box, with some of them moved by Replace and refitted, against
+	// a tree built from scratch over the moved objects. Replacing a sphere with a box then has to rebuild, and still
+	// agree with a fresh build.
+	inline bool BVHRefitMatchesBuild()
+	{
+		Common::Seed({ 43 });
+		HittableList objects;
+		const std::shared_ptr<Material> material = std::make_shared<Lambertian>(Colour(0.5f));
+		for (int idx = 0; idx < 60; idx++)
+		{
+			const Point3 centre = Point3::Random(0.0f, 20.0f);
+			if (idx % 4 == 0)
+			{
+				objects.Add(std::make_shared<MovingSphere>(centre, centre + Vec3::Random(0.0f, 2.0f), 0.0f, 1.0f, 0.7f, material));
+			}
+			else
+			{
+				objects.Add(std::make_shared<Sphere>(centre, 0.7f, material));
+			}
+		}
+		objects.Add(std::make_shared<XZRect>(0.0f, 20.0f, 0.0f, 20.0f, -1.0f, material));
+		objects.Add(std::make_shared<Box>(Point3(8.0f), Point3(11.0f), material));
+
+		BoundingVolumeHierarchy refitted(objects, 0.0f, 1.0f, 2, BoundingVolumeHierarchy::BuildMethod::BinnedSAH, true);
+		std::vector<std::shared_ptr<IHittable>> moved = objects.Objects();
+		const auto built = [&]()
+		{
+			HittableList list;
+			for (const std::shared_ptr<IHittable>& object : moved)
+			{
+				list.Add(object);
+			}
+			return BoundingVolumeHierarchy(list, 0.0f, 1.0f, 2, BoundingVolumeHierarchy::BuildMethod::BinnedSAH);
+		};
+
+		//Small moves, so the refitted tree stays good enough not to be rebuilt
+		for (size_t idx = 0; idx < 60; idx += 3)
+		{
+			const Vec3 offset = Vec3::Random(-1.0f, 1.0f);
+			std::shared_ptr<IHittable> replacement;
+			if (const auto sphere = std::dynamic_pointer_cast<Sphere>(moved[idx]))
+			{
+				replacement = std::make_shared<Sphere>(sphere->Centre() + offset, 0.7f, material);
+			}
+			else if (const auto movingSphere = std::dynamic_pointer_cast<MovingSphere>(moved[idx]))
+			{
+				replacement = std::make_shared<MovingSphere>(movingSphere->Position(0.0f) + offset, movingSphere->Position(1.0f) + offset, 0.0f, 1.0f, 0.7f, material);
+			}
+			moved[idx] = replacement;
+			refitted.Replace(idx, replacement);
+		}
+		moved[61] = std::make_shared<Box>(Point3(9.0f), Point3(12.0f), material);
+		refitted.Replace(61, moved[61]);
+
+		AABB bounds;
+		objects.BoundingBox(0.0f, 1.0f, bounds);
+		const std::vector<Ray> rays = RaysThrough(bounds, 20000, 43);
+		if (refitted.Refit() || !SameHits(refitted, built(), rays, ArithmeticTolerance))
+		{
+			return false;
+		}
+
+		moved[1] = std::make_shared<Box>(Point3(2.0f), Point3(3.0f), material);
+		refitted.Replace(1, moved[1]);
+		return refitted.Refit() && SameHits(refitted, built(), rays, ArithmeticTolerance);
+	}
+
+	// A world holding every kind of object SceneCache stores, saved and loaded again: a moving top level tree, so
+	// moving quantized nodes, over still trees nested in it, instances, transforms and a medium, with materials and
+	// textures shared between them. The loaded world must find the same hits, on materials with the same ids that
+	// give off the same light, and objects that shared a material before must share one after.
+	inline bool SceneCacheRoundTrip()
+	{
+		Common::Seed({ 44 });
+		const std::shared_ptr<Texture> red = std::make_shared<SolidColour>(0.8f, 0.1f, 0.1f);
+		const std::shared_ptr<Texture> checker = std::make_shared<CheckerTexture>(red, std::make_shared<SolidColour>(0.9f));
+		const std::shared_ptr<Material> materials[] = {
+			std::make_shared<Lambertian>(checker), std::make_shared<Metal>(Colour(0.7f), 0.2f), std::make_shared<Dielectric>(1.5f),
+			std::make_shared<DiffuseLight>(checker), std::make_shared<DiffuseLight>(std::make_shared<NoiseTexture>(2.0f)), std::make_shared<Lambertian>(red) };
+		const auto material = [&]() { return materials[static_cast<size_t>(Common::Random(0.0f, 5.99f))]; };
+
+		HittableList cluster;
+		for (int idx = 0; idx < 40; idx++)
+		{
+			cluster.Add(std::make_shared<Sphere>(Point3::Random(0.0f, 8.0f), 0.6f, material()));
+		}
+		const std::shared_ptr<BoundingVolumeHierarchy> nested = std::make_shared<BoundingVolumeHierarchy>(cluster);
+
+		const std::shared_ptr<InstanceHierarchy> instances = std::make_shared<InstanceHierarchy>();
+		for (int idx = 0; idx < 9; idx++)
+		{
+			instances->Add(nested, Matrix3x4::Translation(Vec3((idx % 3) * 12.0f, 15.0f, (idx / 3) * 12.0f)) * Matrix3x4::RotationY(idx * 40.0f));
+		}
+		instances->Build();
+
+		HittableList objects;
+		for (int idx = 0; idx < 30; idx++)
+		{
+			const Point3 centre = Point3::Random(0.0f, 30.0f);
+			objects.Add(std::make_shared<MovingSphere>(centre, centre + Vec3::Random(0.0f, 2.0f), 0.0f, 1.0f, 0.8f, material()));
+		}
+		objects.Add(nested);
+		objects.Add(instances);
+		objects.Add(std::make_shared<XYRect>(0.0f, 30.0f, 0.0f, 30.0f, -2.0f, material()));
+		objects.Add(std::make_shared<XZRect>(0.0f, 30.0f, 0.0f, 30.0f, -2.0f, material()));
+		objects.Add(std::make_shared<YZRect>(0.0f, 30.0f, 0.0f, 30.0f, -2.0f, material()));
+		const std::shared_ptr<IHittable> box = std::make_shared<Box>(Point3(20.0f), Point3(24.0f), material());
+		objects.Add(std::make_shared<Transform>(box, Matrix3x4::Translation(Vec3(-8.0f, 0.0f, 4.0f)) * Matrix3x4::RotationY(30.0f)));
+		objects.Add(std::make_shared<ConstantMedium>(std::make_shared<Box>(Point3(2.0f), Point3(9.0f), material()), 0.3f, checker));
+		const BoundingVolumeHierarchy world(objects, 0.0f, 1.0f, 2, BoundingVolumeHierarchy::BuildMethod::BinnedSAH);
+
+		const std::filesystem::path directory = std::filesystem::temp_directory_path() / "RaytracerSelfTest";
+		const SceneCache cache(directory, SceneCache::KeyFor(-1, BoundingVolumeHierarchy::BuildMethod::BinnedSAH));
+		BoundingVolumeHierarchy loaded;
+		const bool roundTripped = cache.Save(world) && cache.Load(loaded);
+		std::error_code error;
+		std::filesystem::remove_all(directory, error);
+		if (!roundTripped)
+		{
+			return false;
+		}
+
+		AABB bounds;
+		world.BoundingBox(0.0f, 1.0f, bounds);
+		const std::vector<Ray> rays = RaysThrough(bounds, 20000, 44);
+		if (!SameHits(world, loaded, rays))
+		{
+			return false;
+		}
+
+		std::map<uint32_t, const Material*> loadedMaterials;
+		for (const Ray& ray : rays)
+		{
+			HitRecord before, after;
+			if (!world.Hit(ray, 0.001f, Common::Infinity, before) || !loaded.Hit(ray, 0.001f, Common::Infinity, after))
+			{
+				continue;
+			}
+
+			const Material* const shared = loadedMaterials.try_emplace(before.HitMaterial->Id(), after.HitMaterial.get()).first->second;
+			if (after.HitMaterial->Id() != before.HitMaterial->Id() || after.HitMaterial->GetType() != before.HitMaterial->GetType()
+				|| shared != after.HitMaterial.get()
+				|| !Same(after.HitMaterial->Emit(after.U, after.V, after.Position), before.HitMaterial->Emit(before.U, before.V, before.Position)))
+			{
+				return false;
+			}
+		}
+		return !loadedMaterials.empty();
+	}
+
+	// RayQueryScene's Intersect and Occluded against testing every object in a list, for a batch that mixes bundles of
+	// rays from one point, which are traced as packets, with rays that go every which way, which aren't, and for rays
+	// whose intervals differ within a bundle.
+	inline bool RayQueryMatchesList()
+	{
+		Common::Seed({ 50 });
+		HittableList objects;
+		RayQueryScene scene;
+		const std::shared_ptr<Material> materials[] = { std::make_shared<Lambertian>(Colour(0.5f)), std::make_shared<Metal>(Colour(0.8f), 0.1f) };
+		for (int idx = 0; idx < 300; idx++)
+		{
+			const Point3 centre = Point3::Random(0.0f, 20.0f);
+			const std::shared_ptr<Material>& material = materials[idx % 2];
+			std::shared_ptr<IHittable> object;
+			if (idx % 3 == 0)
+			{
+				object = std::make_shared<MovingSphere>(centre, centre + Vec3::Random(0.0f, 1.0f), 0.0f, 1.0f, 0.4f, material);
+			}
+			else
+			{
+				object = std::make_shared<Sphere>(centre, 0.4f, material);
+			}
+			objects.Add(object);
+			scene.Add(object);
+		}
+		objects.Add(std::make_shared<XZRect>(0.0f, 20.0f, 0.0f, 20.0f, -1.0f, materials[0]));
+		scene.Add(objects.Objects().back());
+		scene.Commit(BoundingVolumeHierarchy::BuildMethod::BinnedSAH, 0.0f, 1.0f);
+
+		std::vector<RayIn> rays;
+		for (int bundle = 0; bundle < 300; bundle++)
+		{
+			const Point3 origin = Point3::Random(-10.0f, 30.0f);
+			const Vec3 towards = Point3::Random(0.0f, 20.0f) - origin;
+			const bool coherent = bundle % 2 == 0;
+			for (int idx = 0; idx < 16; idx++)
+			{
+				RayIn ray;
+				ray.Origin = coherent ? origin : Point3::Random(-10.0f, 30.0f);
+				ray.Direction = coherent ? towards + Vec3::Random(-1.0f, 1.0f) : Vec3::Random(-1.0f, 1.0f);
+				ray.Time = Common::Random();
+				if (bundle % 3 == 0)
+				{
+					ray.TMin = idx < 6 ? 0.001f : 0.2f;
+					ray.TMax = idx % 2 == 0 ? Common::Infinity : 0.8f;
+				}
+				rays.push_back(ray);
+			}
+		}
+
+		std::vector<HitOut> hits(rays.size());
+		std::unique_ptr<bool[]> occluded = std::make_unique<bool[]>(rays.size());
+		if (!scene.Intersect(rays, hits) || !scene.Occluded(rays, std::span(occluded.get(), rays.size())))
+		{
+			return false;
+		}
+
+		for (size_t idx = 0; idx < rays.size(); idx++)
+		{
+			const RayIn& in = rays[idx];
+			const Ray ray(in.Origin, in.Direction, in.Time);
+			HitRecord expected;
+			const bool hit = objects.Hit(ray, in.TMin, in.TMax, expected);
+			const HitOut& out = hits[idx];
+			//Grazing rays are skipped here too, since the checks after SameHit's would fail for them the same way
+			if (std::min(hit ? Cosine(in.Direction, expected.Normal) : 1.0f, out.Hit ? Cosine(in.Direction, out.Normal) : 1.0f) < GrazingCosine)
+			{
+				continue;
+			}
+
+			HitRecord found;
+			found.T = out.T;
+			found.Normal = out.Normal;
+			const bool agrees = SameHit(ray, out.Hit, found, hit, expected, ArithmeticTolerance) && occluded[idx] == hit && (hit
+				? out.FrontFace == expected.FrontFace && out.MaterialId == expected.HitMaterial->Id()
+				: out.T == Common::Infinity && Same(out.Position, Point3(0.0f)) && Same(out.Normal, Vec3(0.0f)) && out.MaterialId == UINT32_MAX);
+			if (!agrees)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+}
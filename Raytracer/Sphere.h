@@ -1,11 +1,12 @@
 #pragma once
 
+#include "Archive.h"
 #include "Hittable.h"
 #include "Vec3.h"
 
 #include <tuple>
 
-class Sphere : public IHittable
+class Sphere final : public IHittable
 {
 public:
 	Sphere() {}
@@ -64,6 +65,22 @@ public:
 	Point3 Centre() const { return m_Centre; }
 	float Radius() const { return m_Radius; }
 	std::shared_ptr<Material> Mat() const { return m_Material; }
+
+	bool Serialise(ArchiveWriter& Out) const
+	{
+		Out.Write(m_Centre);
+		Out.Write(m_Radius);
+		Out.WriteMaterial(m_Material);
+		return true;
+	}
+
+	void Deserialise(ArchiveReader& In)
+	{
+		m_Centre = In.Read<Point3>();
+		m_Radius = In.Read<float>();
+		m_Material = In.ReadMaterial();
+	}
+
 private:
 	Point3 m_Centre;
 	float m_Radius;
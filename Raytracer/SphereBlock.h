@@ -0,0 +1,112 @@
+#pragma once
+
+#include "MovingSphere.h"
+#include "Ray.h"
+#include "SIMD.h"
+#include "Sphere.h"
+
+#include <cstdint>
+
+// Up to eight spheres stored one array per component, so a ray is tested against all of them with one pass of Float8
+// arithmetic. Moving spheres keep their first centre, the distance moved and the reciprocal of their time range, and
+// are placed per lane at the ray's time; static spheres have no offset, so their centre comes out exactly.
+struct SphereBlock
+{
+	static constexpr int Width = Float8::Width;
+
+	void Add(const Sphere& S, const uint32_t MaterialIdx)
+	{
+		SetLane(S.Centre(), Vec3(0.0f), 0.0f, 0.0f, S.Radius(), MaterialIdx);
+	}
+
+	void Add(const MovingSphere& S, const uint32_t MaterialIdx)
+	{
+		//A sphere that moves over no time at all stays at its first centre, rather than dividing by zero
+		const float timeRange = S.T1() - S.T0();
+		SetLane(S.Centre0(), S.Centre1() - S.Centre0(), S.T0(), timeRange != 0.0f ? 1.0f / timeRange : 0.0f, S.Radius(), MaterialIdx);
+	}
+
+	Point3 Centre(const int Lane, const float Time) const
+	{
+		const float travelled = (Time - T0[Lane]) * InverseDuration[Lane];
+		return Point3(CentreX[Lane] + (travelled * OffsetX[Lane]), CentreY[Lane] + (travelled * OffsetY[Lane]), CentreZ[Lane] + (travelled * OffsetZ[Lane]));
+	}
+
+	// Same test as Sphere::Hit for every lane at once. Returns the lane with the nearest root in [TMin, TMax] and
+	// writes that root to OutT, or returns -1 when nothing is hit.
+	int Intersect(const Ray& R, const float TMin, const float TMax, float& OutT) const
+	{
+		const Float8 travelled = (Float8(R.Time()) - Float8::Load(T0)) * Float8::Load(InverseDuration);
+		const Float8 centreX = Float8::Load(CentreX) + (travelled * Float8::Load(OffsetX));
+		const Float8 centreY = Float8::Load(CentreY) + (travelled * Float8::Load(OffsetY));
+		const Float8 centreZ = Float8::Load(CentreZ) + (travelled * Float8::Load(OffsetZ));
+
+		const Float8 ocX = Float8(R.Origin().x()) - centreX;
+		const Float8 ocY = Float8(R.Origin().y()) - centreY;
+		const Float8 ocZ = Float8(R.Origin().z()) - centreZ;
+		const Float8 directionX(R.Direction().x()), directionY(R.Direction().y()), directionZ(R.Direction().z());
+
+		const Float8 a(R.Direction().LengthSq());
+		const Float8 halfB = (ocX * directionX) + (ocY * directionY) + (ocZ * directionZ);
+		const Float8 c = ((ocX * ocX) + (ocY * ocY) + (ocZ * ocZ)) - Float8::Load(RadiusSq);
+		const Float8 discriminant = (halfB * halfB) - (a * c);
+		const Float8 sqrtD = Sqrt(Max(discriminant, Float8(0.0f)));
+
+		const Float8 tMin(TMin), tMax(TMax);
+		const Float8 nearRoot = (-halfB - sqrtD) / a;
+		const Float8 farRoot = (-halfB + sqrtD) / a;
+		const Float8 nearInRange = (nearRoot >= tMin) & (nearRoot <= tMax);
+		const Float8 farInRange = (farRoot >= tMin) & (farRoot <= tMax);
+
+		const int hits = MoveMask((discriminant >= Float8(0.0f)) & (nearInRange | farInRange)) & ((1 << Count) - 1);
+		if (hits == 0)
+		{
+			return -1;
+		}
+
+		alignas(32) float roots[Width];
+		Select(nearInRange, nearRoot, farRoot).Store(roots);
+
+		int nearest = -1;
+		for (int lane = 0; lane < Count; lane++)
+		{
+			if (((hits >> lane) & 1) && (nearest < 0 || roots[lane] < roots[nearest]))
+			{
+				nearest = lane;
+			}
+		}
+
+		OutT = roots[nearest];
+		return nearest;
+	}
+
+	alignas(32) float CentreX[Width] = {};
+	alignas(32) float CentreY[Width] = {};
+	alignas(32) float CentreZ[Width] = {};
+	alignas(32) float OffsetX[Width] = {};
+	alignas(32) float OffsetY[Width] = {};
+	alignas(32) float OffsetZ[Width] = {};
+	alignas(32) float T0[Width] = {};
+	alignas(32) float InverseDuration[Width] = {};
+	alignas(32) float RadiusSq[Width] = {};
+	alignas(32) float InverseRadius[Width] = {};
+	uint32_t Materials[Width] = {};	//Indices into the owner's material table
+	int Count = 0;
+
+private:
+	void SetLane(const Point3& Centre, const Vec3& Offset, const float StartTime, const float InverseTimeRange, const float Radius, const uint32_t MaterialIdx)
+	{
+		const int lane = Count++;
+		CentreX[lane] = Centre.x();
+		CentreY[lane] = Centre.y();
+		CentreZ[lane] = Centre.z();
+		OffsetX[lane] = Offset.x();
+		OffsetY[lane] = Offset.y();
+		OffsetZ[lane] = Offset.z();
+		T0[lane] = StartTime;
+		InverseDuration[lane] = InverseTimeRange;
+		RadiusSq[lane] = Radius * Radius;
+		InverseRadius[lane] = 1.0f / Radius;
+		Materials[lane] = MaterialIdx;
+	}
+};
@@ -1,16 +1,35 @@
 #pragma once
 
+#include "Archive.h"
 #include "Common.h"
 #include "Perlin.h"
 #include "StbImg.h"
 
+#include <memory>
+#include <string>
+
 class Texture
 {
 public:
+	enum class Type { None, Solid, Checker, Noise, Image };
+
 	virtual Colour Value(float u, float v, const Point3& p) const = 0;
+	virtual Type GetType() const = 0;
+
+	// Writes the type and then the texture's own fields, which Deserialise makes a texture of that type from.
+	void Serialise(ArchiveWriter& Out) const
+	{
+		Out.Write(GetType());
+		SerialiseFields(Out);
+	}
+
+	static std::shared_ptr<Texture> Deserialise(ArchiveReader& In);
+
+protected:
+	virtual void SerialiseFields(ArchiveWriter& Out) const = 0;
 };
 
-class SolidColour : public Texture
+class SolidColour final : public Texture
 {
 public:
 	SolidColour() {}
@@ -18,11 +37,19 @@ public:
 	SolidColour(const float R, const float G, const float B) : m_Colour(R, G, B) {}
 
 	virtual Colour Value(float u, float v, const Point3& p) const override { return m_Colour; }
+	virtual Type GetType() const override { return Type::Solid; }
+
+	static std::shared_ptr<SolidColour> DeserialiseFields(ArchiveReader& In) { return std::make_shared<SolidColour>(In.Read<Colour>()); }
+
+protected:
+	virtual void SerialiseFields(ArchiveWriter& Out) const override { Out.Write(m_Colour); }
+
 private:
+
 	Colour m_Colour;
 };
 
-class CheckerTexture : public Texture
+class CheckerTexture final : public Texture
 {
 public:
 	CheckerTexture() {}
@@ -41,11 +68,28 @@ public:
 			return m_Even->Value(u, v, p);
 		}
 	}
+
+	virtual Type GetType() const override { return Type::Checker; }
+
+	static std::shared_ptr<CheckerTexture> DeserialiseFields(ArchiveReader& In)
+	{
+		const std::shared_ptr<Texture> even = In.ReadTexture();
+		return std::make_shared<CheckerTexture>(even, In.ReadTexture());
+	}
+
+protected:
+	virtual void SerialiseFields(ArchiveWriter& Out) const override
+	{
+		Out.WriteTexture(m_Even);
+		Out.WriteTexture(m_Odd);
+	}
+
 private:
+
 	std::shared_ptr<Texture> m_Even, m_Odd;
 };
 
-class NoiseTexture : public Texture
+class NoiseTexture final : public Texture
 {
 public:
 	NoiseTexture(){}
@@ -56,16 +100,33 @@ public:
 		return Colour(1.0f) * 0.5f * (1.0f + std::sin((m_Scale*p.z()) + (10.0f * m_Noise.Turbulence(p * m_Scale))));
 	}
 
+	virtual Type GetType() const override { return Type::Noise; }
+
+	static std::shared_ptr<NoiseTexture> DeserialiseFields(ArchiveReader& In)
+	{
+		const auto noise = std::make_shared<NoiseTexture>(In.Read<float>());
+		noise->m_Noise.Deserialise(In);
+		return noise;
+	}
+
+protected:
+	virtual void SerialiseFields(ArchiveWriter& Out) const override
+	{
+		Out.Write(m_Scale);
+		m_Noise.Serialise(Out);
+	}
+
 private:
+
 	Perlin m_Noise;
 	float m_Scale;
 };
 
-class ImageTexture : public Texture
+class ImageTexture final : public Texture
 {
 public:
 	ImageTexture() {}
-	ImageTexture(const char* FileName)
+	ImageTexture(const char* FileName) : m_FileName(FileName)
 	{
 		int componentsPerPixel = m_BytesPerPixel;
 
@@ -105,10 +166,34 @@ public:
 		return Colour{ colourScale * pixel[0], colourScale * pixel[1], colourScale * pixel[2] };
 	}
 
+	Type GetType() const override { return Type::Image; }
+
+	static std::shared_ptr<ImageTexture> DeserialiseFields(ArchiveReader& In) { return std::make_shared<ImageTexture>(In.ReadString().c_str()); }
+
+protected:
+	//The pixels are left in the image file, which is loaded again from where it was found
+	virtual void SerialiseFields(ArchiveWriter& Out) const override { Out.WriteString(m_FileName); }
+
 private:
+
+	std::string m_FileName;
 	unsigned char* m_Data;
 	int m_Width, m_Height;
 	int m_BytesPerScanline;
 
 	static constexpr int m_BytesPerPixel = 3;
-};
\ No newline at end of file
+};
+
+inline std::shared_ptr<Texture> Texture::Deserialise(ArchiveReader& In)
+{
+	switch (In.Read<Type>())
+	{
+	case Type::Solid:	return SolidColour::DeserialiseFields(In);
+	case Type::Checker:	return CheckerTexture::DeserialiseFields(In);
+	case Type::Noise:	return NoiseTexture::DeserialiseFields(In);
+	case Type::Image:	return ImageTexture::DeserialiseFields(In);
+	default:
+		In.Failed = true;
+		return nullptr;
+	}
+}
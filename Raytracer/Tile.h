@@ -0,0 +1,11 @@
+#pragma once
+
+// Half-open pixel rectangle [X0, X1) x [Y0, Y1).
+struct Tile
+{
+	int X0, Y0, X1, Y1;
+
+	int Width() const { return X1 - X0; }
+	int Height() const { return Y1 - Y0; }
+	int PixelCount() const { return Width() * Height(); }
+};
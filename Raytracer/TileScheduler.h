@@ -0,0 +1,121 @@
+#pragma once
+
+#include "Tile.h"
+
+#include <algorithm>
+#include <atomic>
+#include <numeric>
+#include <thread>
+#include <vector>
+
+namespace Parallel
+{
+	inline int ThreadCount()
+	{
+		const unsigned int hardwareThreads = std::thread::hardware_concurrency();
+		return hardwareThreads > 0 ? static_cast<int>(hardwareThreads) : 4;
+	}
+
+	// Calls Body(idx) for every idx in [0, Count), handing indices out in order to whichever thread is free next.
+	template<typename Function>
+	void For(const size_t Count, const Function& Body)
+	{
+		std::atomic<size_t> next{ 0 };
+		auto worker = [&]()
+		{
+			for (size_t idx = next++; idx < Count; idx = next++)
+			{
+				Body(idx);
+			}
+		};
+
+		const size_t threadCount = std::min(static_cast<size_t>(ThreadCount()), Count);
+		std::vector<std::thread> threads;
+		for (size_t threadIdx = 1; threadIdx < threadCount; threadIdx++)
+		{
+			threads.emplace_back(worker);
+		}
+
+		worker();
+		for (std::thread& thread : threads)
+		{
+			thread.join();
+		}
+	}
+}
+
+namespace Tiles
+{
+	// Cuts Region along a TileSize grid anchored at the image origin, so the same pixels always land in the same tile.
+	inline std::vector<Tile> Split(const Tile& Region, const int TileSize)
+	{
+		std::vector<Tile> tiles;
+		const int firstY = (Region.Y0 / TileSize) * TileSize;
+		const int firstX = (Region.X0 / TileSize) * TileSize;
+		for (int y = firstY; y < Region.Y1; y += TileSize)
+		{
+			for (int x = firstX; x < Region.X1; x += TileSize)
+			{
+				tiles.push_back({ std::max(x, Region.X0), std::max(y, Region.Y0), std::min(x + TileSize, Region.X1), std::min(y + TileSize, Region.Y1) });
+			}
+		}
+
+		return tiles;
+	}
+
+	inline std::vector<Tile> Quarter(const Tile& T)
+	{
+		const int midX = T.X0 + std::max(T.Width() / 2, 1);
+		const int midY = T.Y0 + std::max(T.Height() / 2, 1);
+
+		std::vector<Tile> quarters;
+		for (const Tile& candidate : { Tile{ T.X0, T.Y0, midX, midY }, Tile{ midX, T.Y0, T.X1, midY }, Tile{ T.X0, midY, midX, T.Y1 }, Tile{ midX, midY, T.X1, T.Y1 } })
+		{
+			if (candidate.PixelCount() > 0)
+			{
+				quarters.push_back(candidate);
+			}
+		}
+
+		return quarters;
+	}
+
+	// Longest-processing-time-first order from measured per-tile costs. Tiles costing more than SplitFactor times
+	// the mean are quartered first, so the most expensive work isn't left as one big tile at the end of the frame.
+	inline std::vector<Tile> Schedule(const std::vector<Tile>& Tiles, const std::vector<double>& Costs, const double SplitFactor)
+	{
+		const double meanCost = Tiles.empty() ? 0.0 : std::accumulate(Costs.begin(), Costs.end(), 0.0) / Tiles.size();
+
+		std::vector<Tile> scheduled;
+		std::vector<double> scheduledCosts;
+		for (size_t idx = 0; idx < Tiles.size(); idx++)
+		{
+			if (SplitFactor > 0.0 && Costs[idx] > SplitFactor * meanCost && Tiles[idx].PixelCount() > 1)
+			{
+				for (const Tile& quarter : Quarter(Tiles[idx]))
+				{
+					scheduled.push_back(quarter);
+					scheduledCosts.push_back(Costs[idx] * quarter.PixelCount() / Tiles[idx].PixelCount());
+				}
+			}
+			else
+			{
+				scheduled.push_back(Tiles[idx]);
+				scheduledCosts.push_back(Costs[idx]);
+			}
+		}
+
+		std::vector<size_t> order(scheduled.size());
+		std::iota(order.begin(), order.end(), size_t{ 0 });
+		std::stable_sort(order.begin(), order.end(), [&](const size_t A, const size_t B) { return scheduledCosts[A] > scheduledCosts[B]; });
+
+		std::vector<Tile> result;
+		result.reserve(order.size());
+		for (const size_t idx : order)
+		{
+			result.push_back(scheduled[idx]);
+		}
+
+		return result;
+	}
+}
@@ -0,0 +1,318 @@
+#pragma once
+
+#include "AABB.h"
+#include "BVHStats.h"
+#include "BoundingVolumeHierarchy.h"
+#include "Camera.h"
+#include "Common.h"
+#include "Framebuffer.h"
+#include "Material.h"
+#include "Ray.h"
+#include "RayPacket.h"
+#include "TileScheduler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+// Traces a tile breadth-first. A pool of paths is advanced one bounce at a time by separate stages that each loop
+// over the whole pool: generate camera rays, sort the ray stream, extend (intersect), shade, and accumulate finished
+// paths. Sorting rays by direction octant and origin before intersecting keeps packets coherent after the first
+// bounce, and grouping hits by material before shading runs the same material code back to back. Every path keeps its
+// own random generator, seeded as TraceTile seeds TracePath's and swapped in while the path is shaded, so a path's
+// random numbers don't depend on the order the stages visit paths in.
+//
+// There is no shadow ray stage because the renderer has no light sampling; emitters are only found by scattering.
+class WavefrontIntegrator
+{
+public:
+	explicit WavefrontIntegrator(const size_t PoolSize = 1 << 14) : m_PoolSize(PoolSize) {}
+
+	// Adds samples SampleStart to SampleStart + SampleCount - 1 of every pixel of Region to Result, each pixel's in
+	// order, like TraceTile.
+	void Render(const Tile& Region, const int SampleStart, const int SampleCount, const Camera& Camera, const BoundingVolumeHierarchy& World,
+		const Colour& Background, const int MaxDepth, const int ImageWidth, const int ImageHeight, Framebuffer& Result)
+	{
+		AABB bounds(Point3(-1.0f), Point3(1.0f));
+		World.BoundingBox(0.0f, 1.0f, bounds);
+
+		//The pool holds whole waves of samples for every pixel in the tile
+		const int samplesPerWave = std::max(1, static_cast<int>(m_PoolSize / Region.PixelCount()));
+		for (int sampleOffset = 0; sampleOffset < SampleCount; sampleOffset += samplesPerWave)
+		{
+			m_SamplesPerPixel = std::min(samplesPerWave, SampleCount - sampleOffset);
+			Generate(Region, SampleStart + sampleOffset, Camera, ImageWidth, ImageHeight);
+
+			//Every path in a wave starts together, so they are all on the same bounce
+			for (int bounce = 0; !m_Active.empty(); bounce++)
+			{
+				Sort(bounds);
+				BVH_STAT(BVHStats::BeginRays(bounce, m_Active.size()));
+				Extend(World);
+				Shade(Background, bounce, MaxDepth);
+			}
+
+			//Only once the whole wave has finished, so each pixel's samples are added in order
+			Accumulate(Region, Result);
+		}
+	}
+
+	// Prints how many hits of each material type were shaded and how fast, over every wavefront render in this process.
+	static void ReportShading(std::ostream& Out)
+	{
+		for (int type = 0; type < static_cast<int>(Material::Type::Count); type++)
+		{
+			const uint64_t hits = m_ShadedHits[type];
+			const double seconds = static_cast<double>(m_ShadingNanoseconds[type]) * 1e-9;
+			if (hits == 0)
+			{
+				continue;
+			}
+
+			Out << "\nShaded " << Material::TypeName(static_cast<Material::Type>(type)) << ": " << hits << " hits, "
+				<< (seconds > 0.0 ? static_cast<double>(hits) / seconds * 1e-6 : 0.0) << " Mhits/s";
+		}
+	}
+
+private:
+	void Generate(const Tile& Region, const int FirstSample, const Camera& Camera, const int ImageWidth, const int ImageHeight)
+	{
+		const size_t count = static_cast<size_t>(Region.PixelCount()) * m_SamplesPerPixel;
+		m_Rays = m_RayBuffer.View(count);
+		Camera.GenerateRays(Region, FirstSample, m_SamplesPerPixel, ImageWidth, ImageHeight, m_Rays);
+
+		m_Generators.resize(count);
+		for (size_t idx = 0; idx < count; idx++)
+		{
+			const int pixel = static_cast<int>(idx / m_SamplesPerPixel);
+			const int sample = FirstSample + static_cast<int>(idx % m_SamplesPerPixel);
+			Common::SeedSample(Region.X0 + (pixel % Region.Width()), Region.Y0 + (pixel / Region.Width()), sample, Common::SampleStream::Path);
+			m_Generators[idx] = Common::Generator();
+		}
+
+		m_ThroughputR.assign(count, 1.0f);
+		m_ThroughputG.assign(count, 1.0f);
+		m_ThroughputB.assign(count, 1.0f);
+		m_Samples.assign(count, PathSample());
+		m_Hits.resize(count);
+		m_HasHit.assign(count, 0);
+
+		m_Active.resize(count);
+		for (size_t idx = 0; idx < count; idx++)
+		{
+			m_Active[idx] = static_cast<uint32_t>(idx);
+		}
+	}
+
+	// Orders the live rays by direction octant, then along a Morton curve through their origins.
+	void Sort(const AABB& Bounds)
+	{
+		const Vec3 extent = Bounds.Max() - Bounds.Min();
+		m_SortBuffer.clear();
+		for (const uint32_t idx : m_Active)
+		{
+			const uint32_t octant = (m_Rays.DirectionX[idx] < 0.0f ? 1u : 0u) | (m_Rays.DirectionY[idx] < 0.0f ? 2u : 0u) | (m_Rays.DirectionZ[idx] < 0.0f ? 4u : 0u);
+			const uint32_t cellX = Quantise(m_Rays.OriginX[idx], Bounds.Min().x(), extent.x());
+			const uint32_t cellY = Quantise(m_Rays.OriginY[idx], Bounds.Min().y(), extent.y());
+			const uint32_t cellZ = Quantise(m_Rays.OriginZ[idx], Bounds.Min().z(), extent.z());
+			const uint64_t key = (static_cast<uint64_t>(octant) << 30) | (SpreadBits(cellX) | (SpreadBits(cellY) << 1) | (SpreadBits(cellZ) << 2));
+			m_SortBuffer.emplace_back(key, idx);
+		}
+
+		//Ties are broken by path index, so the order (and the random numbers drawn in it) is deterministic
+		std::sort(m_SortBuffer.begin(), m_SortBuffer.end());
+		for (size_t idx = 0; idx < m_SortBuffer.size(); idx++)
+		{
+			m_Active[idx] = m_SortBuffer[idx].second;
+		}
+	}
+
+	void Extend(const BoundingVolumeHierarchy& World)
+	{
+		constexpr int packetSize = 8;
+		for (size_t first = 0; first < m_Active.size(); first += packetSize)
+		{
+			const int count = static_cast<int>(std::min<size_t>(packetSize, m_Active.size() - first));
+			RayPacket<packetSize> packet(m_Rays, m_Active.data() + first, count, 0.001f);
+			HitRecord hits[packetSize];
+			const uint32_t hitMask = World.HitPacket(packet, hits);
+
+			for (int lane = 0; lane < count; lane++)
+			{
+				const uint32_t idx = m_Active[first + lane];
+				m_HasHit[idx] = (hitMask >> lane) & 1u;
+				//A miss's record is never read, so only hits are worth moving
+				if (m_HasHit[idx])
+				{
+					m_Hits[idx] = std::move(hits[lane]);
+				}
+			}
+		}
+	}
+
+	// Same bookkeeping as one iteration of TracePath's bounce loop. Hits are sorted by material type, texture type and
+	// material, and each run of one type is shaded by a loop specialised for it, so the calls inside need no virtual
+	// dispatch and the branch predictor and instruction cache see one material's code at a time.
+	void Shade(const Colour& Background, const int Bounce, const int MaxDepth)
+	{
+		m_SortBuffer.clear();
+		for (const uint32_t idx : m_Active)
+		{
+			uint64_t key = 0; //Misses sort first
+			if (m_HasHit[idx])
+			{
+				const Material& material = *m_Hits[idx].HitMaterial;
+				key = ((static_cast<uint64_t>(material.GetType()) + 1) << 40) | (static_cast<uint64_t>(material.GetTextureType()) << 32) | material.Id();
+			}
+			m_SortBuffer.emplace_back(key, idx);
+		}
+		std::sort(m_SortBuffer.begin(), m_SortBuffer.end());
+
+		m_Active.clear();
+		for (size_t begin = 0; begin < m_SortBuffer.size();)
+		{
+			const uint64_t group = m_SortBuffer[begin].first >> 40;
+			size_t end = begin + 1;
+			while (end < m_SortBuffer.size() && (m_SortBuffer[end].first >> 40) == group)
+			{
+				end++;
+			}
+
+			if (group == 0)
+			{
+				ShadeMisses(begin, end, Background, Bounce);
+			}
+			else
+			{
+				switch (static_cast<Material::Type>(group - 1))
+				{
+				case Material::Type::Lambertian:	ShadeGroup<Lambertian>(begin, end, Bounce, MaxDepth); break;
+				case Material::Type::Metal:			ShadeGroup<Metal>(begin, end, Bounce, MaxDepth); break;
+				case Material::Type::Dielectric:	ShadeGroup<Dielectric>(begin, end, Bounce, MaxDepth); break;
+				case Material::Type::DiffuseLight:	ShadeGroup<DiffuseLight>(begin, end, Bounce, MaxDepth); break;
+				case Material::Type::Isotropic:		ShadeGroup<Isotropic>(begin, end, Bounce, MaxDepth); break;
+				default: break;
+				}
+			}
+
+			begin = end;
+		}
+	}
+
+	void ShadeMisses(const size_t Begin, const size_t End, const Colour& Background, const int Bounce)
+	{
+		for (size_t entry = Begin; entry < End; entry++)
+		{
+			const uint32_t idx = m_SortBuffer[entry].second;
+			PathSample& sample = m_Samples[idx];
+			Colour& contribution = Bounce <= 1 ? sample.Direct : sample.Indirect;
+
+			contribution += Throughput(idx) * Background;
+			if (Bounce == 0)
+			{
+				sample.Albedo = Background;
+			}
+		}
+	}
+
+	template<typename MaterialType>
+	void ShadeGroup(const size_t Begin, const size_t End, const int Bounce, const int MaxDepth)
+	{
+		const auto start = std::chrono::steady_clock::now();
+
+		for (size_t entry = Begin; entry < End; entry++)
+		{
+			const uint32_t idx = m_SortBuffer[entry].second;
+			const HitRecord& hit = m_Hits[idx];
+			//MaterialType is final, so these calls are resolved at compile time
+			const MaterialType& material = static_cast<const MaterialType&>(*hit.HitMaterial);
+			PathSample& sample = m_Samples[idx];
+			Colour& contribution = Bounce <= 1 ? sample.Direct : sample.Indirect;
+
+			const Ray ray = m_Rays.Get(idx);
+			Ray scattered;
+			Colour attenuation;
+			const Colour emitted = material.Emit(hit.U, hit.V, hit.Position);
+			Common::Generator() = m_Generators[idx];
+			const bool scatters = material.Scatter(ray, hit, attenuation, scattered);
+			m_Generators[idx] = Common::Generator();
+			contribution += Throughput(idx) * emitted;
+
+			if (Bounce == 0)
+			{
+				sample.Albedo = scatters ? attenuation : emitted;
+				sample.Normal = hit.Normal;
+				sample.Depth = hit.T * ray.Direction().Length();
+				sample.MaterialId = material.Id();
+			}
+
+			if (!scatters || Bounce + 1 >= MaxDepth)
+			{
+				continue;
+			}
+
+			m_ThroughputR[idx] *= attenuation.x();
+			m_ThroughputG[idx] *= attenuation.y();
+			m_ThroughputB[idx] *= attenuation.z();
+			m_Rays.Set(idx, scattered);
+			m_Active.push_back(idx);
+		}
+
+		const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+		const int type = static_cast<int>(m_Hits[m_SortBuffer[Begin].second].HitMaterial->GetType());
+		m_ShadedHits[type] += End - Begin;
+		m_ShadingNanoseconds[type] += static_cast<uint64_t>(elapsed.count());
+	}
+
+	Colour Throughput(const uint32_t Idx) const { return Colour(m_ThroughputR[Idx], m_ThroughputG[Idx], m_ThroughputB[Idx]); }
+
+	void Accumulate(const Tile& Region, Framebuffer& Result)
+	{
+		//Path indices run pixel by pixel with samples innermost, matching Camera::GenerateRays
+		for (size_t idx = 0; idx < m_Samples.size(); idx++)
+		{
+			const int pixel = static_cast<int>(idx / m_SamplesPerPixel);
+			Result.AddSample(pixel % Region.Width(), pixel / Region.Width(), m_Samples[idx]);
+		}
+	}
+
+	static uint32_t Quantise(const float Value, const float Min, const float Extent)
+	{
+		const float cell = Extent > 0.0f ? ((Value - Min) / Extent) * 1023.0f : 0.0f;
+		return static_cast<uint32_t>(std::clamp(cell, 0.0f, 1023.0f));
+	}
+
+	// Spaces the low 10 bits of V three apart, so three of them interleave into a 30 bit Morton code.
+	static uint64_t SpreadBits(uint64_t V)
+	{
+		V = (V | (V << 16)) & 0x030000FFull;
+		V = (V | (V << 8)) & 0x0300F00Full;
+		V = (V | (V << 4)) & 0x030C30C3ull;
+		V = (V | (V << 2)) & 0x09249249ull;
+		return V;
+	}
+
+	size_t m_PoolSize;
+	int m_SamplesPerPixel = 1;
+
+	//Path state, indexed by path
+	RayBatchBuffer m_RayBuffer;
+	RayBatch m_Rays;
+	std::vector<float> m_ThroughputR, m_ThroughputG, m_ThroughputB;
+	std::vector<PathSample> m_Samples;
+	std::vector<HitRecord> m_Hits;
+	std::vector<uint8_t> m_HasHit;
+	std::vector<Common::RandomEngine> m_Generators;
+
+	//Streams of path indices passed between stages
+	std::vector<uint32_t> m_Active;
+	std::vector<std::pair<uint64_t, uint32_t>> m_SortBuffer;
+
+	//Shading throughput, shared by the integrators on every thread
+	inline static std::atomic<uint64_t> m_ShadedHits[static_cast<int>(Material::Type::Count)] = {};
+	inline static std::atomic<uint64_t> m_ShadingNanoseconds[static_cast<int>(Material::Type::Count)] = {};
+};